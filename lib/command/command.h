@@ -10,13 +10,14 @@
  * 1. The RenderPass uses these classes:
  *    * RenderPass
  *    * Pipeline
+ *    * PipelineCache
  *    * PipelineCreateInfo
  *    * PipelineStage
  *    * Shader
  *
  * 2. The Semaphore (with PresentSemaphore), Fence, and Event classes.
  *
- * 3. The CommandPool and CommandBuilder classes.
+ * 3. The CommandPool, CommandBuilder, and ParallelBuilder classes.
  */
 
 #include <lib/language/VkInit.h>
@@ -26,6 +27,8 @@
 // vk_enum_string_helper.h is not in the default vulkan installation, but is
 // generated by the gn/vendor/VulkanSamples/BUILD.gn file in this repo.
 #include <vulkan/vk_enum_string_helper.h>
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
@@ -173,8 +176,10 @@ typedef struct PipelineCreateInfo {
 
   // Use vkCreateDescriptorSetLayout to create layouts, which then
   // auto-generates VkPipelineLayoutCreateInfo.
-  // TODO: Add pushConstants.
   std::vector<VkDescriptorSetLayout> setLayouts;
+  // pushConstants are the ranges CommandBuilder::pushConstants() can write.
+  // science::ShaderLibrary::stage() fills them in from the shaders.
+  std::vector<VkPushConstantRange> pushConstants;
 
   std::vector<VkDynamicState> dynamicStates;
 
@@ -191,6 +196,47 @@ typedef struct PipelineCreateInfo {
   VkSubpassDescription subpassDesc;
 } PipelineCreateInfo;
 
+// PipelineCache wraps a VkPipelineCache and saves it to a file, so the driver
+// does not have to recompile every pipeline on the next launch.
+//
+// The file is only used if it was written by the same driver on the same
+// device: the file header records physProp.vendorID, deviceID, driverVersion
+// and pipelineCacheUUID, and the Vulkan header inside the data is checked as
+// well. A missing or stale file is not an error; the cache just starts empty.
+//
+// Example usage:
+//   command::PipelineCache cache(dev);
+//   if (cache.ctorError(dev, "pipeline.cache")) { ... }
+//   renderPass.pipelineCache = &cache;
+//   ...
+//   if (cache.save(dev)) { ... }  // Before shutting down.
+typedef struct PipelineCache {
+  PipelineCache(language::Device& dev) : vk{dev.dev, vkDestroyPipelineCache} {
+    vk.allocator = dev.dev.allocator;
+  }
+  PipelineCache(PipelineCache&&) = default;
+  PipelineCache(const PipelineCache&) = delete;
+
+  // Two-stage constructor: check the return code of ctorError().
+  // ctorError() creates the VkPipelineCache, loading filename if it is valid.
+  WARN_UNUSED_RESULT int ctorError(language::Device& dev,
+                                   std::string filename);
+
+  // save() writes the cache to filename. It writes a temporary file and
+  // renames it over filename, so a crash never leaves a truncated file.
+  WARN_UNUSED_RESULT int save(language::Device& dev);
+
+  std::string filename;
+  VkPtr<VkPipelineCache> vk;
+} PipelineCache;
+
+// makePipelineLayout creates the VkPipelineLayout shared by Pipeline and
+// ComputePipeline.
+WARN_UNUSED_RESULT int makePipelineLayout(
+    language::Device& dev, const std::vector<VkDescriptorSetLayout>& setLayouts,
+    const std::vector<VkPushConstantRange>& pushConstants,
+    VkPtr<VkPipelineLayout>& pipelineLayout);
+
 // Pipeline represents a VkPipeline and VkPipelineLayout pair.
 typedef struct Pipeline {
   Pipeline(language::Device& dev);
@@ -217,6 +263,44 @@ typedef struct Pipeline {
                                       RenderPass& renderPass, size_t subpass_i);
 } Pipeline;
 
+// ComputePipeline represents a VkPipeline and VkPipelineLayout pair that runs
+// a single compute Shader. It is not part of a RenderPass: record it outside
+// a render pass with CommandBuilder::bindComputePipelineAndDescriptors() and
+// CommandBuilder::dispatch(). Since it needs no RenderPass or swapChain, it
+// also works on a headless Device, such as a software Vulkan ICD.
+//
+// Example usage:
+//   command::ComputePipeline cull(dev);
+//   cull.shader = std::make_shared<command::Shader>(dev);
+//   if (cull.shader->loadSPV(spv_cull_comp, sizeof(spv_cull_comp))) { ... }
+//   cull.setLayouts.emplace_back(layout.vk);
+//   if (cull.ctorError(dev, renderPass.pipelineCache)) { ... }
+//
+// Or use science::ShaderLibrary::stage() to set shader, and
+// science::DescriptorLibrary::makeSet() to add setLayouts.
+typedef struct ComputePipeline {
+  ComputePipeline(language::Device& dev);
+  ComputePipeline(ComputePipeline&&) = default;
+  ComputePipeline(const ComputePipeline& other) = delete;
+  virtual ~ComputePipeline();
+
+  // Two-stage constructor: check the return code of ctorError().
+  // cache is optional. Pass the RenderPass's pipelineCache to keep compute
+  // and graphics pipelines in one cache file.
+  WARN_UNUSED_RESULT int ctorError(language::Device& dev,
+                                   PipelineCache* cache = nullptr);
+
+  std::shared_ptr<Shader> shader;
+  std::string entryPointName{"main"};
+  std::vector<VkDescriptorSetLayout> setLayouts;
+  // pushConstants are the ranges CommandBuilder::pushConstants() can write.
+  // science::ShaderLibrary::stage() fills them in from the shader.
+  std::vector<VkPushConstantRange> pushConstants;
+
+  VkPtr<VkPipelineLayout> pipelineLayout;
+  VkPtr<VkPipeline> vk;
+} ComputePipeline;
+
 // RenderPass is the main object to set up and control presenting pixels to the
 // screen.
 //
@@ -256,6 +340,10 @@ typedef struct RenderPass {
 
   VkRenderPassCreateInfo rpci;
 
+  // pipelineCache is optional. If it is set, ctorError() uses it to create
+  // every Pipeline.
+  PipelineCache* pipelineCache{nullptr};
+
   // Override this function to customize the subpass dependencies.
   // The default just executes subpasses serially (in order).
   WARN_UNUSED_RESULT virtual int getSubpassDeps(
@@ -324,7 +412,23 @@ typedef struct Fence {
     vk.allocator = dev.dev.allocator;
   }
   // Two-stage constructor: check the return code of ctorError().
-  WARN_UNUSED_RESULT int ctorError(language::Device& dev);
+  // Pass VK_FENCE_CREATE_SIGNALED_BIT in flags to create the fence already
+  // signalled, so the first wait() returns immediately.
+  WARN_UNUSED_RESULT int ctorError(language::Device& dev,
+                                   VkFenceCreateFlags flags = 0);
+
+  // wait() calls vkWaitForFences() and returns non-zero on error or timeout.
+  WARN_UNUSED_RESULT int wait(language::Device& dev,
+                              uint64_t timeoutNanos = UINT64_MAX);
+
+  // reset() calls vkResetFences() to unsignal the fence.
+  WARN_UNUSED_RESULT int reset(language::Device& dev);
+
+  // getStatus() calls vkGetFenceStatus(), which returns VK_SUCCESS if the
+  // fence is signalled and VK_NOT_READY if it is not.
+  VkResult getStatus(language::Device& dev) {
+    return vkGetFenceStatus(dev.dev, vk);
+  }
 
   VkPtr<VkFence> vk;
 } Fence;
@@ -342,6 +446,29 @@ typedef struct Event {
   VkPtr<VkEvent> vk;
 } Event;
 
+// QueryPool holds a VkQueryPool, such as the timestamps used by GpuProfiler.
+typedef struct QueryPool {
+  QueryPool(language::Device& dev) : vk{dev.dev, vkDestroyQueryPool} {
+    vk.allocator = dev.dev.allocator;
+  }
+  // Two-stage constructor: check the return code of ctorError().
+  // pipelineStatistics is only used if type is
+  // VK_QUERY_TYPE_PIPELINE_STATISTICS.
+  WARN_UNUSED_RESULT int ctorError(
+      language::Device& dev, VkQueryType type, uint32_t count,
+      VkQueryPipelineStatisticFlags pipelineStatistics = 0);
+
+  // getResults() calls vkGetQueryPoolResults() for 64-bit results. Without
+  // VK_QUERY_RESULT_WAIT_BIT in flags it returns VK_NOT_READY if any of the
+  // queries are not available yet, and does not block.
+  VkResult getResults(language::Device& dev, uint32_t first, uint32_t n,
+                      std::vector<uint64_t>& results,
+                      VkQueryResultFlags flags = 0);
+
+  uint32_t count{0};
+  VkPtr<VkQueryPool> vk;
+} QueryPool;
+
 // CommandPool holds a reference to the VkCommandPool from which commands are
 // allocated. Create a CommandPool instance in each thread that submits
 // commands to qfam_i.
@@ -420,7 +547,7 @@ class CommandBuilder {
   VkCommandBuffer buf = VK_NULL_HANDLE;
 
   int alloc() {
-    if (cpool.alloc(bufs)) {
+    if (cpool.alloc(bufs, level)) {
       return 1;
     }
     isAllocated = true;
@@ -429,11 +556,15 @@ class CommandBuilder {
   }
 
  public:
-  CommandBuilder(CommandPool& cpool_, size_t initialSize = 1)
-      : cpool(cpool_), bufs(initialSize) {}
+  // Pass VK_COMMAND_BUFFER_LEVEL_SECONDARY in level to build secondary
+  // command buffers. See ParallelBuilder, below.
+  CommandBuilder(CommandPool& cpool_, size_t initialSize = 1,
+                 VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY)
+      : cpool(cpool_), bufs(initialSize), level(level) {}
   ~CommandBuilder();
 
   std::vector<VkCommandBuffer> bufs;
+  const VkCommandBufferLevel level;
 
   // resize updates the vector size and reallocates the VkCommandBuffers.
   WARN_UNUSED_RESULT int resize(size_t bufsSize) {
@@ -550,6 +681,42 @@ class CommandBuilder {
     return begin(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
   }
 
+  // beginSecondary begins a secondary command buffer that will execute
+  // inside subpass of pass. pass.passBeginInfo.framebuffer must already be
+  // set. The primary command buffer must use beginSecondaryPass().
+  //
+  // The default usageFlags include SIMULTANEOUS_USE, because a secondary
+  // command buffer without it cannot be used in a primary built with
+  // beginSimultaneousUse().
+  WARN_UNUSED_RESULT int beginSecondary(
+      RenderPass& pass, uint32_t subpass = 0,
+      VkCommandBufferUsageFlags usageFlags =
+          VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+          VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT) {
+    if (level != VK_COMMAND_BUFFER_LEVEL_SECONDARY) {
+      fprintf(stderr, "beginSecondary: CommandBuilder is not SECONDARY\n");
+      return 1;
+    }
+    if (!isAllocated && alloc()) {
+      return 1;
+    }
+    VkCommandBufferInheritanceInfo VkInit(cbii);
+    cbii.renderPass = pass.vk;
+    cbii.subpass = subpass;
+    cbii.framebuffer = pass.passBeginInfo.framebuffer;
+
+    VkCommandBufferBeginInfo VkInit(cbbi);
+    cbbi.flags = usageFlags;
+    cbbi.pInheritanceInfo = &cbii;
+    VkResult v = vkBeginCommandBuffer(buf, &cbbi);
+    if (v != VK_SUCCESS) {
+      fprintf(stderr, "vkBeginCommandBuffer failed: %d (%s)\n", v,
+              string_VkResult(v));
+      return 1;
+    }
+    return 0;
+  }
+
   WARN_UNUSED_RESULT int end() {
     if (!isAllocated && alloc()) {
       return 1;
@@ -604,6 +771,12 @@ class CommandBuilder {
                        pValues);
     return 0;
   }
+  WARN_UNUSED_RESULT int pushConstants(ComputePipeline& pipe, uint32_t offset,
+                                       uint32_t size, const void* pValues) {
+    vkCmdPushConstants(buf, pipe.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                       offset, size, pValues);
+    return 0;
+  }
 
   WARN_UNUSED_RESULT int fillBuffer(VkBuffer dst, VkDeviceSize dstOffset,
                                     VkDeviceSize size, uint32_t data) {
@@ -786,11 +959,11 @@ class CommandBuilder {
                               pDynamicOffsets);
   }
   WARN_UNUSED_RESULT int bindComputePipelineAndDescriptors(
-      Pipeline& pipe, uint32_t firstSet, uint32_t descriptorSetCount,
+      ComputePipeline& pipe, uint32_t firstSet, uint32_t descriptorSetCount,
       const VkDescriptorSet* pDescriptorSets, uint32_t dynamicOffsetCount = 0,
       const uint32_t* pDynamicOffsets = nullptr) {
-    return bindPipeline(VK_PIPELINE_BIND_POINT_COMPUTE, pipe) ||
-           bindDescriptorSets(VK_PIPELINE_BIND_POINT_COMPUTE,
+    vkCmdBindPipeline(buf, VK_PIPELINE_BIND_POINT_COMPUTE, pipe.vk);
+    return bindDescriptorSets(VK_PIPELINE_BIND_POINT_COMPUTE,
                               pipe.pipelineLayout, firstSet, descriptorSetCount,
                               pDescriptorSets, dynamicOffsetCount,
                               pDynamicOffsets);
@@ -1010,4 +1183,208 @@ class CommandBuilder {
   }
 };
 
+// ParallelBuilder records secondary command buffers on several threads, then
+// calls executeCommands() to run them from a primary command buffer.
+//
+// A VkCommandPool must only be used by one thread at a time, so each worker
+// thread gets its own CommandPool and its own CommandBuilder with
+// VK_COMMAND_BUFFER_LEVEL_SECONDARY buffers. The secondary buffers are
+// executed in worker order, so the draw order is the same as if the work
+// were recorded on one thread.
+//
+// Example usage:
+//   command::ParallelBuilder parallel(dev, language::GRAPHICS);
+//   if (parallel.ctorError() || parallel.resize(dev.framebufs.size())) { ... }
+//   builder.use(i);
+//   if (builder.beginSimultaneousUse() || builder.beginSecondaryPass(pass) ||
+//       parallel.record(builder, pass, i, chunks.size(),
+//           [&](command::CommandBuilder& b, size_t first, size_t last) {
+//             // Record state (viewport, scissor, pipeline) and draws for
+//             // chunks [first, last). Dynamic state is not inherited.
+//             return 0;
+//           }) ||
+//       builder.endRenderPass() || builder.end()) { ... }
+class ParallelBuilder {
+ public:
+  ParallelBuilder(language::Device& dev, language::SurfaceSupport queueFamily)
+      : dev(dev), queueFamily(queueFamily) {}
+  ParallelBuilder(ParallelBuilder&&) = default;
+  ParallelBuilder(const ParallelBuilder&) = delete;
+
+  // Two-stage constructor: check the return code of ctorError().
+  // If threadCount is 0, std::thread::hardware_concurrency() is used.
+  WARN_UNUSED_RESULT int ctorError(size_t threadCount = 0);
+
+  // resize sets how many secondary command buffers each worker keeps. Use
+  // one per primary command buffer that will reference them.
+  WARN_UNUSED_RESULT int resize(size_t bufsSize);
+
+  // RecordFn records work items [first, last) into builder. It is called on
+  // a worker thread, with builder already begun by beginSecondary().
+  typedef std::function<int(CommandBuilder& builder, size_t first,
+                            size_t last)>
+      RecordFn;
+
+  // record splits workCount items across the worker threads. Each worker
+  // records secondary command buffer bufI. Then record calls
+  // primary.executeCommands() with all of them. primary must be inside a
+  // render pass begun with beginSecondaryPass().
+  WARN_UNUSED_RESULT int record(CommandBuilder& primary, RenderPass& pass,
+                                size_t bufI, size_t workCount, RecordFn fn,
+                                uint32_t subpass = 0);
+
+  size_t threadCount() const { return workers.size(); }
+
+  language::Device& dev;
+  const language::SurfaceSupport queueFamily;
+
+ protected:
+  typedef struct Worker {
+    Worker(language::Device& dev, language::SurfaceSupport queueFamily)
+        : pool(dev, queueFamily),
+          builder(pool, 1, VK_COMMAND_BUFFER_LEVEL_SECONDARY) {}
+
+    CommandPool pool;
+    CommandBuilder builder;
+  } Worker;
+  // workers uses unique_ptr because builder holds a reference to pool.
+  std::vector<std::unique_ptr<Worker>> workers;
+};
+
+// GpuProfiler measures GPU time with timestamp queries. Each named scope
+// writes a timestamp before and after the commands it wraps, such as a
+// render pass or a dispatch.
+//
+// The queries are split into slots, one per command buffer, because command
+// buffers are recorded ahead of time and resubmitted. Each slot is read back
+// after its command buffer's fence signals, so the CPU never waits for the
+// GPU. The results are N frames old, where N is the number of slots.
+//
+// Example usage:
+//   command::GpuProfiler profiler(dev);
+//   size_t passScope;
+//   if (profiler.ctorError(language::GRAPHICS, dev.framebufs.size()) ||
+//       profiler.addScope("main pass", passScope)) { ... }
+//   // When recording command buffer i:
+//   if (builder.beginSimultaneousUse() || profiler.reset(builder, i)) { ... }
+//   {
+//     command::GpuProfiler::Scope scope(profiler, builder, i, passScope);
+//     ... record the render pass ...
+//   }
+//   // After submitting command buffer i:
+//   profiler.markSubmitted(i);
+//   // After the fence for command buffer i has signalled:
+//   if (profiler.collect(i)) { ... }
+//   fprintf(stderr, "%.3f ms\n", profiler.stats.at(passScope).mean());
+class GpuProfiler {
+ public:
+  GpuProfiler(language::Device& dev) : dev(dev), pool(dev) {}
+  GpuProfiler(GpuProfiler&&) = default;
+  GpuProfiler(const GpuProfiler&) = delete;
+
+  // Two-stage constructor: check the return code of ctorError().
+  // queueFamily is where the command buffers will be submitted. If it does
+  // not support timestamps, ctorError() succeeds but isSupported() is false
+  // and Scope does nothing.
+  WARN_UNUSED_RESULT int ctorError(language::SurfaceSupport queueFamily,
+                                   size_t slotCount, size_t maxScopes = 16);
+
+  // addScope adds a named scope and sets scopeI to its index in stats.
+  WARN_UNUSED_RESULT int addScope(const std::string& name, size_t& scopeI);
+
+  // reset records vkCmdResetQueryPool() for slot. Call it each time the
+  // command buffer for slot is recorded, outside any render pass.
+  WARN_UNUSED_RESULT int reset(CommandBuilder& builder, size_t slot);
+
+  // markSubmitted tells the profiler the command buffer for slot was
+  // submitted. Call it after each submit of that command buffer.
+  void markSubmitted(size_t slot) {
+    if (slot < slotCount) {
+      submitted.at(slot) = true;
+    }
+  }
+
+  // collect reads back the results of slot and adds them to stats, if slot
+  // was submitted since it was last collected or reset. Call it only after
+  // the fence for slot has signalled.
+  WARN_UNUSED_RESULT int collect(size_t slot);
+
+  bool isSupported() const { return nanosPerTick > 0; }
+
+  // Scope writes the begin timestamp when it is constructed and the end
+  // timestamp when it is destroyed.
+  class Scope {
+   public:
+    Scope(GpuProfiler& profiler, CommandBuilder& builder, size_t slot,
+          size_t scopeI);
+    ~Scope();
+
+   protected:
+    GpuProfiler& profiler;
+    CommandBuilder& builder;
+    uint32_t query{(uint32_t)-1};
+  };
+
+  // Stats holds the rolling statistics for one scope, in milliseconds.
+  typedef struct Stats {
+    Stats(const std::string& name) : name(name) {}
+
+    void add(double ms) {
+      if (samples.size() < window) {
+        samples.emplace_back(ms);
+      } else {
+        samples.at(next) = ms;
+      }
+      next = (next + 1) % window;
+      lastMs = ms;
+      count++;
+    }
+
+    double mean() const {
+      double sum = 0;
+      for (auto ms : samples) {
+        sum += ms;
+      }
+      return samples.empty() ? 0 : sum / samples.size();
+    }
+
+    double max() const {
+      double m = 0;
+      for (auto ms : samples) {
+        m = std::max(m, ms);
+      }
+      return m;
+    }
+
+    std::string name;
+    // window is the number of samples kept for mean() and max().
+    static constexpr size_t window = 64;
+    std::vector<double> samples;
+    size_t next{0};
+    double lastMs{0};
+    uint64_t count{0};
+  } Stats;
+  std::vector<Stats> stats;
+
+  language::Device& dev;
+
+ protected:
+  // queryOf returns the first of the 2 queries for scopeI in slot.
+  uint32_t queryOf(size_t slot, size_t scopeI) const {
+    return (slot * maxScopes + scopeI) * 2;
+  }
+
+  QueryPool pool;
+  size_t slotCount{0};
+  size_t maxScopes{0};
+  double nanosPerTick{0};
+  uint64_t validMask{0};
+  // written is which scopes were recorded in each slot, indexed by queryOf().
+  std::vector<bool> written;
+  // submitted is which slots were submitted and not collected yet. The
+  // queries in a slot are only written once the GPU runs its command buffer.
+  std::vector<bool> submitted;
+  std::vector<uint64_t> results;
+};
+
 }  // namespace command
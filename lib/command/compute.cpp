@@ -0,0 +1,48 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "command.h"
+
+namespace command {
+
+ComputePipeline::ComputePipeline(language::Device& dev)
+    : pipelineLayout{dev.dev, vkDestroyPipelineLayout},
+      vk{dev.dev, vkDestroyPipeline} {
+  pipelineLayout.allocator = dev.dev.allocator;
+  vk.allocator = dev.dev.allocator;
+}
+
+ComputePipeline::~ComputePipeline() {}
+
+int ComputePipeline::ctorError(language::Device& dev, PipelineCache* cache) {
+  if (!shader || !shader->vk) {
+    fprintf(stderr, "ComputePipeline::ctorError: shader not loaded\n");
+    return 1;
+  }
+
+  if (makePipelineLayout(dev, setLayouts, pushConstants, pipelineLayout)) {
+    return 1;
+  }
+
+  VkComputePipelineCreateInfo VkInit(p);
+  VkOverwrite(p.stage);
+  p.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  p.stage.module = shader->vk;
+  p.stage.pName = entryPointName.c_str();
+  p.layout = pipelineLayout;
+
+  vk.reset();
+  VkPipelineCache vkcache = VK_NULL_HANDLE;
+  if (cache) {
+    vkcache = cache->vk;
+  }
+  VkResult v = vkCreateComputePipelines(dev.dev, vkcache, 1, &p,
+                                        dev.dev.allocator, &vk);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateComputePipelines() returned %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace command
@@ -0,0 +1,111 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * compute_test opens a headless Device, runs one ComputePipeline dispatch
+ * that writes a storage buffer, and reads the buffer back. It needs no
+ * window, so it runs on a software Vulkan ICD. It exits non-zero on failure.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+
+#include "lib/command/command.h"
+#include "lib/command/compute_test.comp.h"
+#include "lib/language/VkInit.h"
+#include "lib/language/language.h"
+#include "lib/memory/memory.h"
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// localSize is local_size_x in compute_test.comp.
+constexpr uint32_t localSize = 64;
+constexpr uint32_t groups = 4;
+constexpr uint32_t count = localSize * groups;
+
+int dispatchAndRead(language::Device& dev) {
+  memory::Buffer out(dev);
+  out.info.size = count * sizeof(uint32_t);
+  out.info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  if (out.ctorError(dev, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                             VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) ||
+      out.bindMemory(dev) || out.mem.mapPersistent(dev)) {
+    return 1;
+  }
+  memset(out.mem.mapped, 0, out.info.size);
+
+  VkDescriptorSetLayoutBinding VkInit(binding);
+  binding.binding = 0;
+  binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  binding.descriptorCount = 1;
+  binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  memory::DescriptorSetLayout layout(dev);
+  memory::DescriptorPool pool(dev);
+  command::ComputePipeline pipe(dev);
+  pipe.shader = std::make_shared<command::Shader>(dev);
+  if (layout.ctorError(dev, {binding}) || pool.ctorError(1, layout.types) ||
+      pipe.shader->loadSPV(spv_compute_test_comp,
+                           sizeof(spv_compute_test_comp))) {
+    return 1;
+  }
+  pipe.setLayouts.emplace_back(layout.vk);
+  memory::DescriptorSet set(pool);
+  if (pipe.ctorError(dev) || set.ctorError(layout) ||
+      set.write(0, std::vector<memory::Buffer*>{&out})) {
+    return 1;
+  }
+
+  // The barrier makes the shader writes visible to the host after the fence.
+  command::CommandPool cpool(dev, language::GRAPHICS);
+  command::Fence fence(dev);
+  if (cpool.ctorError(dev) || fence.ctorError(dev)) {
+    return 1;
+  }
+  command::CommandBuilder builder(cpool);
+  VkBufferMemoryBarrier VkInit(bmb);
+  bmb.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  bmb.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  bmb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bmb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bmb.buffer = out.vk;
+  bmb.offset = 0;
+  bmb.size = VK_WHOLE_SIZE;
+  command::CommandBuilder::BarrierSet bset;
+  bset.buf.emplace_back(bmb);
+  VkDescriptorSet sets[] = {set.vk};
+  if (builder.beginOneTimeUse() ||
+      builder.bindComputePipelineAndDescriptors(pipe, 0, 1, sets) ||
+      builder.dispatch(groups, 1, 1) ||
+      builder.barrier(bset, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                      VK_PIPELINE_STAGE_HOST_BIT) ||
+      builder.end() || builder.submit(0, {}, {}, {}, fence.vk) ||
+      fence.wait(dev) || out.mem.invalidate(dev)) {
+    return 1;
+  }
+
+  const uint32_t* v = (const uint32_t*)out.mem.mapped;
+  for (uint32_t i = 0; i < count; i++) {
+    if (v[i] != i * 3 + 1) {
+      fprintf(stderr, "compute_test: v[%u] = %u want %u\n", i, v[i],
+              i * 3 + 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main() {
+  language::Instance inst;
+  if (inst.ctorError(nullptr, 0, nullptr, nullptr) || inst.open({64, 64})) {
+    return 1;
+  }
+  if (!inst.devs_size()) {
+    fprintf(stderr, "compute_test: no devices created\n");
+    return 1;
+  }
+  if (dispatchAndRead(inst.at(0))) {
+    return 1;
+  }
+  printf("compute_test: pass\n");
+  return 0;
+}
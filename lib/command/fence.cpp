@@ -56,8 +56,9 @@ int PresentSemaphore::present(uint32_t image_i) {
   return 0;
 };
 
-int Fence::ctorError(language::Device& dev) {
+int Fence::ctorError(language::Device& dev, VkFenceCreateFlags flags /*= 0*/) {
   VkFenceCreateInfo VkInit(fci);
+  fci.flags = flags;
   VkResult v = vkCreateFence(dev.dev, &fci, nullptr, &vk);
   if (v != VK_SUCCESS) {
     fprintf(stderr, "vkCreateFence returned %d (%s)\n", v, string_VkResult(v));
@@ -66,6 +67,29 @@ int Fence::ctorError(language::Device& dev) {
   return 0;
 }
 
+int Fence::wait(language::Device& dev, uint64_t timeoutNanos /*= UINT64_MAX*/) {
+  VkFence fences[] = {vk};
+  VkResult v = vkWaitForFences(dev.dev, sizeof(fences) / sizeof(fences[0]),
+                               fences, VK_TRUE /*waitAll*/, timeoutNanos);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkWaitForFences returned %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  return 0;
+}
+
+int Fence::reset(language::Device& dev) {
+  VkFence fences[] = {vk};
+  VkResult v =
+      vkResetFences(dev.dev, sizeof(fences) / sizeof(fences[0]), fences);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkResetFences returned %d (%s)\n", v, string_VkResult(v));
+    return 1;
+  }
+  return 0;
+}
+
 int Event::ctorError(language::Device& dev) {
   VkEventCreateInfo VkInit(eci);
   VkResult v = vkCreateEvent(dev.dev, &eci, nullptr, &vk);
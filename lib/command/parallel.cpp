@@ -0,0 +1,79 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include <thread>
+#include "command.h"
+
+namespace command {
+
+int ParallelBuilder::ctorError(size_t threadCount /*= 0*/) {
+  if (!threadCount) {
+    threadCount = std::thread::hardware_concurrency();
+    if (!threadCount) {
+      threadCount = 1;
+    }
+  }
+  workers.clear();
+  for (size_t i = 0; i < threadCount; i++) {
+    workers.emplace_back(new Worker(dev, queueFamily));
+    if (workers.back()->pool.ctorError(dev)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int ParallelBuilder::resize(size_t bufsSize) {
+  for (auto& worker : workers) {
+    if (worker->builder.resize(bufsSize)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int ParallelBuilder::record(CommandBuilder& primary, RenderPass& pass,
+                            size_t bufI, size_t workCount, RecordFn fn,
+                            uint32_t subpass /*= 0*/) {
+  if (workers.empty()) {
+    fprintf(stderr, "BUG: ParallelBuilder::record before ctorError\n");
+    return 1;
+  }
+  if (!workCount) {
+    return 0;
+  }
+  size_t n = std::min(workers.size(), workCount);
+  size_t perWorker = (workCount + n - 1) / n;
+  n = (workCount + perWorker - 1) / perWorker;
+
+  std::vector<int> result(n, 0);
+  auto work = [&](size_t t) {
+    size_t first = t * perWorker;
+    size_t last = std::min(first + perWorker, workCount);
+    auto& b = workers.at(t)->builder;
+    b.use(bufI);
+    result.at(t) = b.beginSecondary(pass, subpass) || fn(b, first, last) ||
+                   b.end();
+  };
+
+  // The calling thread does the first slice of work itself.
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < n; t++) {
+    threads.emplace_back(work, t);
+  }
+  work(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<VkCommandBuffer> secondary;
+  for (size_t t = 0; t < n; t++) {
+    if (result.at(t)) {
+      fprintf(stderr, "ParallelBuilder::record: worker %zu failed\n", t);
+      return 1;
+    }
+    secondary.emplace_back(workers.at(t)->builder.bufs.at(bufI));
+  }
+  return primary.executeCommands(secondary.size(), secondary.data());
+}
+
+}  // namespace command
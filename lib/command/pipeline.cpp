@@ -4,6 +4,27 @@
 
 namespace command {
 
+int makePipelineLayout(language::Device& dev,
+                       const std::vector<VkDescriptorSetLayout>& setLayouts,
+                       const std::vector<VkPushConstantRange>& pushConstants,
+                       VkPtr<VkPipelineLayout>& pipelineLayout) {
+  VkPipelineLayoutCreateInfo VkInit(plci);
+  plci.setLayoutCount = setLayouts.size();
+  plci.pSetLayouts = setLayouts.data();
+  plci.pushConstantRangeCount = pushConstants.size();
+  plci.pPushConstantRanges = pushConstants.data();
+
+  pipelineLayout.reset();
+  VkResult v = vkCreatePipelineLayout(dev.dev, &plci, dev.dev.allocator,
+                                      &pipelineLayout);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkCreatePipelineLayout() returned %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  return 0;
+}
+
 PipelineAttachment::PipelineAttachment(language::Device& dev, VkFormat format,
                                        VkImageLayout refLayout) {
   VkOverwrite(refvk);
@@ -36,6 +57,10 @@ PipelineAttachment::PipelineAttachment(language::Device& dev, VkFormat format,
       // Then after the RenderPass ends, the Framebuffer gets transitioned
       // automatically to a VkImage with:
       vk.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+      if (dev.headless) {
+        // There is no swapChain. Leave the image ready to be read back.
+        vk.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      }
       // (These are default values. Customize as needed for your application.)
       break;
 
@@ -171,21 +196,8 @@ int Pipeline::init(language::Device& dev, RenderPass& renderPass,
   info.cbsci.attachmentCount = info.perFramebufColorBlend.size();
   info.cbsci.pAttachments = info.perFramebufColorBlend.data();
 
-  VkPipelineLayoutCreateInfo VkInit(plci);
-  // TODO: Add pushConstants.
-  plci.setLayoutCount = info.setLayouts.size();
-  plci.pSetLayouts = info.setLayouts.data();
-  plci.pushConstantRangeCount = 0;
-  plci.pPushConstantRanges = 0;
-
-  //
-  // Create pipelineLayout.
-  //
-  pipelineLayout.reset();
-  VkResult v = vkCreatePipelineLayout(dev.dev, &plci, nullptr, &pipelineLayout);
-  if (v != VK_SUCCESS) {
-    fprintf(stderr, "vkCreatePipelineLayout() returned %d (%s)\n", v,
-            string_VkResult(v));
+  if (makePipelineLayout(dev, info.setLayouts, info.pushConstants,
+                         pipelineLayout)) {
     return 1;
   }
 
@@ -219,7 +231,11 @@ int Pipeline::init(language::Device& dev, RenderPass& renderPass,
   p.subpass = subpass_i;
 
   vk.reset();
-  v = vkCreateGraphicsPipelines(dev.dev, VK_NULL_HANDLE, 1, &p, nullptr, &vk);
+  VkPipelineCache cache = VK_NULL_HANDLE;
+  if (renderPass.pipelineCache) {
+    cache = renderPass.pipelineCache->vk;
+  }
+  VkResult v = vkCreateGraphicsPipelines(dev.dev, cache, 1, &p, nullptr, &vk);
   if (v != VK_SUCCESS) {
     fprintf(stderr, "vkCreateGraphicsPipelines() returned %d (%s)\n", v,
             string_VkResult(v));
@@ -0,0 +1,157 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <lib/file/file.h>
+#include "command.h"
+
+namespace command {
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// FileHeader is written before the VkPipelineCache data. driverVersion is
+// not in the Vulkan header, so it must be checked here.
+typedef struct FileHeader {
+  char magic[8];
+  uint32_t vendorID;
+  uint32_t deviceID;
+  uint32_t driverVersion;
+  uint32_t dataSize;
+  uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+} FileHeader;
+
+const char fileMagic[8] = "v0lcach";
+
+void makeHeader(language::Device& dev, FileHeader& h, size_t dataSize) {
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, fileMagic, sizeof(h.magic));
+  h.vendorID = dev.physProp.vendorID;
+  h.deviceID = dev.physProp.deviceID;
+  h.driverVersion = dev.physProp.driverVersion;
+  h.dataSize = dataSize;
+  memcpy(h.pipelineCacheUUID, dev.physProp.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+// isValid checks both FileHeader and the header Vulkan puts at the start of
+// the data (see VkPipelineCacheHeaderVersion in the Vulkan spec).
+bool isValid(language::Device& dev, const file::MappedFile& file) {
+  FileHeader want, got;
+  if (file.size < sizeof(got)) {
+    return false;
+  }
+  memcpy(&got, file.data, sizeof(got));
+  makeHeader(dev, want, file.size - sizeof(got));
+  if (memcmp(&want, &got, sizeof(want))) {
+    return false;
+  }
+
+  // The Vulkan header is: uint32_t length, uint32_t version, uint32_t
+  // vendorID, uint32_t deviceID, uint8_t pipelineCacheUUID[VK_UUID_SIZE].
+  uint32_t vk[4];
+  if (got.dataSize < sizeof(vk) + VK_UUID_SIZE) {
+    return false;
+  }
+  const char* data = file.data + sizeof(got);
+  memcpy(vk, data, sizeof(vk));
+  return vk[0] >= sizeof(vk) + VK_UUID_SIZE && vk[0] <= got.dataSize &&
+         vk[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         vk[2] == dev.physProp.vendorID && vk[3] == dev.physProp.deviceID &&
+         !memcmp(data + sizeof(vk), dev.physProp.pipelineCacheUUID,
+                 VK_UUID_SIZE);
+}
+
+}  // anonymous namespace
+
+int PipelineCache::ctorError(language::Device& dev, std::string filename) {
+  this->filename = filename;
+  // A missing file is not an error: the cache starts out empty.
+  file::MappedFile file;
+  if (access(filename.c_str(), F_OK) == 0 && file.open(filename.c_str())) {
+    return 1;
+  }
+
+  VkPipelineCacheCreateInfo VkInit(pcci);
+  if (file.size) {
+    if (isValid(dev, file)) {
+      pcci.initialDataSize = file.size - sizeof(FileHeader);
+      pcci.pInitialData = file.data + sizeof(FileHeader);
+    } else {
+      fprintf(stderr, "PipelineCache: %s is stale, ignoring it\n",
+              filename.c_str());
+    }
+  }
+  vk.reset();
+  VkResult v = vkCreatePipelineCache(dev.dev, &pcci, dev.dev.allocator, &vk);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkCreatePipelineCache failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  return 0;
+}
+
+int PipelineCache::save(language::Device& dev) {
+  size_t dataSize = 0;
+  VkResult v = vkGetPipelineCacheData(dev.dev, vk, &dataSize, nullptr);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkGetPipelineCacheData failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  std::vector<char> file(sizeof(FileHeader) + dataSize);
+  v = vkGetPipelineCacheData(dev.dev, vk, &dataSize,
+                             file.data() + sizeof(FileHeader));
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkGetPipelineCacheData failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  file.resize(sizeof(FileHeader) + dataSize);
+  FileHeader h;
+  makeHeader(dev, h, dataSize);
+  memcpy(file.data(), &h, sizeof(h));
+
+  // Write to a temporary file, then rename() it over filename. rename() is
+  // atomic, so filename is always either the old or the new cache.
+  std::string tmp = filename + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "PipelineCache: open(%s) failed: %d %s\n", tmp.c_str(),
+            errno, strerror(errno));
+    return 1;
+  }
+  size_t done = 0;
+  while (done < file.size()) {
+    ssize_t r = write(fd, file.data() + done, file.size() - done);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "PipelineCache: write(%s) failed: %d %s\n", tmp.c_str(),
+              errno, strerror(errno));
+      close(fd);
+      unlink(tmp.c_str());
+      return 1;
+    }
+    done += r;
+  }
+  int syncResult = fsync(fd);
+  if (close(fd) < 0 || syncResult < 0) {
+    fprintf(stderr, "PipelineCache: fsync/close(%s) failed: %d %s\n",
+            tmp.c_str(), errno, strerror(errno));
+    unlink(tmp.c_str());
+    return 1;
+  }
+  if (rename(tmp.c_str(), filename.c_str()) < 0) {
+    fprintf(stderr, "PipelineCache: rename(%s, %s) failed: %d %s\n",
+            tmp.c_str(), filename.c_str(), errno, strerror(errno));
+    unlink(tmp.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace command
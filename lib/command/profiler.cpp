@@ -0,0 +1,152 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "command.h"
+
+namespace command {
+
+int QueryPool::ctorError(
+    language::Device& dev, VkQueryType type, uint32_t count,
+    VkQueryPipelineStatisticFlags pipelineStatistics /*= 0*/) {
+  VkQueryPoolCreateInfo VkInit(qpci);
+  qpci.queryType = type;
+  qpci.queryCount = count;
+  qpci.pipelineStatistics = pipelineStatistics;
+  vk.reset();
+  VkResult v = vkCreateQueryPool(dev.dev, &qpci, dev.dev.allocator, &vk);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateQueryPool failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  this->count = count;
+  return 0;
+}
+
+VkResult QueryPool::getResults(language::Device& dev, uint32_t first,
+                               uint32_t n, std::vector<uint64_t>& results,
+                               VkQueryResultFlags flags /*= 0*/) {
+  results.resize(n);
+  return vkGetQueryPoolResults(dev.dev, vk, first, n,
+                               results.size() * sizeof(results[0]),
+                               results.data(), sizeof(results[0]),
+                               flags | VK_QUERY_RESULT_64_BIT);
+}
+
+int GpuProfiler::ctorError(language::SurfaceSupport queueFamily,
+                           size_t slotCount, size_t maxScopes /*= 16*/) {
+  if (!slotCount || !maxScopes) {
+    fprintf(stderr, "GpuProfiler::ctorError(%zu, %zu): invalid\n", slotCount,
+            maxScopes);
+    return 1;
+  }
+  auto qfam_i = dev.getQfamI(queueFamily);
+  if (qfam_i == (decltype(qfam_i)) - 1) {
+    return 1;
+  }
+  this->slotCount = slotCount;
+  this->maxScopes = maxScopes;
+  stats.clear();
+  written.clear();
+  written.resize(slotCount * maxScopes * 2, false);
+  submitted.clear();
+  submitted.resize(slotCount, false);
+
+  uint32_t validBits = dev.qfams.at(qfam_i).vk.timestampValidBits;
+  if (!validBits) {
+    fprintf(stderr, "GpuProfiler: queue family does not support timestamps\n");
+    nanosPerTick = 0;
+    return 0;
+  }
+  validMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+  nanosPerTick = dev.physProp.limits.timestampPeriod;
+  return pool.ctorError(dev, VK_QUERY_TYPE_TIMESTAMP,
+                        slotCount * maxScopes * 2);
+}
+
+int GpuProfiler::addScope(const std::string& name, size_t& scopeI) {
+  if (stats.size() >= maxScopes) {
+    fprintf(stderr, "GpuProfiler::addScope(%s): maxScopes is %zu\n",
+            name.c_str(), maxScopes);
+    return 1;
+  }
+  scopeI = stats.size();
+  stats.emplace_back(name);
+  return 0;
+}
+
+int GpuProfiler::reset(CommandBuilder& builder, size_t slot) {
+  if (slot >= slotCount) {
+    fprintf(stderr, "GpuProfiler::reset(%zu): only %zu slots\n", slot,
+            slotCount);
+    return 1;
+  }
+  for (size_t i = 0; i < maxScopes * 2; i++) {
+    written.at(queryOf(slot, 0) + i) = false;
+  }
+  // The old results of slot are discarded when the new command buffer runs.
+  submitted.at(slot) = false;
+  if (!isSupported()) {
+    return 0;
+  }
+  return builder.resetQueryPool(pool.vk, queryOf(slot, 0), maxScopes * 2);
+}
+
+int GpuProfiler::collect(size_t slot) {
+  if (slot >= slotCount) {
+    fprintf(stderr, "GpuProfiler::collect(%zu): only %zu slots\n", slot,
+            slotCount);
+    return 1;
+  }
+  if (!isSupported() || !submitted.at(slot)) {
+    return 0;
+  }
+  // Each submit is collected only once.
+  submitted.at(slot) = false;
+  for (size_t scopeI = 0; scopeI < stats.size(); scopeI++) {
+    uint32_t query = queryOf(slot, scopeI);
+    if (!written.at(query)) {
+      continue;
+    }
+    VkResult v = pool.getResults(dev, query, 2, results);
+    if (v == VK_NOT_READY) {
+      // The fence for slot has not signalled: collect() was called early.
+      continue;
+    }
+    if (v != VK_SUCCESS) {
+      fprintf(stderr, "vkGetQueryPoolResults failed: %d (%s)\n", v,
+              string_VkResult(v));
+      return 1;
+    }
+    // Masking with validMask makes the subtraction wrap correctly.
+    uint64_t ticks = (results.at(1) - results.at(0)) & validMask;
+    stats.at(scopeI).add(ticks * nanosPerTick / 1e6);
+  }
+  return 0;
+}
+
+GpuProfiler::Scope::Scope(GpuProfiler& profiler, CommandBuilder& builder,
+                          size_t slot, size_t scopeI)
+    : profiler(profiler), builder(builder) {
+  if (!profiler.isSupported() || slot >= profiler.slotCount ||
+      scopeI >= profiler.stats.size()) {
+    return;
+  }
+  query = profiler.queryOf(slot, scopeI);
+  profiler.written.at(query) = true;
+  if (builder.writeTimestamp(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             profiler.pool.vk, query)) {
+    fprintf(stderr, "GpuProfiler::Scope: writeTimestamp failed\n");
+  }
+}
+
+GpuProfiler::Scope::~Scope() {
+  if (query == (uint32_t)-1) {
+    return;
+  }
+  if (builder.writeTimestamp(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                             profiler.pool.vk, query + 1)) {
+    fprintf(stderr, "~GpuProfiler::Scope: writeTimestamp failed\n");
+  }
+}
+
+}  // namespace command
@@ -1,10 +1,6 @@
 /* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
  */
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
+#include <lib/file/file.h>
 #include "command.h"
 
 namespace command {
@@ -30,37 +26,13 @@ int Shader::loadSPV(const void* spvBegin, const void* spvEnd) {
 }
 
 int Shader::loadSPV(const char* filename) {
-  int infile = open(filename, O_RDONLY);
-  if (infile < 0) {
-    fprintf(stderr, "loadSPV: open(%s) failed: %d %s\n", filename, errno,
-            strerror(errno));
+  file::MappedFile f;
+  if (f.open(filename)) {
+    fprintf(stderr, "loadSPV(%s) failed\n", filename);
     return 1;
   }
-  struct stat s;
-  if (fstat(infile, &s) == -1) {
-    fprintf(stderr, "loadSPV: fstat(%s) failed: %d %s\n", filename, errno,
-            strerror(errno));
-    return 1;
-  }
-  char* map =
-      (char*)mmap(0, s.st_size, PROT_READ, MAP_SHARED, infile, 0 /*offset*/);
-  if (!map) {
-    fprintf(stderr, "loadSPV: mmap(%s) failed: %d %s\n", filename, errno,
-            strerror(errno));
-    close(infile);
-    return 1;
-  }
-
-  int r = loadSPV(map, map + s.st_size);
-  if (munmap(map, s.st_size) < 0) {
-    fprintf(stderr, "loadSPV: munmap(%s) failed: %d %s\n", filename, errno,
-            strerror(errno));
-    close(infile);
-    return 1;
-  }
-  if (close(infile) < 0) {
-    fprintf(stderr, "loadSPV: close(%s) failed: %d %s\n", filename, errno,
-            strerror(errno));
+  int r = loadSPV(f.data, f.data + f.size);
+  if (f.close()) {
     return 1;
   }
   return r;
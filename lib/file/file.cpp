@@ -0,0 +1,85 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace file {
+
+MappedFile::MappedFile(MappedFile&& other)
+    : data(other.data), size(other.size), filename(other.filename) {
+  other.data = nullptr;
+  other.size = 0;
+}
+
+MappedFile::~MappedFile() {
+  if (close()) {
+    fprintf(stderr, "~MappedFile: close failed\n");
+  }
+}
+
+int MappedFile::open(const char* filename) {
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "MappedFile: open(%s) failed: %d %s\n", filename, errno,
+            strerror(errno));
+    return 1;
+  }
+  // The mapping stays valid after fd is closed.
+  int r = map(fd, filename);
+  if (::close(fd) < 0) {
+    fprintf(stderr, "MappedFile: close(%s) failed: %d %s\n", filename, errno,
+            strerror(errno));
+    return 1;
+  }
+  return r;
+}
+
+int MappedFile::map(int fd, const char* name) {
+  if (close()) {
+    return 1;
+  }
+  filename = name;
+  struct stat s;
+  if (fstat(fd, &s) == -1) {
+    fprintf(stderr, "MappedFile: fstat(%s) failed: %d %s\n", name, errno,
+            strerror(errno));
+    return 1;
+  }
+  if (!s.st_size) {
+    return 0;  // mmap() of 0 bytes is an error.
+  }
+  void* p = mmap(0, s.st_size, PROT_READ, MAP_SHARED, fd, 0 /*offset*/);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "MappedFile: mmap(%s) failed: %d %s\n", name, errno,
+            strerror(errno));
+    return 1;
+  }
+  data = (const char*)p;
+  size = s.st_size;
+  return 0;
+}
+
+int MappedFile::close() {
+  if (!data) {
+    return 0;
+  }
+  int r = munmap((void*)data, size);
+  data = nullptr;
+  size = 0;
+  if (r < 0) {
+    fprintf(stderr, "MappedFile: munmap(%s) failed: %d %s\n", filename.c_str(),
+            errno, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace file
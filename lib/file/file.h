@@ -0,0 +1,59 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * lib/file is the file layer for the v0lum3 project. It has no dependencies
+ * on Vulkan, so any lib can use it.
+ */
+
+#include <stddef.h>
+#include <string>
+
+#pragma once
+
+#ifndef WARN_UNUSED_RESULT
+// Same as lib/language/language.h, for code that does not include it.
+#if defined(COMPILER_GCC) || defined(__clang__)
+#define WARN_UNUSED_RESULT __attribute__((warn_unused_result))
+#elif defined(COMPILER_MSVC)
+#define WARN_UNUSED_RESULT _Check_return_
+#else
+#define WARN_UNUSED_RESULT
+#endif
+#endif
+
+namespace file {
+
+// MappedFile maps a whole file into memory, read-only, with mmap(). The
+// pages are read from disk only when they are touched.
+//
+// Example usage:
+//   file::MappedFile f;
+//   if (f.open("main.vert.spv")) { ... }
+//   use(f.data, f.size);
+//   if (f.close()) { ... }  // Or let ~MappedFile do it.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(MappedFile&& other);
+  MappedFile(const MappedFile&) = delete;
+  virtual ~MappedFile();
+
+  // open() maps all of filename. An empty file sets data = nullptr and
+  // size = 0. The file does not stay open: the mapping keeps its contents
+  // until close().
+  WARN_UNUSED_RESULT int open(const char* filename);
+
+  // map() maps all of fd, which stays owned by the caller. Call it again to
+  // see bytes appended to the file since the last map(). name is only for
+  // error messages.
+  WARN_UNUSED_RESULT int map(int fd, const char* name);
+
+  // close() unmaps the file. It is not an error to call it more than once.
+  WARN_UNUSED_RESULT int close();
+
+  const char* data{nullptr};
+  size_t size{0};
+  // filename is the name passed to open() or map().
+  std::string filename;
+};
+
+}  // namespace file
@@ -0,0 +1,277 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "job.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+namespace job {
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// workerOf and workerIndex identify the Scheduler and deque of a worker
+// thread. They are nullptr and 0 on every other thread.
+thread_local const Scheduler* workerOf = nullptr;
+thread_local size_t workerIndex = 0;
+
+}  // anonymous namespace
+
+Scheduler::~Scheduler() {
+  {
+    std::lock_guard<std::mutex> l(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto& t : workers) {
+    t.join();
+  }
+}
+
+int Scheduler::ctorError(size_t threads /*= 0*/) {
+  if (!deques.empty()) {
+    fprintf(stderr, "BUG: Scheduler::ctorError called twice\n");
+    return 1;
+  }
+  if (!threads) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  mainThread = std::this_thread::get_id();
+  for (size_t i = 0; i < threads; i++) {
+    deques.emplace_back(new Deque);
+  }
+  workers.reserve(threads - 1);
+  for (size_t i = 1; i < threads; i++) {
+    workers.emplace_back(&Scheduler::workerMain, this, i);
+  }
+  return 0;
+}
+
+size_t Scheduler::threadIndex() { return workerIndex; }
+
+Handle Scheduler::submit(std::function<int()> fn,
+                         const std::vector<Handle>& after /*= {}*/) {
+  return add(fn, after, false /*mainOnly*/);
+}
+
+Handle Scheduler::submitMain(std::function<int()> fn,
+                             const std::vector<Handle>& after /*= {}*/) {
+  return add(fn, after, true /*mainOnly*/);
+}
+
+Handle Scheduler::add(std::function<int()> fn, const std::vector<Handle>& after,
+                      bool mainOnly) {
+  Handle j = std::make_shared<Job>(fn, mainOnly);
+  for (auto& dep : after) {
+    if (!dep) {
+      continue;
+    }
+    std::lock_guard<std::mutex> l(dep->lock);
+    if (dep->done) {
+      if (dep->failed) {
+        j->failed = true;
+      }
+      continue;
+    }
+    j->pending++;
+    dep->dependents.emplace_back(j);
+  }
+  // Remove the 1 that kept j from running before all dependencies were
+  // counted.
+  if (!--j->pending) {
+    enqueue(j);
+  }
+  return j;
+}
+
+void Scheduler::enqueue(Handle j) {
+  if (j->mainOnly) {
+    std::lock_guard<std::mutex> l(lock);
+    mainJobs.emplace_back(j);
+    doneWake.notify_all();
+    return;
+  }
+  size_t self = workerOf == this ? workerIndex : 0;
+  {
+    Deque& d = *deques.at(self);
+    std::lock_guard<std::mutex> l(d.lock);
+    d.jobs.emplace_back(j);
+  }
+  queued++;
+  {
+    // Take the lock so a worker cannot check queued and then miss this
+    // notify before it waits.
+    std::lock_guard<std::mutex> l(lock);
+  }
+  wake.notify_one();
+  // A thread blocked in wait() may be the only one free to run j, e.g. when
+  // every worker is itself inside wait().
+  doneWake.notify_all();
+}
+
+Handle Scheduler::pop(size_t self) {
+  Deque& d = *deques.at(self);
+  std::lock_guard<std::mutex> l(d.lock);
+  if (d.jobs.empty()) {
+    return nullptr;
+  }
+  Handle j = d.jobs.back();
+  d.jobs.pop_back();
+  queued--;
+  return j;
+}
+
+Handle Scheduler::next(size_t self) {
+  if (!queued) {
+    return nullptr;
+  }
+  // Pop the newest job from this thread's deque.
+  Handle j = pop(self);
+  if (j) {
+    return j;
+  }
+  // Steal the oldest job from another thread.
+  for (size_t k = 1; k < deques.size(); k++) {
+    Deque& d = *deques.at((self + k) % deques.size());
+    std::lock_guard<std::mutex> l(d.lock);
+    if (!d.jobs.empty()) {
+      Handle j = d.jobs.front();
+      d.jobs.pop_front();
+      queued--;
+      return j;
+    }
+  }
+  return nullptr;
+}
+
+Handle Scheduler::popMain() {
+  std::lock_guard<std::mutex> l(lock);
+  if (mainJobs.empty()) {
+    return nullptr;
+  }
+  Handle j = mainJobs.front();
+  mainJobs.pop_front();
+  return j;
+}
+
+void Scheduler::run(Handle j) {
+  if (!j->failed && j->fn()) {
+    j->failed = true;
+  }
+  // Free anything fn captured now, not when the last Handle goes away.
+  j->fn = nullptr;
+  finish(j);
+}
+
+void Scheduler::finish(Handle j) {
+  std::vector<Handle> dependents;
+  {
+    std::lock_guard<std::mutex> l(j->lock);
+    j->done = true;
+    dependents.swap(j->dependents);
+  }
+  for (auto& d : dependents) {
+    if (j->failed) {
+      d->failed = true;
+    }
+    if (!--d->pending) {
+      enqueue(d);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> l(lock);
+  }
+  doneWake.notify_all();
+}
+
+void Scheduler::workerMain(size_t self) {
+  workerOf = this;
+  workerIndex = self;
+  for (;;) {
+    Handle j = next(self);
+    if (j) {
+      run(j);
+      continue;
+    }
+    std::unique_lock<std::mutex> l(lock);
+    wake.wait(l, [this]() { return stopping || queued > 0; });
+    if (stopping) {
+      return;
+    }
+  }
+}
+
+int Scheduler::wait(const Handle& h) {
+  if (!h) {
+    fprintf(stderr, "BUG: Scheduler::wait(nullptr)\n");
+    return 1;
+  }
+  const bool isMain = isMainThread();
+  const size_t self = workerOf == this ? workerIndex : 0;
+  while (!h->done) {
+    Handle j;
+    if (isMain) {
+      j = popMain();
+    }
+    if (!j) {
+      j = next(self);
+    }
+    if (j) {
+      run(j);
+      continue;
+    }
+    std::unique_lock<std::mutex> l(lock);
+    doneWake.wait(l, [&]() {
+      return h->done || (isMain && !mainJobs.empty()) || queued > 0;
+    });
+  }
+  return h->failed ? 1 : 0;
+}
+
+int Scheduler::wait(const std::vector<Handle>& all) {
+  int r = 0;
+  for (auto& h : all) {
+    if (wait(h)) {
+      r = 1;
+    }
+  }
+  return r;
+}
+
+size_t Scheduler::runMain() {
+  if (!isMainThread()) {
+    fprintf(stderr, "BUG: Scheduler::runMain not on the main thread\n");
+    return 0;
+  }
+  // Main-thread jobs can make other jobs ready. finish() puts those on
+  // deques[0], which no worker pops from the back: run them here too so they
+  // do not wait for a worker to steal them or for the next wait().
+  size_t n = 0;
+  for (;;) {
+    Handle j = popMain();
+    if (!j) {
+      j = pop(0);
+    }
+    if (!j) {
+      return n;
+    }
+    run(j);
+    n++;
+  }
+}
+
+int Scheduler::parallelFor(size_t n, size_t grain,
+                           std::function<int(size_t begin, size_t end)> fn) {
+  if (!grain) {
+    grain = 1;
+  }
+  std::vector<Handle> all;
+  all.reserve((n + grain - 1) / grain);
+  for (size_t begin = 0; begin < n; begin += grain) {
+    size_t end = std::min(n, begin + grain);
+    // fn outlives the jobs because wait() returns only when they finish.
+    all.emplace_back(submit([&fn, begin, end]() { return fn(begin, end); }));
+  }
+  return wait(all);
+}
+
+}  // namespace job
@@ -0,0 +1,178 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * lib/job is a work-stealing job scheduler for the v0lum3 project. It has
+ * no dependencies on Vulkan, so any lib can use it.
+ *
+ * Each worker thread has its own deque of ready jobs. A worker pushes and
+ * pops jobs at the back of its own deque (newest first, which keeps its
+ * caches warm) and, when its deque is empty, steals the oldest job from the
+ * front of another thread's deque.
+ *
+ * A job can wait for other jobs: it becomes ready only when every job it
+ * was submitted after has finished. A job can also be pinned to the main
+ * thread (the thread that called Scheduler::ctorError()), for work such as
+ * vkQueueSubmit that must not leave the render thread. Main-thread jobs run
+ * only inside Scheduler::runMain() and Scheduler::wait().
+ *
+ * Jobs return an int like the rest of v0lum3: 0 on success, non-zero on
+ * error. A job whose dependency failed is not run and also fails.
+ *
+ * Example usage:
+ *   job::Scheduler jobs;
+ *   if (jobs.ctorError()) { ... }
+ *   job::Handle gen = jobs.submit([&]() -> int { return generate(); });
+ *   job::Handle mesh = jobs.submit([&]() -> int { return mesh(); }, {gen});
+ *   job::Handle up = jobs.submitMain([&]() -> int { return upload(); },
+ *                                    {mesh});
+ *   if (jobs.wait(up)) { ... }  // The main thread runs 'up' inside wait().
+ */
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+#ifndef WARN_UNUSED_RESULT
+// Same as lib/language/language.h, for code that does not include it.
+#if defined(COMPILER_GCC) || defined(__clang__)
+#define WARN_UNUSED_RESULT __attribute__((warn_unused_result))
+#elif defined(COMPILER_MSVC)
+#define WARN_UNUSED_RESULT _Check_return_
+#else
+#define WARN_UNUSED_RESULT
+#endif
+#endif
+
+namespace job {
+
+// Job is one unit of work for a Scheduler. Only Scheduler modifies a Job.
+typedef struct Job {
+  Job(std::function<int()> fn, bool mainOnly)
+      : fn(fn), mainOnly(mainOnly) {}
+  Job(Job&&) = delete;
+  Job(const Job&) = delete;
+
+  std::function<int()> fn;
+  const bool mainOnly;
+  // pending counts unfinished dependencies, plus 1 until submit() returns.
+  std::atomic<size_t> pending{1};
+  std::atomic<bool> failed{false};
+  std::atomic<bool> done{false};
+
+  // lock protects dependents, and done while dependents are added.
+  std::mutex lock;
+  // dependents are the jobs waiting for this one.
+  std::vector<std::shared_ptr<Job>> dependents;
+} Job;
+
+// Handle refers to a Job. A Job stays valid as long as a Handle to it
+// exists.
+typedef std::shared_ptr<Job> Handle;
+
+// Scheduler runs jobs on a pool of worker threads. See the top of this file.
+class Scheduler {
+ public:
+  Scheduler() = default;
+  Scheduler(Scheduler&&) = delete;
+  Scheduler(const Scheduler&) = delete;
+  // ~Scheduler stops the worker threads. Jobs that have not started are
+  // dropped: wait() for them first.
+  virtual ~Scheduler();
+
+  // Two-stage constructor: check the return code of ctorError().
+  // threads is the total number of threads including the calling thread,
+  // which becomes the main thread. 0 means one per core.
+  WARN_UNUSED_RESULT int ctorError(size_t threads = 0);
+
+  // submit() queues fn to run on any thread once every job in after has
+  // finished. fn may call submit() and wait().
+  Handle submit(std::function<int()> fn, const std::vector<Handle>& after = {});
+
+  // submitMain() is like submit() but fn only runs on the main thread.
+  Handle submitMain(std::function<int()> fn,
+                    const std::vector<Handle>& after = {});
+
+  // wait() blocks until h has finished and returns non-zero if it failed.
+  // While it waits, the calling thread runs other jobs, including
+  // main-thread jobs if it is the main thread.
+  WARN_UNUSED_RESULT int wait(const Handle& h);
+
+  // wait() for a group of jobs returns non-zero if any of them failed.
+  WARN_UNUSED_RESULT int wait(const std::vector<Handle>& all);
+
+  // runMain() runs the main-thread jobs that are ready, and any jobs they
+  // made ready that are still queued on the main thread's deque, without
+  // blocking. It returns how many it ran. Call it once per frame from the
+  // main thread.
+  size_t runMain();
+
+  // parallelFor() calls fn(begin, end) on ranges of at most grain indices
+  // that cover 0 to n, across all threads, and waits for them. It returns
+  // non-zero if any fn returned non-zero.
+  WARN_UNUSED_RESULT int parallelFor(
+      size_t n, size_t grain, std::function<int(size_t begin, size_t end)> fn);
+
+  // threadCount() returns the number of threads that run jobs, including
+  // the main thread.
+  size_t threadCount() const { return deques.size(); }
+
+  // threadIndex() returns 1 to threadCount() - 1 on a worker thread and 0
+  // on any other thread. Use it to give each thread its own scratch space.
+  static size_t threadIndex();
+
+ protected:
+  typedef struct Deque {
+    std::mutex lock;
+    std::deque<Handle> jobs;
+  } Deque;
+
+  // add() implements submit() and submitMain().
+  Handle add(std::function<int()> fn, const std::vector<Handle>& after,
+             bool mainOnly);
+  // enqueue() makes j ready to run.
+  void enqueue(Handle j);
+  // finish() marks j done and enqueues dependents that are now ready.
+  void finish(Handle j);
+  // run() runs j (unless a dependency failed) and finishes it.
+  void run(Handle j);
+  // pop() pops the newest job from the deque of thread self, or returns
+  // nullptr.
+  Handle pop(size_t self);
+  // next() pops a job from the deque of thread self or steals one. It
+  // returns nullptr if every deque is empty.
+  Handle next(size_t self);
+  // popMain() pops a ready main-thread job or returns nullptr.
+  Handle popMain();
+  void workerMain(size_t self);
+  bool isMainThread() const {
+    return std::this_thread::get_id() == mainThread;
+  }
+
+  // deques[0] belongs to the main thread and any thread that is not a
+  // worker. deques[i] belongs to workers[i - 1].
+  std::vector<std::unique_ptr<Deque>> deques;
+  std::vector<std::thread> workers;
+  std::thread::id mainThread;
+  // queued counts the jobs in all deques, so idle workers know when to
+  // wake up.
+  std::atomic<size_t> queued{0};
+
+  // lock protects mainJobs, and is held to notify wake and doneWake.
+  std::mutex lock;
+  std::deque<Handle> mainJobs;
+  // wake is signalled when a job is queued or the Scheduler is stopping.
+  std::condition_variable wake;
+  // doneWake is signalled when a job finishes or a main-thread job is
+  // queued.
+  std::condition_variable doneWake;
+  bool stopping{false};
+};
+
+}  // namespace job
@@ -0,0 +1,207 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * job_test stresses job::Scheduler: dependencies, failures, main-thread
+ * jobs and nested waits. Build it with -fsanitize=thread to check for races.
+ * A deadlock makes the watchdog abort the test.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+
+#include "lib/job/job.h"
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+int testChain(job::Scheduler& jobs) {
+  // Each job checks that the one before it has already run.
+  std::atomic<int> step{0};
+  job::Handle prev;
+  std::vector<job::Handle> all;
+  for (int i = 0; i < 100; i++) {
+    prev = jobs.submit(
+        [&step, i]() -> int {
+          if (step != i) {
+            fprintf(stderr, "testChain: job %d ran at step %d\n", i,
+                    (int)step);
+            return 1;
+          }
+          step++;
+          return 0;
+        },
+        {prev});
+    all.emplace_back(prev);
+  }
+  if (jobs.wait(all) || step != 100) {
+    fprintf(stderr, "testChain: step %d want 100\n", (int)step);
+    return 1;
+  }
+  return 0;
+}
+
+int testFail(job::Scheduler& jobs) {
+  std::atomic<int> ran{0};
+  job::Handle bad = jobs.submit([]() -> int { return 1; });
+  job::Handle after = jobs.submit(
+      [&ran]() -> int {
+        ran++;
+        return 0;
+      },
+      {bad});
+  job::Handle main = jobs.submitMain(
+      [&ran]() -> int {
+        ran++;
+        return 0;
+      },
+      {after});
+  if (!jobs.wait(bad) || !jobs.wait(after) || !jobs.wait(main)) {
+    fprintf(stderr, "testFail: wait() did not report the failure\n");
+    return 1;
+  }
+  if (ran) {
+    fprintf(stderr, "testFail: %d dependents of a failed job ran\n",
+            (int)ran);
+    return 1;
+  }
+  return 0;
+}
+
+int testMainOnly(job::Scheduler& jobs) {
+  const std::thread::id mainThread = std::this_thread::get_id();
+  std::atomic<int> wrong{0};
+  std::vector<job::Handle> all;
+  for (int i = 0; i < 200; i++) {
+    job::Handle work = jobs.submit([]() -> int { return 0; });
+    all.emplace_back(jobs.submitMain(
+        [&wrong, mainThread]() -> int {
+          if (std::this_thread::get_id() != mainThread) {
+            wrong++;
+          }
+          return 0;
+        },
+        {work}));
+  }
+  if (jobs.wait(all) || wrong) {
+    fprintf(stderr, "testMainOnly: %d main jobs ran on a worker\n",
+            (int)wrong);
+    return 1;
+  }
+  return 0;
+}
+
+// testNestedMain is a job that waits for a main-thread job and then for a
+// job that depends on it, while the main thread only calls runMain(). The
+// job that depends on the main-thread job is queued on the main thread's
+// deque by runMain().
+int testNestedMain(job::Scheduler& jobs) {
+  std::atomic<int> ran{0};
+  job::Handle outer = jobs.submit([&jobs, &ran]() -> int {
+    job::Handle a = jobs.submitMain([&ran]() -> int {
+      ran++;
+      return 0;
+    });
+    job::Handle b = jobs.submit(
+        [&ran]() -> int {
+          ran++;
+          return 0;
+        },
+        {a});
+    return jobs.wait(b);
+  });
+  while (!outer->done) {
+    jobs.runMain();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (jobs.wait(outer) || ran != 2) {
+    fprintf(stderr, "testNestedMain: ran %d want 2\n", (int)ran);
+    return 1;
+  }
+  return 0;
+}
+
+int testNestedWait(job::Scheduler& jobs) {
+  // Every job waits for jobs it submits, so all threads end up in wait().
+  std::atomic<int> leaves{0};
+  std::function<int(int)> tree = [&](int depth) -> int {
+    if (!depth) {
+      leaves++;
+      return 0;
+    }
+    std::vector<job::Handle> kids;
+    for (int i = 0; i < 4; i++) {
+      kids.emplace_back(
+          jobs.submit([&tree, depth]() -> int { return tree(depth - 1); }));
+    }
+    return jobs.wait(kids);
+  };
+  if (jobs.wait(jobs.submit([&tree]() -> int { return tree(5); })) ||
+      leaves != 1024) {
+    fprintf(stderr, "testNestedWait: %d leaves want 1024\n", (int)leaves);
+    return 1;
+  }
+  return 0;
+}
+
+int testParallelFor(job::Scheduler& jobs) {
+  std::vector<int> hits(10000);
+  if (jobs.parallelFor(hits.size(), 37, [&hits](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          hits[i]++;
+        }
+        return 0;
+      })) {
+    fprintf(stderr, "testParallelFor: failed\n");
+    return 1;
+  }
+  for (size_t i = 0; i < hits.size(); i++) {
+    if (hits[i] != 1) {
+      fprintf(stderr, "testParallelFor: hits[%zu] = %d\n", i, hits[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int runAll(size_t threads) {
+  job::Scheduler jobs;
+  if (jobs.ctorError(threads)) {
+    return 1;
+  }
+  for (int round = 0; round < 20; round++) {
+    if (testChain(jobs) || testFail(jobs) || testMainOnly(jobs) ||
+        testNestedMain(jobs) || testNestedWait(jobs) ||
+        testParallelFor(jobs)) {
+      fprintf(stderr, "threads=%zu round %d failed\n", threads, round);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main() {
+  std::atomic<bool> finished{false};
+  std::thread watchdog([&finished]() {
+    for (int i = 0; i < 1200 && !finished; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (!finished) {
+      fprintf(stderr, "job_test: timed out, probably a deadlock\n");
+      abort();
+    }
+  });
+  int r = 0;
+  for (size_t threads : {1, 2, 4, 8}) {
+    if (runAll(threads)) {
+      r = 1;
+      break;
+    }
+  }
+  finished = true;
+  watchdog.join();
+  if (!r) {
+    printf("job_test: pass\n");
+  }
+  return r;
+}
@@ -116,6 +116,11 @@ inline void _VkInit(VkPipelineLayoutCreateInfo& plci) {
   plci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 }
 
+inline void _VkInit(VkPipelineCacheCreateInfo& pcci) {
+  memset(&pcci, 0, sizeof(pcci));
+  pcci.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+}
+
 inline void _VkInit(VkAttachmentDescription& ad) {
   memset(&ad, 0, sizeof(ad));
   // VkAttachmentDescription has no 'sType'.
@@ -146,6 +151,11 @@ inline void _VkInit(VkGraphicsPipelineCreateInfo& gpci) {
   gpci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
 }
 
+inline void _VkInit(VkComputePipelineCreateInfo& cpci) {
+  memset(&cpci, 0, sizeof(cpci));
+  cpci.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+}
+
 inline void _VkInit(VkFramebufferCreateInfo& fbci) {
   memset(&fbci, 0, sizeof(fbci));
   fbci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
@@ -166,6 +176,11 @@ inline void _VkInit(VkEventCreateInfo& eci) {
   eci.sType = VK_STRUCTURE_TYPE_EVENT_CREATE_INFO;
 }
 
+inline void _VkInit(VkQueryPoolCreateInfo& qpci) {
+  memset(&qpci, 0, sizeof(qpci));
+  qpci.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+}
+
 inline void _VkInit(VkCommandPoolCreateInfo& cpci) {
   memset(&cpci, 0, sizeof(cpci));
   cpci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -198,6 +213,11 @@ inline void _VkInit(VkCommandBufferAllocateInfo& ai) {
   ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 }
 
+inline void _VkInit(VkCommandBufferInheritanceInfo& cbii) {
+  memset(&cbii, 0, sizeof(cbii));
+  cbii.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+}
+
 inline void _VkInit(VkCommandBufferBeginInfo& cbbi) {
   memset(&cbbi, 0, sizeof(cbbi));
   cbbi.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -208,6 +228,11 @@ inline void _VkInit(VkMemoryAllocateInfo& mai) {
   mai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
 }
 
+inline void _VkInit(VkMappedMemoryRange& mmr) {
+  memset(&mmr, 0, sizeof(mmr));
+  mmr.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+}
+
 inline void _VkInit(VkBufferCreateInfo& bci) {
   memset(&bci, 0, sizeof(bci));
   bci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -218,6 +243,16 @@ inline void _VkInit(VkImageCreateInfo& ici) {
   ici.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 }
 
+inline void _VkInit(VkMemoryBarrier& mb) {
+  memset(&mb, 0, sizeof(mb));
+  mb.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+}
+
+inline void _VkInit(VkBufferMemoryBarrier& bmb) {
+  memset(&bmb, 0, sizeof(bmb));
+  bmb.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+}
+
 inline void _VkInit(VkImageMemoryBarrier& imb) {
   memset(&imb, 0, sizeof(imb));
   imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -254,5 +289,14 @@ inline void _VkInit(VkWriteDescriptorSet& wds) {
   wds.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 }
 
+inline void _VkInit(VkDescriptorUpdateTemplateCreateInfoKHR& dutci) {
+  memset(&dutci, 0, sizeof(dutci));
+  dutci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO_KHR;
+}
+
+inline void _VkInit(VkDescriptorUpdateTemplateEntryKHR& dute) {
+  memset(&dute, 0, sizeof(dute));
+}
+
 }  // namespace internal
 }  // namespace language
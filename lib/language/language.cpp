@@ -85,6 +85,11 @@ struct InstanceInternal : public Instance {
     VkBool32 oneQueueWithPresentSupported = false;
     for (size_t q_i = 0; q_i < vkQFams.size(); q_i++) {
       VkBool32 isPresentSupported = false;
+      if (headless) {
+        // There is no surface, so no queue can PRESENT.
+        dev.qfams.emplace_back(vkQFams.at(q_i), NONE);
+        continue;
+      }
       VkResult v = vkGetPhysicalDeviceSurfaceSupportKHR(
           dev.phys, q_i, this->surface, &isPresentSupported);
       if (v != VK_SUCCESS) {
@@ -108,6 +113,14 @@ struct InstanceInternal : public Instance {
     delete devExtensions;
     devExtensions = nullptr;
 
+    if (headless) {
+      // Render into an RGBA image. Every device must support it as a color
+      // attachment and as a transfer source.
+      dev.headless = true;
+      dev.format.format = VK_FORMAT_R8G8B8A8_UNORM;
+      dev.format.colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+      return 0;
+    }
     if (!oneQueueWithPresentSupported) {
       return 0;
     }
@@ -171,6 +184,7 @@ struct InstanceInternal : public Instance {
       dev.phys = phys;
       vkGetPhysicalDeviceProperties(phys, &dev.physProp);
       vkGetPhysicalDeviceMemoryProperties(dev.phys, &dev.memProps);
+      vkGetPhysicalDeviceFeatures(dev.phys, &dev.availableFeatures);
 
       int r = initSupportedQueues(*vkQFams, dev);
       delete vkQFams;
@@ -224,14 +238,17 @@ int Instance::ctorError(const char** requiredExtensions,
 
   if ((r = ii->initDebug()) != 0) return r;
 
-  VkResult v = createWindowSurface(*this, window);
-  if (v != VK_SUCCESS) {
-    fprintf(stderr,
-            "createWindowSurface (the user-provided fn) failed: %d (%s)", v,
-            string_VkResult(v));
-    return 1;
+  headless = !createWindowSurface;
+  if (!headless) {
+    VkResult v = createWindowSurface(*this, window);
+    if (v != VK_SUCCESS) {
+      fprintf(stderr,
+              "createWindowSurface (the user-provided fn) failed: %d (%s)", v,
+              string_VkResult(v));
+      return 1;
+    }
+    surface.allocator = pAllocator;
   }
-  surface.allocator = pAllocator;
 
   {
     std::vector<VkPhysicalDevice>* physDevs = Vk::getDevices(vk);
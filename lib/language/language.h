@@ -131,7 +131,9 @@ typedef struct Framebuf {
 // SurfaceSupport encodes the result of vkGetPhysicalDeviceSurfaceSupportKHR().
 // As an exception, the GRAPHICS value is used to request a QueueFamily
 // with vk.queueFlags & VK_QUEUE_GRAPHICS_BIT in Instance::requestQfams() and
-// Device::getQfamI().
+// Device::getQfamI(). Similarly, TRANSFER requests a QueueFamily that can do
+// VK_QUEUE_TRANSFER_BIT but not GRAPHICS or COMPUTE (usually a DMA engine that
+// runs in parallel with rendering).
 // TODO: add COMPUTE.
 enum SurfaceSupport {
   UNDEFINED = 0,
@@ -139,6 +141,7 @@ enum SurfaceSupport {
   PRESENT = 2,
 
   GRAPHICS = 0x1000,  // Not used in struct QueueFamily.
+  TRANSFER = 0x2000,  // Not used in struct QueueFamily.
 };
 
 // QueueRequest communicates the physical device and queue family within the
@@ -175,6 +178,10 @@ typedef struct QueueFamily {
   inline bool isGraphics() const {
     return vk.queueFlags & VK_QUEUE_GRAPHICS_BIT;
   }
+  inline bool isTransferOnly() const {
+    return (vk.queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+           !(vk.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT));
+  }
 
   // Populated only after open().
   std::vector<float> prios;
@@ -215,6 +222,17 @@ typedef struct Device {
   // Device extensions to choose from. Populated after ctorError().
   std::vector<VkExtensionProperties> availableExtensions;
 
+  // Optional features like multiDrawIndirect. Populated after ctorError().
+  VkPhysicalDeviceFeatures availableFeatures;
+  // Request optional features by setting them in enabledFeatures before
+  // open(). Only request features that are in availableFeatures.
+  VkPhysicalDeviceFeatures enabledFeatures{};
+  // enabledFeaturesNext is chained to VkDeviceCreateInfo::pNext by open(), to
+  // enable the features of an extension, such as
+  // VkPhysicalDeviceDescriptorIndexingFeaturesEXT. It must stay valid until
+  // open() returns.
+  const void* enabledFeaturesNext{nullptr};
+
   // qfams is populated after ctorError() but qfams.queue is populated
   // only after open().
   std::vector<QueueFamily> qfams;
@@ -256,6 +274,11 @@ typedef struct Device {
   chooseFormat(VkImageTiling tiling, VkFormatFeatureFlags flags,
                const std::vector<VkFormat>& choices);
 
+  // headless is true if Instance::ctorError() was not given a window. A
+  // headless Device has no swapChain: open() only sets swapChainExtent, and
+  // your application populates framebufs (see science::OffscreenTarget).
+  bool headless{false};
+
   // Instance::open() calls resetSwapChain() so swapChain is valid after open().
   VkPtr<VkSwapchainKHR> swapChain{dev, vkDestroySwapchainKHR};
   std::vector<Framebuf> framebufs;
@@ -357,6 +380,11 @@ class Instance {
   //
   // window is an opaque pointer used only in the call to
   // createWindowSurface.
+  //
+  // If createWindowSurface is nullptr, the Instance is headless: no surface
+  // is created and devices do not need PRESENT support. Do not include
+  // VK_KHR_surface in requiredExtensions. This works on machines with no
+  // display, for example with lavapipe or SwiftShader.
   WARN_UNUSED_RESULT int ctorError(const char** requiredExtensions,
                                    size_t requiredExtensionCount,
                                    CreateWindowSurfaceFn createWindowSurface,
@@ -403,6 +431,9 @@ class Instance {
   // allocator before calling ctorError().
   VkAllocationCallbacks* pAllocator = nullptr;
 
+  // headless is set by ctorError() if there is no window.
+  bool headless = false;
+
  protected:
   // Override initDebug() if your app needs different debug settings.
   WARN_UNUSED_RESULT virtual int initDebug();
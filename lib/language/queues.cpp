@@ -15,16 +15,33 @@ namespace language {
 using namespace VkEnum;
 
 int Instance::initQueues(std::vector<QueueRequest>& request) {
-  // Search for a single device that can do both PRESENT and GRAPHICS.
+  // Search for a single device that can do both PRESENT and GRAPHICS. A
+  // headless Instance only needs GRAPHICS.
   bool foundQueue = false;
   for (size_t dev_i = 0; dev_i < devs_size(); dev_i++) {
     auto selectedQfams =
-        requestQfams(dev_i, {language::PRESENT, language::GRAPHICS});
+        headless ? requestQfams(dev_i, {language::GRAPHICS})
+                 : requestQfams(dev_i, {language::PRESENT, language::GRAPHICS});
     foundQueue |= selectedQfams.size() > 0;
     request.insert(request.end(), selectedQfams.begin(), selectedQfams.end());
+    if (!selectedQfams.size()) {
+      continue;
+    }
+
+    // Also request a dedicated TRANSFER queue if the device has one. It is
+    // optional: memory::TransferQueue falls back to the GRAPHICS queue.
+    bool hasTransfer = false;
+    for (auto& fam : at(dev_i).qfams) {
+      hasTransfer |= fam.isTransferOnly();
+    }
+    if (hasTransfer) {
+      auto transferQfams = requestQfams(dev_i, {language::TRANSFER});
+      request.insert(request.end(), transferQfams.begin(), transferQfams.end());
+    }
   }
   if (!foundQueue) {
-    fprintf(stderr, "Error: no device has both PRESENT and GRAPHICS queues.\n");
+    fprintf(stderr, "Error: no device has %s queues.\n",
+            headless ? "GRAPHICS" : "both PRESENT and GRAPHICS");
     return 1;
   }
   return 0;
@@ -88,10 +105,6 @@ int Instance::open(VkExtent2D surfaceSizeRequest) {
       allQci.push_back(dqci);
     }
 
-    // VkPhysicalDeviceFeatures VkInit(physDevFeatures);
-    // vkGetPhysicalDeviceFeatures(dev.phys, &physDevFeatures);
-    VkPhysicalDeviceFeatures VkInit(enabledFeatures);
-
     // Enable device layer "VK_LAYER_LUNARG_standard_validation"
     std::vector<const char*> enabledLayers;
     enabledLayers.push_back(VK_LAYER_LUNARG_standard_validation);
@@ -99,7 +112,8 @@ int Instance::open(VkExtent2D surfaceSizeRequest) {
     VkDeviceCreateInfo VkInit(dCreateInfo);
     dCreateInfo.queueCreateInfoCount = allQci.size();
     dCreateInfo.pQueueCreateInfos = allQci.data();
-    dCreateInfo.pEnabledFeatures = &enabledFeatures;
+    dCreateInfo.pNext = dev.enabledFeaturesNext;
+    dCreateInfo.pEnabledFeatures = &dev.enabledFeatures;
     if (dev.extensionRequests.size()) {
       dCreateInfo.enabledExtensionCount = dev.extensionRequests.size();
       dCreateInfo.ppEnabledExtensionNames = dev.extensionRequests.data();
@@ -133,6 +147,11 @@ int Instance::open(VkExtent2D surfaceSizeRequest) {
         q_count++;
       }
     }
+    if (q_count && dev.headless) {
+      // There is no swapChain. framebufs are populated by the app.
+      dev.swapChainExtent = surfaceSizeRequest;
+      continue;
+    }
     if (q_count && dev.presentModes.size()) {
       if (swap_chain_count == 1) {
         fprintf(stderr, "Warn: A multi-GPU setup probably does not work.\n");
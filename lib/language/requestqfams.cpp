@@ -31,6 +31,9 @@ std::vector<QueueRequest> Instance::requestQfams(
         case GRAPHICS:
           name = "GRAPHICS";
           break;
+        case TRANSFER:
+          name = "TRANSFER";
+          break;
       }
       fprintf(stderr, " %d=%s", (int)s, name);
     }
@@ -68,6 +71,8 @@ std::vector<QueueRequest> Instance::requestQfams(
       auto s = *s_i;
       if (s == GRAPHICS && fam.isGraphics()) {
         qsupport.emplace(GRAPHICS);
+      } else if (s == TRANSFER && fam.isTransferOnly()) {
+        qsupport.emplace(TRANSFER);
       } else if (fam.surfaceSupport == s) {
         qsupport.emplace(s);
       }
@@ -144,6 +149,7 @@ size_t Device::getQfamI(SurfaceSupport support) const {
   for (size_t i = 0; i < qfams.size(); i++) {
     auto& fam = qfams.at(i);
     if (support == GRAPHICS && fam.isGraphics()) return i;
+    if (support == TRANSFER && fam.isTransferOnly()) return i;
     if (support == fam.surfaceSupport) return i;
   }
   fprintf(stderr, "getQfamI(%d): not found\n", (int)support);
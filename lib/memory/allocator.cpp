@@ -0,0 +1,240 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include <iterator>
+#include "memory.h"
+
+namespace memory {
+
+Suballocation::Suballocation(Suballocation&& other)
+    : allocator(other.allocator),
+      block(other.block),
+      offset(other.offset),
+      size(other.size) {
+  other.allocator = nullptr;
+  other.block = nullptr;
+  other.offset = 0;
+  other.size = 0;
+}
+
+void Suballocation::reset() {
+  if (block && allocator) {
+    allocator->free(*this);
+  }
+}
+
+DeviceMemoryAllocator::~DeviceMemoryAllocator() {
+  for (auto& block : blocks) {
+    if (block->allocCount) {
+      fprintf(stderr,
+              "BUG: ~DeviceMemoryAllocator: block still has %zu "
+              "suballocations\n",
+              block->allocCount);
+    }
+  }
+}
+
+bool DeviceMemoryAllocator::findRange(MemoryBlock& block, VkDeviceSize size,
+                                      VkDeviceSize alignment,
+                                      Suballocation& out) {
+  // First fit: the freeList is sorted by offset, so this tends to pack
+  // suballocations toward the start of the block.
+  for (auto i = block.freeList.begin(); i != block.freeList.end(); i++) {
+    VkDeviceSize rangeStart = i->first;
+    VkDeviceSize rangeEnd = i->first + i->second;
+    VkDeviceSize start = (rangeStart + alignment - 1) / alignment * alignment;
+    if (start + size > rangeEnd) {
+      continue;
+    }
+
+    // Split the free range. Any padding due to alignment stays free.
+    block.freeList.erase(i);
+    if (start > rangeStart) {
+      block.freeList[rangeStart] = start - rangeStart;
+    }
+    if (start + size < rangeEnd) {
+      block.freeList[start + size] = rangeEnd - (start + size);
+    }
+
+    out.allocator = this;
+    out.block = &block;
+    out.offset = start;
+    out.size = size;
+    block.used += size;
+    block.allocCount++;
+    return true;
+  }
+  return false;
+}
+
+int DeviceMemoryAllocator::alloc(MemoryRequirements& req,
+                                 VkMemoryPropertyFlags props, bool linear,
+                                 Suballocation& out) {
+  out.reset();
+  int typeI = req.indexOf(props);
+  if (typeI == -1) {
+    fprintf(stderr, "DeviceMemoryAllocator::alloc: indexOf returned -1\n");
+    return 1;
+  }
+  VkDeviceSize alignment = req.vk.alignment ? req.vk.alignment : 1;
+  VkDeviceSize size = req.vk.size;
+  VkMemoryPropertyFlags typeFlags =
+      dev.memProps.memoryTypes[typeI].propertyFlags;
+  if ((typeFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
+      !(typeFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+    // DeviceMemory::flush() and invalidate() round out to
+    // nonCoherentAtomSize, so a neighbor must not share an atom. Both are
+    // powers of two, so the larger one is a multiple of the smaller.
+    VkDeviceSize atom = dev.physProp.limits.nonCoherentAtomSize;
+    if (atom > alignment) {
+      alignment = atom;
+    }
+    size = (size + alignment - 1) / alignment * alignment;
+  }
+  bool dedicated = size > blockSize / 2;
+
+  if (!dedicated) {
+    for (auto& block : blocks) {
+      if (block->memoryTypeIndex != (uint32_t)typeI ||
+          block->linear != linear || block->dedicated) {
+        continue;
+      }
+      if (findRange(*block, size, alignment, out)) {
+        return 0;
+      }
+    }
+  }
+
+  // No room in any existing block. Allocate a new one.
+  std::unique_ptr<MemoryBlock> block(new MemoryBlock(dev));
+  block->memoryTypeIndex = typeI;
+  block->linear = linear;
+  block->dedicated = dedicated;
+  block->size = dedicated ? size : blockSize;
+  block->used = 0;
+  block->allocCount = 0;
+
+  VkMemoryAllocateInfo VkInit(info);
+  info.memoryTypeIndex = typeI;
+  for (;;) {
+    info.allocationSize = block->size;
+    VkResult v = vkAllocateMemory(dev.dev, &info, dev.dev.allocator,
+                                  &block->mem.vk);
+    if (v == VK_SUCCESS) {
+      break;
+    }
+    if (v == VK_ERROR_OUT_OF_DEVICE_MEMORY && block->size > size) {
+      // Small heaps may not have room for a full blockSize. Try smaller.
+      block->size = std::max(block->size / 2, size);
+      continue;
+    }
+    fprintf(stderr, "vkAllocateMemory failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  block->mem.allocSize = block->size;
+  block->mem.propertyFlags = dev.memProps.memoryTypes[typeI].propertyFlags;
+  block->freeList[0] = block->size;
+  blocks.emplace_back(std::move(block));
+
+  if (!findRange(**(blocks.end() - 1), size, alignment, out)) {
+    fprintf(stderr, "BUG: DeviceMemoryAllocator::alloc: new block is full\n");
+    return 1;
+  }
+  return 0;
+}
+
+void DeviceMemoryAllocator::free(Suballocation& sub) {
+  if (!sub.block) {
+    return;
+  }
+  MemoryBlock& block = *sub.block;
+  VkDeviceSize offset = sub.offset;
+  VkDeviceSize size = sub.size;
+  block.used -= sub.size;
+  block.allocCount--;
+  sub.allocator = nullptr;
+  sub.block = nullptr;
+  sub.offset = 0;
+  sub.size = 0;
+
+  // Coalesce with the free range that follows, if any.
+  auto next = block.freeList.lower_bound(offset);
+  if (next != block.freeList.end() && next->first == offset + size) {
+    size += next->second;
+    next = block.freeList.erase(next);
+  }
+  // Coalesce with the free range that precedes, if any.
+  if (next != block.freeList.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      block.freeList.erase(prev);
+    }
+  }
+  block.freeList[offset] = size;
+
+  if (block.allocCount) {
+    return;
+  }
+
+  // The block is now empty. Dedicated blocks are released right away. Other
+  // blocks are released only if another empty block of the same kind is kept
+  // around, so that a create-destroy-create pattern does not thrash.
+  size_t found = blocks.size();
+  bool keepOther = false;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    auto& b = *blocks.at(i);
+    if (&b == &block) {
+      found = i;
+    } else if (!b.allocCount && !b.dedicated &&
+               b.memoryTypeIndex == block.memoryTypeIndex &&
+               b.linear == block.linear) {
+      keepOther = true;
+    }
+  }
+  if (found == blocks.size()) {
+    fprintf(stderr, "BUG: DeviceMemoryAllocator::free: block not found\n");
+    return;
+  }
+  if (block.dedicated || keepOther) {
+    blocks.erase(blocks.begin() + found);
+  }
+}
+
+DeviceMemoryAllocator::Stats DeviceMemoryAllocator::getStats(
+    int memoryTypeIndex /*= -1*/) const {
+  Stats s;
+  memset(&s, 0, sizeof(s));
+  for (auto& block : blocks) {
+    if (memoryTypeIndex != -1 &&
+        block->memoryTypeIndex != (uint32_t)memoryTypeIndex) {
+      continue;
+    }
+    s.blockCount++;
+    s.allocCount += block->allocCount;
+    s.bytesReserved += block->size;
+    s.bytesUsed += block->used;
+    s.freeRangeCount += block->freeList.size();
+    for (auto& range : block->freeList) {
+      s.largestFreeRange = std::max(s.largestFreeRange, range.second);
+    }
+  }
+  return s;
+}
+
+void DeviceMemoryAllocator::dumpStats(FILE* f) const {
+  for (uint32_t i = 0; i < dev.memProps.memoryTypeCount; i++) {
+    Stats s = getStats(i);
+    if (!s.blockCount) {
+      continue;
+    }
+    fprintf(f,
+            "memoryType[%u]: %zu blocks, %zu allocs, 0x%lx of 0x%lx bytes "
+            "used, %zu free ranges, fragmentation %.2f\n",
+            i, s.blockCount, s.allocCount, s.bytesUsed, s.bytesReserved,
+            s.freeRangeCount, s.fragmentation());
+  }
+}
+
+}  // namespace memory
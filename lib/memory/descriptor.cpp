@@ -0,0 +1,323 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "memory.h"
+
+namespace memory {
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// appendFrom copies n T's from src, one every stride bytes, to the end of v.
+template <typename T>
+void appendFrom(std::vector<T>& v, const char* src, size_t n, size_t stride) {
+  size_t at = v.size();
+  v.resize(at + n);
+  for (size_t i = 0; i < n; i++) {
+    memcpy(&v.at(at + i), src + i * stride, sizeof(T));
+  }
+}
+
+const char* kindName[] = {"invalid", "imageInfo", "bufferInfo",
+                          "VkBufferView"};
+
+}  // anonymous namespace
+
+int DescriptorAllocator::addPool(const DescriptorSetLayout& layout) {
+  // Count the descriptors one set of layout needs, so the new pool can hold
+  // setsPerPool of them even if ratios does not mention its types.
+  const uint32_t sets = std::max(setsPerPool, 1u);
+  std::map<VkDescriptorType, uint32_t> need;
+  for (size_t i = 0; i < layout.types.size(); i++) {
+    need[layout.types.at(i)] += layout.counts.at(i);
+  }
+  std::map<VkDescriptorType, uint32_t> counts;
+  for (auto& r : ratios) {
+    counts[r.type] += (uint32_t)ceilf(r.perSet * sets);
+  }
+  for (auto& n : need) {
+    counts[n.first] = std::max(counts[n.first], n.second * sets);
+  }
+  std::vector<VkDescriptorPoolSize> sizes;
+  for (auto& c : counts) {
+    if (!c.second) {
+      continue;
+    }
+    sizes.emplace_back();
+    VkOverwrite(sizes.back());
+    sizes.back().type = c.first;
+    sizes.back().descriptorCount = c.second;
+  }
+  if (sizes.empty()) {
+    fprintf(stderr, "DescriptorAllocator: layout and ratios are empty\n");
+    return 1;
+  }
+
+  pools.emplace_back(new DescriptorPool(dev));
+  DescriptorPool& pool = *pools.back();
+  if (transient) {
+    pool.flags &= ~VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+  }
+  if (pool.ctorError(sets, sizes)) {
+    pools.pop_back();
+    return 1;
+  }
+  current = pools.size() - 1;
+  return 0;
+}
+
+std::unique_ptr<DescriptorSet> DescriptorAllocator::alloc(
+    const DescriptorSetLayout& layout) {
+  // The Vulkan spec says to ignore the exact error code: a full pool may
+  // return VK_ERROR_FRAGMENTED_POOL, VK_ERROR_OUT_OF_POOL_MEMORY_KHR or (on
+  // older drivers) VK_ERROR_OUT_OF_DEVICE_MEMORY. Try every pool, starting
+  // with current, then a new pool. Only a new pool failing is an error.
+  for (size_t tries = 0; tries < pools.size(); tries++) {
+    size_t i = (current + tries) % pools.size();
+    std::unique_ptr<DescriptorSet> set(new DescriptorSet(*pools.at(i)));
+    if (set->alloc(layout) == VK_SUCCESS) {
+      current = i;
+      return set;
+    }
+  }
+  if (addPool(layout)) {
+    return std::unique_ptr<DescriptorSet>();
+  }
+  std::unique_ptr<DescriptorSet> set(new DescriptorSet(*pools.back()));
+  if (set->ctorError(layout)) {
+    fprintf(stderr, "DescriptorAllocator: a new pool is full (%zu pools)\n",
+            pools.size());
+    return std::unique_ptr<DescriptorSet>();
+  }
+  return set;
+}
+
+int DescriptorAllocator::reset() {
+  if (!transient) {
+    fprintf(stderr, "BUG: DescriptorAllocator::reset requires transient\n");
+    return 1;
+  }
+  for (auto& pool : pools) {
+    if (pool->reset()) {
+      return 1;
+    }
+  }
+  current = 0;
+  return 0;
+}
+
+DescriptorWriter::Kind DescriptorWriter::kindOf(VkDescriptorType t) {
+  switch (t) {
+    case VK_DESCRIPTOR_TYPE_SAMPLER:
+    case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+    case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+    case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+    case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT:
+      return IMAGE;
+    case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+    case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+    case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+    case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+      return BUFFER;
+    case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
+    case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER:
+      return TEXEL;
+    default:
+      return INVALID;
+  }
+}
+
+int DescriptorWriter::add(DescriptorSet& set, uint32_t binding,
+                          uint32_t arrayI, Kind kind, const char* src,
+                          size_t n, size_t stride) {
+  if (binding >= set.types.size()) {
+    fprintf(stderr,
+            "DescriptorWriter::write(%u, %s): binding=%u with only %zu "
+            "bindings\n",
+            binding, kindName[kind], binding, set.types.size());
+    return 1;
+  }
+  VkDescriptorType t = set.types.at(binding);
+  if (kind == INVALID || kindOf(t) != kind) {
+    fprintf(stderr, "DescriptorWriter::write(%u, %s): binding=%u has type %s\n",
+            binding, kindName[kind], binding, string_VkDescriptorType(t));
+    return 1;
+  }
+  if (!n) {
+    fprintf(stderr, "DescriptorWriter::write(%u, %s): no descriptors\n",
+            binding, kindName[kind]);
+    return 1;
+  }
+  writes.emplace_back();
+  VkWriteDescriptorSet& w = writes.back();
+  VkOverwrite(w);
+  w.dstSet = set.vk;
+  w.dstBinding = binding;
+  w.dstArrayElement = arrayI;
+  w.descriptorType = t;
+  w.descriptorCount = n;
+  switch (kind) {
+    case IMAGE:
+      first.emplace_back(images.size());
+      appendFrom(images, src, n, stride);
+      break;
+    case BUFFER:
+      first.emplace_back(buffers.size());
+      appendFrom(buffers, src, n, stride);
+      break;
+    default:
+      first.emplace_back(views.size());
+      appendFrom(views, src, n, stride);
+      break;
+  }
+  return 0;
+}
+
+int DescriptorWriter::write(
+    DescriptorSet& set, uint32_t binding,
+    const std::vector<VkDescriptorImageInfo>& imageInfo,
+    uint32_t arrayI /*= 0*/) {
+  return add(set, binding, arrayI, IMAGE, (const char*)imageInfo.data(),
+             imageInfo.size(), sizeof(imageInfo[0]));
+}
+
+int DescriptorWriter::write(
+    DescriptorSet& set, uint32_t binding,
+    const std::vector<VkDescriptorBufferInfo>& bufferInfo,
+    uint32_t arrayI /*= 0*/) {
+  return add(set, binding, arrayI, BUFFER, (const char*)bufferInfo.data(),
+             bufferInfo.size(), sizeof(bufferInfo[0]));
+}
+
+int DescriptorWriter::write(
+    DescriptorSet& set, uint32_t binding,
+    const std::vector<VkBufferView>& texelBufferViewInfo,
+    uint32_t arrayI /*= 0*/) {
+  return add(set, binding, arrayI, TEXEL,
+             (const char*)texelBufferViewInfo.data(),
+             texelBufferViewInfo.size(), sizeof(texelBufferViewInfo[0]));
+}
+
+void DescriptorWriter::flush() {
+  if (writes.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < writes.size(); i++) {
+    auto& w = writes.at(i);
+    switch (kindOf(w.descriptorType)) {
+      case IMAGE:
+        w.pImageInfo = &images.at(first.at(i));
+        break;
+      case BUFFER:
+        w.pBufferInfo = &buffers.at(first.at(i));
+        break;
+      default:
+        w.pTexelBufferView = &views.at(first.at(i));
+        break;
+    }
+  }
+  vkUpdateDescriptorSets(dev.dev, writes.size(), writes.data(), 0, nullptr);
+  clear();
+}
+
+void DescriptorWriter::clear() {
+  writes.clear();
+  first.clear();
+  images.clear();
+  buffers.clear();
+  views.clear();
+}
+
+DescriptorUpdateTemplate::~DescriptorUpdateTemplate() { reset(); }
+
+void DescriptorUpdateTemplate::reset() {
+  if (vk != VK_NULL_HANDLE && destroyFn) {
+    destroyFn(dev.dev, vk, dev.dev.allocator);
+  }
+  vk = VK_NULL_HANDLE;
+}
+
+bool DescriptorUpdateTemplate::isEnabled(const language::Device& dev) {
+  for (auto name : dev.extensionRequests) {
+    if (!strcmp(name, VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int DescriptorUpdateTemplate::ctorError(
+    const DescriptorSetLayout& layout,
+    const std::vector<VkDescriptorUpdateTemplateEntryKHR>& entries) {
+  reset();
+  if (entries.empty()) {
+    fprintf(stderr, "DescriptorUpdateTemplate: no entries\n");
+    return 1;
+  }
+  for (auto& e : entries) {
+    if (e.dstBinding >= layout.types.size() ||
+        layout.types.at(e.dstBinding) != e.descriptorType ||
+        DescriptorWriter::kindOf(e.descriptorType) ==
+            DescriptorWriter::INVALID ||
+        !e.descriptorCount) {
+      fprintf(stderr,
+              "DescriptorUpdateTemplate: entry for binding=%u type %s does "
+              "not match the layout\n",
+              e.dstBinding, string_VkDescriptorType(e.descriptorType));
+      return 1;
+    }
+  }
+  this->entries = entries;
+  if (!isEnabled(dev)) {
+    return 0;  // update() uses fallback.
+  }
+
+  auto createFn = (PFN_vkCreateDescriptorUpdateTemplateKHR)vkGetDeviceProcAddr(
+      dev.dev, "vkCreateDescriptorUpdateTemplateKHR");
+  updateFn = (PFN_vkUpdateDescriptorSetWithTemplateKHR)vkGetDeviceProcAddr(
+      dev.dev, "vkUpdateDescriptorSetWithTemplateKHR");
+  destroyFn = (PFN_vkDestroyDescriptorUpdateTemplateKHR)vkGetDeviceProcAddr(
+      dev.dev, "vkDestroyDescriptorUpdateTemplateKHR");
+  if (!createFn || !updateFn || !destroyFn) {
+    fprintf(stderr, "DescriptorUpdateTemplate: vkGetDeviceProcAddr failed\n");
+    return 1;
+  }
+  VkDescriptorUpdateTemplateCreateInfoKHR VkInit(info);
+  info.descriptorUpdateEntryCount = this->entries.size();
+  info.pDescriptorUpdateEntries = this->entries.data();
+  info.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET_KHR;
+  info.descriptorSetLayout = layout.vk;
+  VkResult v = createFn(dev.dev, &info, dev.dev.allocator, &vk);
+  if (v != VK_SUCCESS) {
+    vk = VK_NULL_HANDLE;
+    fprintf(stderr, "vkCreateDescriptorUpdateTemplateKHR failed: %d (%s)\n",
+            v, string_VkResult(v));
+    return 1;
+  }
+  return 0;
+}
+
+int DescriptorUpdateTemplate::update(DescriptorSet& set, const void* data) {
+  if (vk != VK_NULL_HANDLE) {
+    updateFn(dev.dev, set.vk, vk, data);
+    return 0;
+  }
+  if (entries.empty()) {
+    fprintf(stderr, "BUG: DescriptorUpdateTemplate::update before ctorError\n");
+    return 1;
+  }
+  for (auto& e : entries) {
+    if (fallback.add(set, e.dstBinding, e.dstArrayElement,
+                     DescriptorWriter::kindOf(e.descriptorType),
+                     (const char*)data + e.offset, e.descriptorCount,
+                     e.stride)) {
+      fallback.clear();
+      return 1;
+    }
+  }
+  fallback.flush();
+  return 0;
+}
+
+}  // namespace memory
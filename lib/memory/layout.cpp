@@ -1,6 +1,7 @@
 /* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
  */
 #include <lib/science/science.h>
+#include <algorithm>
 #include "memory.h"
 
 using namespace science;
@@ -152,8 +153,15 @@ int Image::makeTransitionAccessMasks(VkImageMemoryBarrier& imageB) {
 }
 
 VkImageMemoryBarrier Image::makeTransition(VkImageLayout newLayout) {
+  return makeTransition(currentLayout, newLayout, 0, info.mipLevels);
+}
+
+VkImageMemoryBarrier Image::makeTransition(VkImageLayout oldLayout,
+                                           VkImageLayout newLayout,
+                                           uint32_t baseMip,
+                                           uint32_t mipCount) {
   VkImageMemoryBarrier VkInit(imageB);
-  imageB.oldLayout = currentLayout;
+  imageB.oldLayout = oldLayout;
   imageB.newLayout = newLayout;
   imageB.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
   imageB.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -163,9 +171,96 @@ VkImageMemoryBarrier Image::makeTransition(VkImageLayout newLayout) {
     imageB.image = VK_NULL_HANDLE;
     return imageB;
   }
+  // makeTransitionAccessMasks() may reset subresourceRange for a depth
+  // layout, so set the range after it.
+  SubresUpdate(imageB.subresourceRange)
+      .setMips(baseMip, mipCount)
+      .setLayer(0, info.arrayLayers);
 
   imageB.image = vk;
   return imageB;
 }
 
+uint32_t Image::fullMipLevels(const VkExtent3D& extent) {
+  uint32_t levels = 1;
+  uint32_t d = std::max(std::max(extent.width, extent.height), extent.depth);
+  for (; d > 1; d >>= 1) {
+    levels++;
+  }
+  return levels;
+}
+
+bool Image::canGenerateMips(language::Device& dev, VkFormat format) {
+  VkFormatFeatureFlags want = VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+                              VK_FORMAT_FEATURE_BLIT_DST_BIT |
+                              VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+  return (dev.formatProperties(format).optimalTilingFeatures & want) == want;
+}
+
+int Image::generateMips(command::CommandBuilder& builder, uint32_t baseLayer,
+                        uint32_t layerCount) {
+  if (info.mipLevels < 2) {
+    return 0;
+  }
+  if (currentLayout != VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL ||
+      baseLayer + layerCount > info.arrayLayers) {
+    fprintf(stderr, "generateMips: layout %s, layers %u + %u of %u\n",
+            string_VkImageLayout(currentLayout), baseLayer, layerCount,
+            info.arrayLayers);
+    return 1;
+  }
+
+  // Level i - 1 moves to TRANSFER_SRC_OPTIMAL to be blitted to level i, and
+  // back to TRANSFER_DST_OPTIMAL in the barrier of the next level.
+  command::CommandBuilder::BarrierSet bset;
+  for (uint32_t i = 1; i <= info.mipLevels; i++) {
+    bset.img.clear();
+    if (i > 1) {
+      bset.img.emplace_back(makeTransition(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                           i - 2, 1));
+    }
+    if (i < info.mipLevels) {
+      bset.img.emplace_back(makeTransition(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                           i - 1, 1));
+    }
+    for (auto& b : bset.img) {
+      SubresUpdate(b.subresourceRange).setLayer(baseLayer, layerCount);
+    }
+    if (builder.barrier(bset, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT)) {
+      return 1;
+    }
+    if (i == info.mipLevels) {
+      break;
+    }
+
+    std::vector<VkImageBlit> regions(1);
+    VkImageBlit& blit = regions.at(0);
+    Subres(blit.srcSubresource)
+        .addColor()
+        .setMip(i - 1)
+        .setLayer(baseLayer, layerCount);
+    Subres(blit.dstSubresource)
+        .addColor()
+        .setMip(i)
+        .setLayer(baseLayer, layerCount);
+    blit.srcOffsets[0] = {0, 0, 0};
+    blit.srcOffsets[1] = {(int32_t)std::max(info.extent.width >> (i - 1), 1u),
+                          (int32_t)std::max(info.extent.height >> (i - 1), 1u),
+                          (int32_t)std::max(info.extent.depth >> (i - 1), 1u)};
+    blit.dstOffsets[0] = {0, 0, 0};
+    blit.dstOffsets[1] = {(int32_t)std::max(info.extent.width >> i, 1u),
+                          (int32_t)std::max(info.extent.height >> i, 1u),
+                          (int32_t)std::max(info.extent.depth >> i, 1u)};
+    if (builder.blitImage(vk, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vk,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regions,
+                          VK_FILTER_LINEAR)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 }  // namespace memory
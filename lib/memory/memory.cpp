@@ -11,7 +11,9 @@ int DeviceMemory::alloc(MemoryRequirements req, VkMemoryPropertyFlags props) {
     fprintf(stderr, "DeviceMemory::alloc: indexOf returned not found\n");
     return 1;
   }
+  sub.reset();
   vk.reset();
+  mapped = nullptr;
   VkResult v =
       vkAllocateMemory(req.dev.dev, &req.vkalloc, req.dev.dev.allocator, &vk);
   if (v != VK_SUCCESS) {
@@ -19,13 +21,51 @@ int DeviceMemory::alloc(MemoryRequirements req, VkMemoryPropertyFlags props) {
             string_VkResult(v));
     return 1;
   }
+  allocSize = req.vkalloc.allocationSize;
+  propertyFlags =
+      req.dev.memProps.memoryTypes[req.vkalloc.memoryTypeIndex].propertyFlags;
   return 0;
 }
 
+int DeviceMemory::alloc(MemoryRequirements req, VkMemoryPropertyFlags props,
+                        DeviceMemoryAllocator& allocator, bool linear) {
+  vk.reset();
+  sub.reset();
+  mapped = nullptr;
+  if (allocator.alloc(req, props, linear, sub)) {
+    return 1;
+  }
+  allocSize = sub.size;
+  propertyFlags = sub.block->mem.propertyFlags;
+  return 0;
+}
+
+VkDeviceMemory DeviceMemory::memory() const {
+  if (sub.block) {
+    return sub.block->mem.vk;
+  }
+  return vk;
+}
+
 int DeviceMemory::mmap(language::Device& dev, void** pData,
                        VkDeviceSize offset /*= 0*/,
                        VkDeviceSize size /*= VK_WHOLE_SIZE*/,
                        VkMemoryMapFlags flags /*= 0*/) {
+  if (mapped || sub.block) {
+    // Keep the mapping inside this allocation.
+    if (offset > allocSize ||
+        (size != VK_WHOLE_SIZE && offset + size > allocSize)) {
+      fprintf(stderr,
+              "DeviceMemory::mmap(offset=0x%lx, size=0x%lx) but only 0x%lx\n",
+              offset, size, allocSize);
+      return 1;
+    }
+    if (mapPersistent(dev)) {
+      return 1;
+    }
+    *pData = ((char*)mapped) + offset;
+    return 0;
+  }
   VkResult v = vkMapMemory(dev.dev, vk, offset, size, flags, pData);
   if (v != VK_SUCCESS) {
     fprintf(stderr, "vkMapMemory failed: %d (%s)\n", v, string_VkResult(v));
@@ -34,7 +74,107 @@ int DeviceMemory::mmap(language::Device& dev, void** pData,
   return 0;
 }
 
-void DeviceMemory::munmap(language::Device& dev) { vkUnmapMemory(dev.dev, vk); }
+void DeviceMemory::munmap(language::Device& dev) {
+  if (mapped || sub.block) {
+    return;
+  }
+  vkUnmapMemory(dev.dev, vk);
+}
+
+int DeviceMemory::mapPersistent(language::Device& dev) {
+  if (mapped) {
+    return 0;
+  }
+  if (!(propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+    fprintf(stderr, "DeviceMemory::mapPersistent: not HOST_VISIBLE (0x%x)\n",
+            propertyFlags);
+    return 1;
+  }
+  if (sub.block) {
+    // Map the whole MemoryBlock once. Every Suballocation in it can then use
+    // the same mapping.
+    if (sub.block->mem.mapPersistent(dev)) {
+      return 1;
+    }
+    mapped = ((char*)sub.block->mem.mapped) + sub.offset;
+    return 0;
+  }
+  VkResult v = vkMapMemory(dev.dev, vk, 0, VK_WHOLE_SIZE, 0, &mapped);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkMapMemory failed: %d (%s)\n", v, string_VkResult(v));
+    mapped = nullptr;
+    return 1;
+  }
+  return 0;
+}
+
+int DeviceMemory::mappedRange(language::Device& dev, VkDeviceSize offset,
+                              VkDeviceSize size, VkMappedMemoryRange& range) {
+  if (offset > allocSize ||
+      (size != VK_WHOLE_SIZE && offset + size > allocSize)) {
+    fprintf(stderr,
+            "DeviceMemory::mappedRange(offset=0x%lx, size=0x%lx) but only "
+            "0x%lx\n",
+            offset, size, allocSize);
+    return 1;
+  }
+  if (size == VK_WHOLE_SIZE) {
+    size = allocSize - offset;
+  }
+
+  // The range must be a multiple of nonCoherentAtomSize, or extend to the end
+  // of the VkDeviceMemory.
+  VkDeviceSize atom = dev.physProp.limits.nonCoherentAtomSize;
+  if (!atom) {
+    atom = 1;
+  }
+  VkDeviceSize start = (sub.offset + offset) / atom * atom;
+  VkDeviceSize end = (sub.offset + offset + size + atom - 1) / atom * atom;
+  VkDeviceSize memSize = sub.block ? sub.block->mem.allocSize : allocSize;
+
+  VkOverwrite(range);
+  range.memory = memory();
+  range.offset = start;
+  range.size = (end >= memSize) ? VK_WHOLE_SIZE : end - start;
+  return 0;
+}
+
+int DeviceMemory::flush(language::Device& dev, VkDeviceSize offset /*= 0*/,
+                        VkDeviceSize size /*= VK_WHOLE_SIZE*/) {
+  if (isCoherent()) {
+    return 0;
+  }
+  VkMappedMemoryRange range;
+  if (mappedRange(dev, offset, size, range)) {
+    return 1;
+  }
+  VkResult v = vkFlushMappedMemoryRanges(dev.dev, 1, &range);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkFlushMappedMemoryRanges failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  return 0;
+}
+
+int DeviceMemory::invalidate(language::Device& dev,
+                             VkDeviceSize offset /*= 0*/,
+                             VkDeviceSize size /*= VK_WHOLE_SIZE*/) {
+  if (isCoherent()) {
+    return 0;
+  }
+  VkMappedMemoryRange range;
+  if (mappedRange(dev, offset, size, range)) {
+    return 1;
+  }
+  VkResult v = vkInvalidateMappedMemoryRanges(dev.dev, 1, &range);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkInvalidateMappedMemoryRanges failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+  return 0;
+}
 
 int Image::ctorError(language::Device& dev, VkMemoryPropertyFlags props) {
   if (!info.extent.width || !info.extent.height || !info.extent.depth ||
@@ -51,11 +191,16 @@ int Image::ctorError(language::Device& dev, VkMemoryPropertyFlags props) {
   }
   currentLayout = info.initialLayout;
 
+  if (suballocator) {
+    return mem.alloc({dev, vk}, props, *suballocator,
+                     info.tiling == VK_IMAGE_TILING_LINEAR);
+  }
   return mem.alloc({dev, vk}, props);
 }
 
 int Image::bindMemory(language::Device& dev, VkDeviceSize offset /*= 0*/) {
-  VkResult v = vkBindImageMemory(dev.dev, vk, mem.vk, offset);
+  VkResult v =
+      vkBindImageMemory(dev.dev, vk, mem.memory(), mem.offset() + offset);
   if (v != VK_SUCCESS) {
     fprintf(stderr, "vkBindImageMemory failed: %d (%s)\n", v,
             string_VkResult(v));
@@ -77,11 +222,15 @@ int Buffer::ctorError(language::Device& dev, VkMemoryPropertyFlags props) {
     return 1;
   }
 
+  if (suballocator) {
+    return mem.alloc({dev, vk}, props, *suballocator, true /*linear*/);
+  }
   return mem.alloc({dev, vk}, props);
 }
 
 int Buffer::bindMemory(language::Device& dev, VkDeviceSize offset /*= 0*/) {
-  VkResult v = vkBindBufferMemory(dev.dev, vk, mem.vk, offset);
+  VkResult v =
+      vkBindBufferMemory(dev.dev, vk, mem.memory(), mem.offset() + offset);
   if (v != VK_SUCCESS) {
     fprintf(stderr, "vkBindBufferMemory failed: %d (%s)\n", v,
             string_VkResult(v));
@@ -92,28 +241,11 @@ int Buffer::bindMemory(language::Device& dev, VkDeviceSize offset /*= 0*/) {
 
 int Buffer::copyFromHost(language::Device& dev, const void* src, size_t len,
                          VkDeviceSize dstOffset /*= 0*/) {
-  if (!(info.usage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)) {
+  if (!(mem.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
     fprintf(stderr,
-            "WARNING: Buffer::copyFromHost on a Buffer where neither "
-            "ctorHostVisible nor ctorHostCoherent was used.\n"
-            "WARNING: usage = 0x%x",
-            info.usage);
-
-    // Dump info.usage bits.
-    const char* firstPrefix = " (";
-    const char* prefix = firstPrefix;
-    for (uint64_t bit = 1; bit < VK_BUFFER_USAGE_FLAG_BITS_MAX_ENUM;
-         bit <<= 1) {
-      if (((uint64_t)info.usage) & bit) {
-        fprintf(stderr, "%s%s", prefix,
-                string_VkBufferUsageFlagBits((VkBufferUsageFlagBits)bit));
-        prefix = " | ";
-      }
-    }
-    if (prefix != firstPrefix) {
-      fprintf(stderr, ")");
-    }
-    fprintf(stderr, "\n");
+            "WARNING: Buffer::copyFromHost on a Buffer that is not "
+            "HOST_VISIBLE.\n"
+            "WARNING: use ctorHostVisible or ctorHostCoherent.\n");
     return 1;
   }
 
@@ -125,12 +257,43 @@ int Buffer::copyFromHost(language::Device& dev, const void* src, size_t len,
     return 1;
   }
 
-  void* mapped;
-  if (mem.mmap(dev, &mapped)) {
+  // The first copyFromHost maps the memory. It then stays mapped so the
+  // next copyFromHost is just a memcpy.
+  if (mem.mapPersistent(dev)) {
+    return 1;
+  }
+  memcpy(((char*)mem.mapped) + dstOffset, src, len);
+  return mem.flush(dev, dstOffset, len);
+}
+
+int UniformRing::ctorError(language::Device& dev, size_t nBytes,
+                           size_t frames) {
+  if (!nBytes || !frames) {
+    fprintf(stderr, "UniformRing::ctorError(%zu, %zu): invalid\n", nBytes,
+            frames);
+    return 1;
+  }
+  auto& limits = dev.physProp.limits;
+  if (nBytes > limits.maxUniformBufferRange) {
+    fprintf(stderr, "UniformRing::ctorError: %zu > maxUniformBufferRange %u\n",
+            nBytes, limits.maxUniformBufferRange);
+    return 1;
+  }
+  VkDeviceSize align = limits.minUniformBufferOffsetAlignment;
+  if (!align) {
+    align = 1;
+  }
+  this->nBytes = nBytes;
+  sliceSize = (nBytes + align - 1) / align * align;
+  this->frames = frames;
+  frameI = 0;
+
+  info.size = sliceSize * frames;
+  info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+  if (Buffer::ctorError(dev, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
+      bindMemory(dev) || mem.mapPersistent(dev)) {
     return 1;
   }
-  memcpy(((char*)mapped) + dstOffset, src, len);
-  mem.munmap(dev);
   return 0;
 }
 
@@ -185,9 +348,6 @@ VkMemoryAllocateInfo* MemoryRequirements::ofProps(VkMemoryPropertyFlags props) {
 
 int DescriptorPool::ctorError(uint32_t maxSets,
                               std::vector<VkDescriptorType> maxDescriptors) {
-  VkDescriptorPoolCreateInfo VkInit(info);
-  info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-
   // Vulkan Spec says: "If multiple VkDescriptorPoolSize structures appear in
   // the pPoolSizes array then the pool will be created with enough storage
   // for the total number of descriptors of each type."
@@ -203,8 +363,15 @@ int DescriptorPool::ctorError(uint32_t maxSets,
     poolSize.type = dType;
     poolSize.descriptorCount = 1;
   }
-  info.poolSizeCount = poolSizes.size();
-  info.pPoolSizes = poolSizes.data();
+  return ctorError(maxSets, poolSizes);
+}
+
+int DescriptorPool::ctorError(uint32_t maxSets,
+                              const std::vector<VkDescriptorPoolSize>& sizes) {
+  VkDescriptorPoolCreateInfo VkInit(info);
+  info.flags = flags;
+  info.poolSizeCount = sizes.size();
+  info.pPoolSizes = sizes.data();
   info.maxSets = maxSets;
 
   vk.reset();
@@ -221,11 +388,14 @@ int DescriptorPool::ctorError(uint32_t maxSets,
 int DescriptorSetLayout::ctorError(
     language::Device& dev,
     const std::vector<VkDescriptorSetLayoutBinding>& bindings) {
-  // Save the descriptor types that make up this layout.
+  // Save the descriptor types and counts that make up this layout.
   types.clear();
   types.reserve(bindings.size());
+  counts.clear();
+  counts.reserve(bindings.size());
   for (auto& binding : bindings) {
     types.emplace_back(binding.descriptorType);
+    counts.emplace_back(binding.descriptorCount);
   }
 
   VkDescriptorSetLayoutCreateInfo VkInit(info);
@@ -244,6 +414,10 @@ int DescriptorSetLayout::ctorError(
 }
 
 DescriptorSet::~DescriptorSet() {
+  if (!vk ||
+      !(pool.flags & VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT)) {
+    return;  // Nothing to free, or only pool.reset() can free it.
+  }
   VkResult v = vkFreeDescriptorSets(pool.dev.dev, pool.vk, 1, &vk);
   if (v != VK_SUCCESS) {
     fprintf(stderr, "vkFreeDescriptorSets failed: %d (%s)\n", v,
@@ -252,7 +426,7 @@ DescriptorSet::~DescriptorSet() {
   }
 }
 
-int DescriptorSet::ctorError(const DescriptorSetLayout& layout) {
+VkResult DescriptorSet::alloc(const DescriptorSetLayout& layout) {
   types = layout.types;
   const VkDescriptorSetLayout& setLayout = layout.vk;
 
@@ -262,6 +436,14 @@ int DescriptorSet::ctorError(const DescriptorSetLayout& layout) {
   info.pSetLayouts = &setLayout;
 
   VkResult v = vkAllocateDescriptorSets(pool.dev.dev, &info, &vk);
+  if (v != VK_SUCCESS) {
+    vk = VK_NULL_HANDLE;
+  }
+  return v;
+}
+
+int DescriptorSet::ctorError(const DescriptorSetLayout& layout) {
+  VkResult v = alloc(layout);
   if (v != VK_SUCCESS) {
     fprintf(stderr,
             "vkAllocateDescriptorSets failed: %d (%s)\n"
@@ -269,7 +451,8 @@ int DescriptorSet::ctorError(const DescriptorSetLayout& layout) {
             "1. Ignore the exact error code returned.\n"
             "2. Try creating a new DescriptorPool.\n"
             "3. Retry DescriptorSet::ctorError().\n"
-            "4. If that fails, abort.\n",
+            "4. If that fails, abort.\n"
+            "DescriptorAllocator does this for you.\n",
             v, string_VkResult(v));
     return 1;
   }
@@ -277,100 +460,35 @@ int DescriptorSet::ctorError(const DescriptorSetLayout& layout) {
 }
 
 int DescriptorSet::write(uint32_t binding,
-                         const std::vector<VkDescriptorImageInfo> imageInfo,
+                         const std::vector<VkDescriptorImageInfo>& imageInfo,
                          uint32_t arrayI /*= 0*/) {
-  if (binding > types.size()) {
-    fprintf(stderr,
-            "DescriptorSet::write(%u, imageInfo): binding=%u with only %zu "
-            "bindings\n",
-            binding, binding, types.size());
+  DescriptorWriter w(pool.dev);
+  if (w.write(*this, binding, imageInfo, arrayI)) {
     return 1;
   }
-  switch (types.at(binding)) {
-    case VK_DESCRIPTOR_TYPE_SAMPLER:
-    case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
-    case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
-    case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
-      break;
-    default:
-      fprintf(stderr,
-              "DescriptorSet::write(%u, imageInfo): binding=%u has type %s\n",
-              binding, binding, string_VkDescriptorType(types.at(binding)));
-      return 1;
-  }
-  VkWriteDescriptorSet VkInit(w);
-  w.dstSet = vk;
-  w.dstBinding = binding;
-  w.dstArrayElement = arrayI;
-  w.descriptorType = types.at(binding);
-  w.descriptorCount = imageInfo.size();
-  w.pImageInfo = imageInfo.data();
-  vkUpdateDescriptorSets(pool.dev.dev, 1, &w, 0, nullptr);
+  w.flush();
   return 0;
 }
 
 int DescriptorSet::write(uint32_t binding,
-                         const std::vector<VkDescriptorBufferInfo> bufferInfo,
+                         const std::vector<VkDescriptorBufferInfo>& bufferInfo,
                          uint32_t arrayI /*= 0*/) {
-  if (binding > types.size()) {
-    fprintf(stderr,
-            "DescriptorSet::write(%u, bufferInfo): binding=%u with only %zu "
-            "bindings\n",
-            binding, binding, types.size());
+  DescriptorWriter w(pool.dev);
+  if (w.write(*this, binding, bufferInfo, arrayI)) {
     return 1;
   }
-  switch (types.at(binding)) {
-    case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
-    case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
-    case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
-    case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
-      break;
-    default:
-      fprintf(stderr,
-              "DescriptorSet::write(%u, bufferInfo): binding=%u has type %s\n",
-              binding, binding, string_VkDescriptorType(types.at(binding)));
-      return 1;
-  }
-  VkWriteDescriptorSet VkInit(w);
-  w.dstSet = vk;
-  w.dstBinding = binding;
-  w.dstArrayElement = arrayI;
-  w.descriptorType = types.at(binding);
-  w.descriptorCount = bufferInfo.size();
-  w.pBufferInfo = bufferInfo.data();
-  vkUpdateDescriptorSets(pool.dev.dev, 1, &w, 0, nullptr);
+  w.flush();
   return 0;
 }
 
 int DescriptorSet::write(uint32_t binding,
-                         const std::vector<VkBufferView> texelBufferViewInfo,
+                         const std::vector<VkBufferView>& texelBufferViewInfo,
                          uint32_t arrayI /*= 0*/) {
-  if (binding > types.size()) {
-    fprintf(stderr,
-            "DescriptorSet::write(%u, VkBufferView): binding=%u with only %zu "
-            "bindings\n",
-            binding, binding, types.size());
+  DescriptorWriter w(pool.dev);
+  if (w.write(*this, binding, texelBufferViewInfo, arrayI)) {
     return 1;
   }
-  switch (types.at(binding)) {
-    case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
-    case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER:
-      break;
-    default:
-      fprintf(
-          stderr,
-          "DescriptorSet::write(%u, VkBufferView): binding=%u has type %s\n",
-          binding, binding, string_VkDescriptorType(types.at(binding)));
-      return 1;
-  }
-  VkWriteDescriptorSet VkInit(w);
-  w.dstSet = vk;
-  w.dstBinding = binding;
-  w.dstArrayElement = arrayI;
-  w.descriptorType = types.at(binding);
-  w.descriptorCount = texelBufferViewInfo.size();
-  w.pTexelBufferView = texelBufferViewInfo.data();
-  vkUpdateDescriptorSets(pool.dev.dev, 1, &w, 0, nullptr);
+  w.flush();
   return 0;
 }
 
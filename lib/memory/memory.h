@@ -7,14 +7,37 @@
  */
 
 #include <lib/command/command.h>
+#include <lib/job/job.h>
 #include <lib/language/VkInit.h>
 #include <lib/language/language.h>
+#include <map>
+#include <memory>
 
 #pragma once
 
 namespace memory {
 
 struct MemoryRequirements;
+struct MemoryBlock;
+struct DeviceMemoryAllocator;
+
+// Suballocation is a range of bytes inside a MemoryBlock. It is handed out by
+// DeviceMemoryAllocator::alloc() and is returned to the allocator when the
+// Suballocation is destroyed (or reset() is called).
+typedef struct Suballocation {
+  Suballocation() : allocator(nullptr), block(nullptr), offset(0), size(0) {}
+  Suballocation(Suballocation&& other);
+  Suballocation(const Suballocation&) = delete;
+  ~Suballocation() { reset(); }
+
+  // reset() returns the range to the DeviceMemoryAllocator.
+  void reset();
+
+  DeviceMemoryAllocator* allocator;
+  MemoryBlock* block;  // nullptr if this Suballocation is empty.
+  VkDeviceSize offset;
+  VkDeviceSize size;
+} Suballocation;
 
 // DeviceMemory represents a raw chunk of bytes that can be accessed by the
 // device. Because GPUs are in everything now, the memory may not be physically
@@ -32,7 +55,11 @@ struct MemoryRequirements;
 // By using the overloaded constructors in MemoryRequirements,
 // DeviceMemory::alloc() is kept simple.
 typedef struct DeviceMemory {
-  DeviceMemory(language::Device& dev) : vk{dev.dev, vkFreeMemory} {
+  DeviceMemory(language::Device& dev)
+      : vk{dev.dev, vkFreeMemory},
+        mapped(nullptr),
+        allocSize(0),
+        propertyFlags(0) {
     vk.allocator = dev.dev.allocator;
   }
 
@@ -42,23 +69,174 @@ typedef struct DeviceMemory {
   WARN_UNUSED_RESULT int alloc(MemoryRequirements req,
                                VkMemoryPropertyFlags props);
 
+  // alloc() with a DeviceMemoryAllocator does not call vkAllocateMemory().
+  // Instead it reserves a range in a larger MemoryBlock. 'linear' must be
+  // true for a VkBuffer or an Image with VK_IMAGE_TILING_LINEAR, and false
+  // for an Image with VK_IMAGE_TILING_OPTIMAL.
+  WARN_UNUSED_RESULT int alloc(MemoryRequirements req,
+                               VkMemoryPropertyFlags props,
+                               DeviceMemoryAllocator& allocator, bool linear);
+
   // mmap() calls vkMapMemory() and returns non-zero on error.
   // NOTE: The vkMapMemory spec currently says "flags is reserved for future
   // use." You probably can ignore the flags parameter.
+  //
+  // If this DeviceMemory is persistently mapped (see mapPersistent), mmap()
+  // just returns a pointer into the existing mapping.
+  //
+  // If this DeviceMemory is a Suballocation, offset and size are relative to
+  // the start of the Suballocation, and the whole MemoryBlock is mapped
+  // persistently the first time any Suballocation in it is mapped.
   WARN_UNUSED_RESULT int mmap(language::Device& dev, void** pData,
                               VkDeviceSize offset = 0,
                               VkDeviceSize size = VK_WHOLE_SIZE,
                               VkMemoryMapFlags flags = 0);
 
-  // munmap() calls vkUnmapMemory().
+  // munmap() calls vkUnmapMemory(). munmap() does nothing if the memory is
+  // persistently mapped.
   void munmap(language::Device& dev);
 
-  VkPtr<VkDeviceMemory> vk;
+  // mapPersistent() maps the memory and keeps it mapped for the lifetime of
+  // this DeviceMemory. It is not an error to call it more than once.
+  // After mapPersistent(), 'mapped' points to the first byte.
+  WARN_UNUSED_RESULT int mapPersistent(language::Device& dev);
+
+  // flush() makes host writes visible to the device, calling
+  // vkFlushMappedMemoryRanges() if the memory is not HOST_COHERENT. The range
+  // is rounded out to nonCoherentAtomSize for you.
+  WARN_UNUSED_RESULT int flush(language::Device& dev, VkDeviceSize offset = 0,
+                               VkDeviceSize size = VK_WHOLE_SIZE);
+
+  // invalidate() makes device writes visible to the host, calling
+  // vkInvalidateMappedMemoryRanges() if the memory is not HOST_COHERENT.
+  WARN_UNUSED_RESULT int invalidate(language::Device& dev,
+                                    VkDeviceSize offset = 0,
+                                    VkDeviceSize size = VK_WHOLE_SIZE);
+
+  // isCoherent() returns true if flush() and invalidate() are not needed.
+  bool isCoherent() const {
+    return propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  }
+
+  // memory() returns the VkDeviceMemory backing this object: either vk or
+  // the MemoryBlock that sub is in.
+  VkDeviceMemory memory() const;
+
+  // offset() returns where this object starts inside memory().
+  VkDeviceSize offset() const { return sub.offset; }
+
+  VkPtr<VkDeviceMemory> vk;  // VK_NULL_HANDLE if sub is used instead.
+  Suballocation sub;
+  void* mapped;  // nullptr unless mapPersistent() was called.
+  VkDeviceSize allocSize;  // Set by alloc(). Equal to sub.size if sub is used.
+  // propertyFlags are the flags of the memory type that alloc() chose. This
+  // may include more flags than the 'props' passed to alloc().
+  VkMemoryPropertyFlags propertyFlags;
+
+ protected:
+  // mappedRange() fills in range for flush() and invalidate().
+  int mappedRange(language::Device& dev, VkDeviceSize offset,
+                  VkDeviceSize size, VkMappedMemoryRange& range);
 } DeviceMemory;
 
+// MemoryBlock is one large VkDeviceMemory that DeviceMemoryAllocator carves
+// up into Suballocation ranges.
+typedef struct MemoryBlock {
+  MemoryBlock(language::Device& dev) : mem(dev) {}
+  MemoryBlock(MemoryBlock&&) = default;
+  MemoryBlock(const MemoryBlock&) = delete;
+
+  DeviceMemory mem;
+  uint32_t memoryTypeIndex;
+  // linear is true if this block holds linear resources (VkBuffer and
+  // VK_IMAGE_TILING_LINEAR Images). Optimal-tiled Images are never put in the
+  // same block as linear resources, which satisfies bufferImageGranularity
+  // without checking each neighbor.
+  bool linear;
+  // dedicated is true if the block was sized for a single large resource.
+  bool dedicated;
+  VkDeviceSize size;
+  VkDeviceSize used;
+  size_t allocCount;
+  // freeList maps offset to size of each unused range, kept coalesced.
+  std::map<VkDeviceSize, VkDeviceSize> freeList;
+} MemoryBlock;
+
+// DeviceMemoryAllocator keeps a few large VkDeviceMemory blocks per
+// memoryTypeIndex and hands out Suballocation ranges from them. This avoids
+// one vkAllocateMemory() call per Image or Buffer, which is slow and which
+// runs into maxMemoryAllocationCount (often only 4096).
+//
+// To use it, set Image::suballocator or Buffer::suballocator before calling
+// ctorError(). The DeviceMemoryAllocator must outlive every Image or Buffer
+// that uses it.
+//
+// In a memory type that is HOST_VISIBLE but not HOST_COHERENT, each
+// Suballocation is aligned and sized to nonCoherentAtomSize, so flush() and
+// invalidate() on one never touch its neighbors.
+//
+// DeviceMemoryAllocator is not thread safe.
+typedef struct DeviceMemoryAllocator {
+  DeviceMemoryAllocator(language::Device& dev)
+      : blockSize(64 * 1024 * 1024), dev(dev) {}
+  DeviceMemoryAllocator(DeviceMemoryAllocator&&) = delete;
+  DeviceMemoryAllocator(const DeviceMemoryAllocator&) = delete;
+  virtual ~DeviceMemoryAllocator();
+
+  // alloc() finds (or allocates) a MemoryBlock with room for req and
+  // populates 'out'. Returns non-zero on error.
+  WARN_UNUSED_RESULT int alloc(MemoryRequirements& req,
+                               VkMemoryPropertyFlags props, bool linear,
+                               Suballocation& out);
+
+  // free() returns a Suballocation to its block. Suballocation::reset() calls
+  // this for you.
+  void free(Suballocation& sub);
+
+  typedef struct Stats {
+    size_t blockCount;
+    size_t allocCount;
+    VkDeviceSize bytesReserved;  // Sum of all MemoryBlock sizes.
+    VkDeviceSize bytesUsed;      // Sum of all Suballocation sizes.
+    size_t freeRangeCount;
+    VkDeviceSize largestFreeRange;
+
+    // fragmentation() is 0 if all free bytes are in one range, and approaches
+    // 1 as the free bytes are split into many small ranges.
+    float fragmentation() const {
+      VkDeviceSize bytesFree = bytesReserved - bytesUsed;
+      if (!bytesFree) {
+        return 0;
+      }
+      return 1.0f - (float)largestFreeRange / bytesFree;
+    }
+  } Stats;
+
+  // getStats() sums the usage of all blocks. If memoryTypeIndex is not -1,
+  // only blocks of that memoryTypeIndex are counted.
+  Stats getStats(int memoryTypeIndex = -1) const;
+
+  // dumpStats() prints getStats() for each memoryTypeIndex in use.
+  void dumpStats(FILE* f) const;
+
+  // blockSize is the size of each new MemoryBlock. Any request larger than
+  // blockSize / 2 gets a dedicated MemoryBlock.
+  VkDeviceSize blockSize;
+  language::Device& dev;
+
+ protected:
+  std::vector<std::unique_ptr<MemoryBlock>> blocks;
+
+  // findRange() searches block for size bytes at the given alignment. Returns
+  // false if block is full.
+  bool findRange(MemoryBlock& block, VkDeviceSize size, VkDeviceSize alignment,
+                 Suballocation& out);
+} DeviceMemoryAllocator;
+
 // Image represents a VkImage.
 typedef struct Image {
-  Image(language::Device& dev) : vk{dev.dev, vkDestroyImage}, mem(dev) {
+  Image(language::Device& dev)
+      : vk{dev.dev, vkDestroyImage}, mem(dev), suballocator(nullptr) {
     vk.allocator = dev.dev.allocator;
     VkOverwrite(info);
     info.imageType = VK_IMAGE_TYPE_2D;
@@ -111,6 +289,7 @@ typedef struct Image {
   }
 
   // bindMemory() calls vkBindImageMemory which binds this->mem.
+  // offset is relative to mem.offset().
   // Note: do not call bindMemory() until some time after ctorError().
   WARN_UNUSED_RESULT int bindMemory(language::Device& dev,
                                     VkDeviceSize offset = 0);
@@ -136,12 +315,46 @@ typedef struct Image {
   //   imageB.srcQueueFamilyIndex = oldQueueFamilyIndex;
   //   imageB.dstQueueFamilyIndex = newQueueFamilyIndex;
   //   ... proceed to use imageB like normal ...
+  //
+  // The barrier covers all mip levels and array layers of the Image.
   VkImageMemoryBarrier makeTransition(VkImageLayout newLayout);
 
+  // makeTransition() for mip levels baseMip to baseMip + mipCount - 1, which
+  // are in oldLayout instead of currentLayout. generateMips() uses this to
+  // move one level at a time. currentLayout is not used.
+  VkImageMemoryBarrier makeTransition(VkImageLayout oldLayout,
+                                      VkImageLayout newLayout,
+                                      uint32_t baseMip, uint32_t mipCount);
+
+  // fullMipLevels returns the number of levels in a full mip chain for
+  // extent, to set info.mipLevels.
+  static uint32_t fullMipLevels(const VkExtent3D& extent);
+
+  // canGenerateMips returns true if format supports the linear blits
+  // generateMips() uses, with VK_IMAGE_TILING_OPTIMAL.
+  static bool canGenerateMips(language::Device& dev, VkFormat format);
+
+  // generateMips() records blits that fill mip levels 1 to
+  // info.mipLevels - 1, each from the level before it. All levels must be in
+  // VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL with level 0 written, and are left
+  // in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL: transition the Image to its next
+  // layout after. info.usage must include TRANSFER_SRC and TRANSFER_DST.
+  //
+  // Only layers baseLayer to baseLayer + layerCount - 1 are generated.
+  WARN_UNUSED_RESULT int generateMips(command::CommandBuilder& builder,
+                                      uint32_t baseLayer,
+                                      uint32_t layerCount);
+  WARN_UNUSED_RESULT int generateMips(command::CommandBuilder& builder) {
+    return generateMips(builder, 0, info.arrayLayers);
+  }
+
   VkImageCreateInfo info;
   VkImageLayout currentLayout;
   VkPtr<VkImage> vk;  // populated after ctorError().
   DeviceMemory mem;   // ctorError() calls mem.alloc() for you.
+  // suballocator is optional. If it is set before ctorError(), mem is a range
+  // in a larger block instead of its own vkAllocateMemory().
+  DeviceMemoryAllocator* suballocator;
 
  protected:
   int makeTransitionAccessMasks(VkImageMemoryBarrier& imageB);
@@ -149,7 +362,8 @@ typedef struct Image {
 
 // Buffer represents a VkBuffer.
 typedef struct Buffer {
-  Buffer(language::Device& dev) : vk{dev.dev, vkDestroyBuffer}, mem(dev) {
+  Buffer(language::Device& dev)
+      : vk{dev.dev, vkDestroyBuffer}, mem(dev), suballocator(nullptr) {
     vk.allocator = dev.dev.allocator;
     VkOverwrite(info);
     // You must set info.size.
@@ -188,6 +402,7 @@ typedef struct Buffer {
   }
 
   // bindMemory() calls vkBindBufferMemory which binds this->mem.
+  // offset is relative to mem.offset().
   // Note: do not call bindMemory() until some time after ctorError().
   WARN_UNUSED_RESULT int bindMemory(language::Device& dev,
                                     VkDeviceSize offset = 0);
@@ -195,6 +410,9 @@ typedef struct Buffer {
   // copyFromHost copies bytes from the host at 'src' into this buffer.
   // Note that copyFromHost only makes sense if the buffer has been constructed
   // with ctorHostVisible or ctorHostCoherent.
+  //
+  // The first copyFromHost calls mem.mapPersistent(), so after that it is
+  // only a memcpy (and a flush if the memory is not HOST_COHERENT).
   WARN_UNUSED_RESULT int copyFromHost(language::Device& dev, const void* src,
                                       size_t len, VkDeviceSize dstOffset = 0);
 
@@ -207,6 +425,29 @@ typedef struct Buffer {
                         dstOffset);
   }
 
+  // write copies one T into this buffer at dstOffset. Like copyFromHost, the
+  // buffer must be HOST_VISIBLE.
+  template <typename T>
+  WARN_UNUSED_RESULT int write(language::Device& dev, const T& value,
+                               VkDeviceSize dstOffset = 0) {
+    return copyFromHost(dev, &value, sizeof(value), dstOffset);
+  }
+
+  // map returns a T* pointing into the persistently mapped buffer, or nullptr
+  // on error. Call mem.flush() after writing through the pointer.
+  template <typename T>
+  T* map(language::Device& dev, VkDeviceSize offset = 0) {
+    if (offset + sizeof(T) > info.size) {
+      fprintf(stderr, "Buffer::map(offset=0x%lx) but size is 0x%lx\n", offset,
+              info.size);
+      return nullptr;
+    }
+    if (mem.mapPersistent(dev)) {
+      return nullptr;
+    }
+    return reinterpret_cast<T*>(((char*)mem.mapped) + offset);
+  }
+
   // copyFrom copies all the contents of Buffer src immediately and waits
   // until the copy is complete (synchronizing host and device).
   // This is the simplest form of copy.
@@ -250,6 +491,9 @@ typedef struct Buffer {
   VkBufferCreateInfo info;
   VkPtr<VkBuffer> vk;  // populated after ctorError().
   DeviceMemory mem;    // ctorError() calls mem.alloc() for you.
+  // suballocator is optional. If it is set before ctorError(), mem is a range
+  // in a larger block instead of its own vkAllocateMemory().
+  DeviceMemoryAllocator* suballocator;
 } Buffer;
 
 // MemoryRequirements automatically gets the VkMemoryRequirements from
@@ -299,19 +543,32 @@ typedef struct Sampler {
     info.compareOp = VK_COMPARE_OP_ALWAYS;
   }
 
-  // TODO: add a ctorError() method to construct vk, the Image (and bind it),
-  // and the ImageView. Then just return. The caller can use the (host-visible)
-  // Image. The caller must manually transition the image to a shader layout.
-
   // ctorError() constructs vk, the Image, and ImageView. It enqueues calls on
   // command::CommandBuilder 'builder' to do layout transitions and copyImage().
   // The Image.info.{extent,format} are set to src.info.{extent,format}.
   // Also src.currentLayout is modified, which does not actually happen until
   // the command builder is submitted.
+  //
+  // If mipmap is true and the format supports it, Image gets a full mip chain
+  // generated on the GPU by Image::generateMips(), and info.maxLod is set to
+  // use all of it.
   WARN_UNUSED_RESULT int ctorError(language::Device& dev,
                                    command::CommandBuilder& builder,
                                    Image& src);
 
+  // ctorError() with a Buffer uploads with copyBufferToImage, which avoids
+  // the size limits and slow reads of a linear Image. Set
+  // image.info.{extent,format} first, and image.info.{mipLevels,arrayLayers}
+  // if src has more than one. src must stay valid until builder is done.
+  //
+  // regions are batched into one copy, for example one per mip level. If
+  // regions is empty, src is all layers of level 0, tightly packed. If no
+  // region has a mipLevel above 0, mipmap works as above.
+  WARN_UNUSED_RESULT int ctorError(language::Device& dev,
+                                   command::CommandBuilder& builder,
+                                   Buffer& src,
+                                   std::vector<VkBufferImageCopy> regions = {});
+
   // toDescriptor is a convenience method to add this Sampler to a descriptor
   // set.
   void toDescriptor(VkDescriptorImageInfo* imageInfo) {
@@ -324,6 +581,16 @@ typedef struct Sampler {
   language::ImageView imageView;
   VkSamplerCreateInfo info;
   VkPtr<VkSampler> vk;
+  bool mipmap{true};
+
+ protected:
+  // ctorImage creates vk, image and imageView. If genMips, image gets a full
+  // mip chain if its format allows it.
+  WARN_UNUSED_RESULT int ctorImage(language::Device& dev, bool genMips);
+  // finishImage generates the mip levels if genMips, and transitions image
+  // to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+  WARN_UNUSED_RESULT int finishImage(command::CommandBuilder& builder,
+                                     bool genMips);
 } Sampler;
 
 // UniformBuffer contains a buffer (just plain ordinary bytes) and adds a
@@ -354,6 +621,211 @@ typedef struct UniformBuffer : public Buffer {
   Buffer stage;
 } UniformBuffer;
 
+// UniformRing is one large HOST_VISIBLE Buffer split into one slice per frame
+// in flight. Each slice is bound with VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+// and a dynamic offset, so the same DescriptorSet serves every frame.
+//
+// Unlike UniformBuffer::copy(), nothing waits for the queue to go idle.
+// UniformRing has no fences of its own: the caller must know the GPU is done
+// with a slice before it selects it, such as after
+// science::FrameScheduler::acquire() returned that frame.
+//
+// Example usage:
+//   UniformRing ring(dev);
+//   if (ring.ctorError(dev, sizeof(UBO), dev.framebufs.size())) { ... }
+//   // Write ring.toDescriptor() to a UNIFORM_BUFFER_DYNAMIC binding, and
+//   // record ring.dynamicOffset(i) in command buffer i.
+//   ...
+//   // Every frame, after the fence for frame i has signalled:
+//   if (ring.select(i) || ring.write(dev, ubo)) { ... }
+typedef struct UniformRing : public Buffer {
+  UniformRing(language::Device& dev)
+      : Buffer{dev}, nBytes(0), sliceSize(0), frames(0), frameI(0) {}
+  UniformRing(UniformRing&&) = default;
+  UniformRing(const UniformRing&) = delete;
+
+  // ctorError creates the Buffer with 'frames' slices of nBytes each, and
+  // maps it persistently.
+  WARN_UNUSED_RESULT int ctorError(language::Device& dev, size_t nBytes,
+                                   size_t frames);
+
+  // select() selects slice 'frame' for copy() and write(). It does not
+  // wait: the GPU must be done with the slice.
+  WARN_UNUSED_RESULT int select(size_t frame) {
+    if (frame >= frames) {
+      fprintf(stderr, "UniformRing::select(%zu) with only %zu frames\n",
+              frame, frames);
+      return 1;
+    }
+    frameI = frame;
+    return 0;
+  }
+
+  // copy copies bytes from the host into the current slice.
+  WARN_UNUSED_RESULT int copy(language::Device& dev, const void* src,
+                              size_t len, VkDeviceSize offset = 0) {
+    if (offset + len > nBytes) {
+      fprintf(stderr, "UniformRing::copy(len=0x%zx, offset=0x%lx) > 0x%zx\n",
+              len, offset, nBytes);
+      return 1;
+    }
+    return copyFromHost(dev, src, len, frameI * sliceSize + offset);
+  }
+
+  // write copies one T into the current slice.
+  template <typename T>
+  WARN_UNUSED_RESULT int write(language::Device& dev, const T& value,
+                               VkDeviceSize offset = 0) {
+    return copy(dev, &value, sizeof(value), offset);
+  }
+
+  // dynamicOffset() is the dynamic offset of slice 'frame', to pass to
+  // CommandBuilder::bindGraphicsPipelineAndDescriptors().
+  uint32_t dynamicOffset(size_t frame) const { return frame * sliceSize; }
+
+  // toDescriptor is a convenience method to add this UniformRing to a
+  // VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC binding.
+  VkDescriptorBufferInfo toDescriptor() const {
+    VkDescriptorBufferInfo bufferInfo;
+    bufferInfo.buffer = vk;
+    bufferInfo.offset = 0;
+    bufferInfo.range = nBytes;
+    return bufferInfo;
+  }
+
+  size_t nBytes;
+  // sliceSize is nBytes rounded up to minUniformBufferOffsetAlignment.
+  VkDeviceSize sliceSize;
+  // frames is the number of slices.
+  size_t frames;
+  size_t frameI;
+} UniformRing;
+
+// TransferQueue uploads host data into device-local Buffers without blocking
+// the GRAPHICS queue. If the device has a dedicated transfer-only queue family
+// (language::TRANSFER) the copies run there, in parallel with rendering.
+// Otherwise TransferQueue falls back to the GRAPHICS queue, which is still
+// better than Buffer::copy() because nothing calls vkQueueWaitIdle.
+//
+// copy() only does a memcpy into a persistently mapped staging buffer and
+// records a vkCmdCopyBuffer. Many copy() calls are batched into a single
+// vkQueueSubmit by flush(). Each flush() returns a ticket. Tickets increase
+// monotonically, like the value of a timeline semaphore: isDone(ticket) polls
+// and wait(ticket) blocks.
+//
+// When the copies run on a different queue family, each dst Buffer must be
+// handed over to the GRAPHICS queue family (a queue family ownership
+// transfer). flush() records the release barriers. acquire() records the
+// matching acquire barriers for every completed batch into a command buffer
+// that will be submitted on the GRAPHICS queue.
+//
+// Example usage:
+//   memory::TransferQueue transfer(dev);
+//   if (transfer.ctorError(dev) || transfer.copy(vertexBuffer, vertices) ||
+//       transfer.flush(&ticket)) { ... }
+//   ...
+//   if (transfer.isDone(ticket)) {
+//     if (transfer.acquire(builder)) { ... }  // Before using vertexBuffer.
+//   }
+//
+// Set jobs to move the memcpy off the calling thread (usually the render
+// thread): copy() then only records the vkCmdCopyBuffer and queues the
+// memcpy as jobs, in pieces of up to jobBytes. src must stay valid until the
+// next flush(), which waits for the memcpys of its batch before it submits.
+class TransferQueue {
+ public:
+  TransferQueue(language::Device& dev);
+  TransferQueue(TransferQueue&&) = delete;
+  TransferQueue(const TransferQueue&) = delete;
+  virtual ~TransferQueue();
+
+  // Two-stage constructor: check the return code of ctorError().
+  // Each of the batchCount batches has batchSize bytes of staging memory.
+  WARN_UNUSED_RESULT int ctorError(language::Device& dev,
+                                   VkDeviceSize batchSize = 4 * 1024 * 1024,
+                                   size_t batchCount = 3);
+
+  // copy() queues a copy of len bytes from the host at src into dst. src is
+  // copied to staging memory before copy() returns, unless jobs is set (then
+  // before flush() submits it). A copy larger than the
+  // space left in the current batch is split across batches, and full
+  // batches are submitted automatically.
+  WARN_UNUSED_RESULT int copy(Buffer& dst, const void* src, size_t len,
+                              VkDeviceSize dstOffset = 0);
+
+  // copy() specialization for a std::vector<T>.
+  template <typename T>
+  WARN_UNUSED_RESULT int copy(Buffer& dst, const std::vector<T>& vec,
+                              VkDeviceSize dstOffset = 0) {
+    return copy(dst, vec.data(), sizeof(vec[0]) * vec.size(), dstOffset);
+  }
+
+  // flush() submits the current batch, if any copies are pending. If ticket
+  // is not null it is set to a ticket for the copies so far.
+  WARN_UNUSED_RESULT int flush(uint64_t* ticket = nullptr);
+
+  // isDone() returns true if all copies up to ticket have completed.
+  bool isDone(uint64_t ticket);
+
+  // wait() blocks until all copies up to ticket have completed.
+  WARN_UNUSED_RESULT int wait(uint64_t ticket);
+
+  // acquire() records the acquire barriers for all completed batches into
+  // graphics, which must be recording a command buffer for the GRAPHICS
+  // queue. If no batches completed since the last acquire(), it records
+  // nothing.
+  WARN_UNUSED_RESULT int acquire(command::CommandBuilder& graphics);
+
+  // isDedicated() returns true if a transfer-only queue family is in use.
+  bool isDedicated() const { return transferQfamI != graphicsQfamI; }
+
+  language::Device& dev;
+  command::CommandPool pool;
+  // jobs is optional. See above.
+  job::Scheduler* jobs{nullptr};
+  // jobBytes is the most one memcpy job copies. Smaller copies are done by
+  // the caller, since a job would cost more than the memcpy.
+  static constexpr VkDeviceSize jobBytes = 256 * 1024;
+
+ protected:
+  typedef struct Batch {
+    Batch(language::Device& dev) : staging(dev), fence(dev) {}
+    Batch(Batch&&) = default;
+    Batch(const Batch&) = delete;
+
+    Buffer staging;
+    command::Fence fence;
+    VkDeviceSize used{0};
+    // ticket is 0 if the batch is not submitted.
+    uint64_t ticket{0};
+    // acquires are the barriers acquire() must record after this batch.
+    std::vector<VkBufferMemoryBarrier> acquires;
+    // writes are the memcpy jobs that must finish before this batch is
+    // submitted.
+    std::vector<job::Handle> writes;
+  } Batch;
+
+  // write() copies n bytes from src into the staging buffer of b at b.used,
+  // in jobs if jobs is set.
+  WARN_UNUSED_RESULT int write(Batch& b, const char* src, VkDeviceSize n);
+
+  // nextBatch() waits until the oldest batch completes if all are in use,
+  // and begins recording into it.
+  WARN_UNUSED_RESULT int nextBatch();
+  // poll() checks the fences of submitted batches and frees completed ones.
+  WARN_UNUSED_RESULT int poll();
+
+  command::CommandBuilder builder;
+  std::vector<Batch> batches;
+  size_t batchI{0};
+  bool recording{false};
+  uint64_t nextTicket{1};
+  uint64_t doneTicket{0};
+  uint32_t transferQfamI{0};
+  uint32_t graphicsQfamI{0};
+  std::vector<VkBufferMemoryBarrier> ready;
+};
+
 // DescriptorPool represents memory reserved for a DescriptorSet (or many).
 // The assumption is that your application knows in advance the max number of
 // DescriptorSet instances that will exist.
@@ -379,6 +851,11 @@ typedef struct DescriptorPool {
   WARN_UNUSED_RESULT int ctorError(
       uint32_t maxSets, std::vector<VkDescriptorType> maxDescriptors);
 
+  // ctorError with VkDescriptorPoolSize is for bigger pools: sizes has the
+  // count of each VkDescriptorType.
+  WARN_UNUSED_RESULT int ctorError(
+      uint32_t maxSets, const std::vector<VkDescriptorPoolSize>& sizes);
+
   WARN_UNUSED_RESULT int reset() {
     VkResult v = vkResetDescriptorPool(dev.dev, vk, 0 /*flags is reserved*/);
     if (v != VK_SUCCESS) {
@@ -389,6 +866,12 @@ typedef struct DescriptorPool {
     return 0;
   }
 
+  // flags are used by ctorError(). Without
+  // VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT, a DescriptorSet is
+  // not freed when it is destroyed, only when the pool is reset().
+  VkDescriptorPoolCreateFlags flags{
+      VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT};
+
   language::Device& dev;
   VkPtr<VkDescriptorPool> vk;
 } DescriptorPool;
@@ -412,6 +895,9 @@ typedef struct DescriptorSetLayout {
       const std::vector<VkDescriptorSetLayoutBinding>& bindings);
 
   std::vector<VkDescriptorType> types;
+  // counts has the descriptorCount of each binding in types: an array
+  // binding needs that many descriptors from the pool.
+  std::vector<uint32_t> counts;
   VkPtr<VkDescriptorSetLayout> vk;
 } DescriptorSetLayout;
 
@@ -437,22 +923,27 @@ typedef struct DescriptorSet {
   // ctorError calls vkAllocateDescriptorSets.
   WARN_UNUSED_RESULT int ctorError(const DescriptorSetLayout& layout);
 
-  // write populates the DescriptorSet with type and buffer.
+  // alloc is ctorError without printing an error, for DescriptorAllocator
+  // to retry in another pool.
+  WARN_UNUSED_RESULT VkResult alloc(const DescriptorSetLayout& layout);
+
+  // write populates the DescriptorSet with type and buffer. Each write is
+  // one vkUpdateDescriptorSets call: use DescriptorWriter to batch them.
   WARN_UNUSED_RESULT int write(
-      uint32_t binding, const std::vector<VkDescriptorImageInfo> imageInfo,
+      uint32_t binding, const std::vector<VkDescriptorImageInfo>& imageInfo,
       uint32_t arrayI = 0);
   // write populates the DescriptorSet with type and buffer.
   WARN_UNUSED_RESULT int write(
-      uint32_t binding, const std::vector<VkDescriptorBufferInfo> bufferInfo,
+      uint32_t binding, const std::vector<VkDescriptorBufferInfo>& bufferInfo,
       uint32_t arrayI = 0);
   // write populates the DescriptorSet with type and buffer.
   WARN_UNUSED_RESULT int write(
-      uint32_t binding, const std::vector<VkBufferView> texelBufferViewInfo,
+      uint32_t binding, const std::vector<VkBufferView>& texelBufferViewInfo,
       uint32_t arrayI = 0);
 
   // write populates the DescriptorSet with type and buffer.
   WARN_UNUSED_RESULT int write(uint32_t binding,
-                               const std::vector<Sampler*> samplers,
+                               const std::vector<Sampler*>& samplers,
                                uint32_t arrayI = 0) {
     std::vector<VkDescriptorImageInfo> imageInfo;
     imageInfo.resize(samplers.size());
@@ -464,7 +955,7 @@ typedef struct DescriptorSet {
 
   // write populates the DescriptorSet with type and buffer.
   WARN_UNUSED_RESULT int write(uint32_t binding,
-                               const std::vector<Buffer*> buffers,
+                               const std::vector<Buffer*>& buffers,
                                uint32_t arrayI = 0) {
     std::vector<VkDescriptorBufferInfo> bufferInfos;
     bufferInfos.resize(buffers.size());
@@ -480,7 +971,305 @@ typedef struct DescriptorSet {
 
   DescriptorPool& pool;
   std::vector<VkDescriptorType> types;
-  VkDescriptorSet vk;
+  VkDescriptorSet vk{VK_NULL_HANDLE};
 } DescriptorSet;
 
+// DescriptorAllocator creates DescriptorSet objects from a list of
+// DescriptorPools. When a pool is full, it tries the other pools and then
+// adds a new one, so an application does not need to know in advance how
+// many sets it will make.
+//
+// Each new pool holds setsPerPool sets, and for each entry in ratios it
+// holds perSet * setsPerPool descriptors of that type. It also holds at
+// least setsPerPool sets of the layout being allocated, counting every
+// element of an array binding.
+//
+// If transient is true, the pools are reset() in bulk instead of freeing
+// each DescriptorSet. Keep one transient DescriptorAllocator per frame in
+// flight and reset() it when the frame starts.
+//
+// Example usage:
+//   memory::DescriptorAllocator chunkSets(dev);
+//   std::unique_ptr<memory::DescriptorSet> set(chunkSets.alloc(layout));
+//   if (!set) { ... }
+//
+// Every DescriptorSet must be destroyed before its DescriptorAllocator.
+class DescriptorAllocator {
+ public:
+  DescriptorAllocator(language::Device& dev) : dev(dev) {}
+  DescriptorAllocator(DescriptorAllocator&&) = default;
+  DescriptorAllocator(const DescriptorAllocator&) = delete;
+
+  typedef struct Ratio {
+    VkDescriptorType type;
+    float perSet;
+  } Ratio;
+
+  // alloc creates a DescriptorSet for layout. It returns a null unique_ptr
+  // on error.
+  std::unique_ptr<DescriptorSet> alloc(const DescriptorSetLayout& layout);
+
+  // reset frees every DescriptorSet in all the pools. Only a transient
+  // DescriptorAllocator can reset(): the DescriptorSet objects from it may
+  // then be destroyed, but not used.
+  WARN_UNUSED_RESULT int reset();
+
+  // Change ratios, setsPerPool and transient before the first alloc().
+  std::vector<Ratio> ratios{
+      {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1.f},
+      {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1.f},
+      {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1.f},
+      {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2.f},
+      {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .5f},
+  };
+  uint32_t setsPerPool{64};
+  bool transient{false};
+
+  language::Device& dev;
+  std::vector<std::unique_ptr<DescriptorPool>> pools;
+
+ protected:
+  // addPool adds a pool that can hold at least one set of layout.
+  WARN_UNUSED_RESULT int addPool(const DescriptorSetLayout& layout);
+
+  // current is the pool alloc() tries first.
+  size_t current{0};
+};
+
+// DescriptorWriter collects writes to many DescriptorSets and bindings, and
+// then flush() sends them all in one vkUpdateDescriptorSets call. The
+// descriptor infos are copied, so the vectors passed to write() may be
+// destroyed before flush().
+//
+// Example usage:
+//   memory::DescriptorWriter writer(dev);
+//   for (auto& c : chunks) {
+//     if (writer.write(*c.set, 0, c.uniforms) ||
+//         writer.write(*c.set, 1, c.textures)) {
+//       ...
+//     }
+//   }
+//   writer.flush();
+//
+// The GPU must not be using any of the DescriptorSets when flush() is called.
+class DescriptorWriter {
+ public:
+  DescriptorWriter(language::Device& dev) : dev(dev) {}
+  DescriptorWriter(DescriptorWriter&&) = default;
+  DescriptorWriter(const DescriptorWriter&) = delete;
+
+  // write adds imageInfo to the writes for set at binding.
+  WARN_UNUSED_RESULT int write(
+      DescriptorSet& set, uint32_t binding,
+      const std::vector<VkDescriptorImageInfo>& imageInfo,
+      uint32_t arrayI = 0);
+  // write adds bufferInfo to the writes for set at binding.
+  WARN_UNUSED_RESULT int write(
+      DescriptorSet& set, uint32_t binding,
+      const std::vector<VkDescriptorBufferInfo>& bufferInfo,
+      uint32_t arrayI = 0);
+  // write adds texelBufferViewInfo to the writes for set at binding.
+  WARN_UNUSED_RESULT int write(
+      DescriptorSet& set, uint32_t binding,
+      const std::vector<VkBufferView>& texelBufferViewInfo,
+      uint32_t arrayI = 0);
+
+  // flush calls vkUpdateDescriptorSets with all the writes and clears them.
+  void flush();
+
+  // size is the number of writes waiting for flush().
+  size_t size() const { return writes.size(); }
+
+  language::Device& dev;
+
+ protected:
+  friend class DescriptorUpdateTemplate;
+
+  // Kind is which member of VkWriteDescriptorSet holds the descriptors.
+  enum Kind {
+    INVALID = 0,
+    IMAGE = 1,
+    BUFFER = 2,
+    TEXEL = 3,
+  };
+  static Kind kindOf(VkDescriptorType t);
+
+  // add checks that binding in set is a kind descriptor and then queues n
+  // descriptors read from src, one every stride bytes.
+  WARN_UNUSED_RESULT int add(DescriptorSet& set, uint32_t binding,
+                             uint32_t arrayI, Kind kind, const char* src,
+                             size_t n, size_t stride);
+  void clear();
+
+  std::vector<VkWriteDescriptorSet> writes;
+  // first is where each write starts in images, buffers or views. The
+  // pointers in writes are only set by flush(), after the vectors are done
+  // growing.
+  std::vector<size_t> first;
+  std::vector<VkDescriptorImageInfo> images;
+  std::vector<VkDescriptorBufferInfo> buffers;
+  std::vector<VkBufferView> views;
+};
+
+// DescriptorUpdateTemplate writes a whole DescriptorSet from a packed struct
+// with a single call. Each entry says where in the struct to find the
+// VkDescriptorImageInfo, VkDescriptorBufferInfo or VkBufferView for one
+// binding. This is much cheaper than a VkWriteDescriptorSet per binding when
+// many sets of the same layout are updated each frame.
+//
+// It uses VK_KHR_descriptor_update_template if the Device enabled it (add
+// VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME to
+// Device::extensionRequests if it is in Device::availableExtensions).
+// Otherwise update() turns the struct into a vkUpdateDescriptorSets call.
+//
+// Example usage:
+//   typedef struct ChunkDescriptors {
+//     VkDescriptorBufferInfo ubo;
+//     VkDescriptorImageInfo tex;
+//   } ChunkDescriptors;
+//   memory::DescriptorUpdateTemplate tmpl(dev);
+//   if (tmpl.ctorError(layout, {
+//         {0, 0, 1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+//          offsetof(ChunkDescriptors, ubo), 0},
+//         {1, 0, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+//          offsetof(ChunkDescriptors, tex), 0},
+//       })) {
+//     ...
+//   }
+//   if (tmpl.update(*set, &chunkDescriptors)) { ... }
+class DescriptorUpdateTemplate {
+ public:
+  DescriptorUpdateTemplate(language::Device& dev) : dev(dev), fallback(dev) {}
+  DescriptorUpdateTemplate(DescriptorUpdateTemplate&&) = delete;
+  DescriptorUpdateTemplate(const DescriptorUpdateTemplate&) = delete;
+  virtual ~DescriptorUpdateTemplate();
+
+  // ctorError creates the template for DescriptorSets of layout.
+  WARN_UNUSED_RESULT int ctorError(
+      const DescriptorSetLayout& layout,
+      const std::vector<VkDescriptorUpdateTemplateEntryKHR>& entries);
+
+  // update writes set from data, which must be laid out as described by the
+  // entries passed to ctorError().
+  WARN_UNUSED_RESULT int update(DescriptorSet& set, const void* data);
+
+  // isEnabled returns true if dev enabled VK_KHR_descriptor_update_template.
+  static bool isEnabled(const language::Device& dev);
+
+  language::Device& dev;
+  std::vector<VkDescriptorUpdateTemplateEntryKHR> entries;
+
+ protected:
+  void reset();
+
+  VkDescriptorUpdateTemplateKHR vk{VK_NULL_HANDLE};
+  // The extension functions are loaded by ctorError() if isEnabled().
+  PFN_vkUpdateDescriptorSetWithTemplateKHR updateFn{nullptr};
+  PFN_vkDestroyDescriptorUpdateTemplateKHR destroyFn{nullptr};
+  // fallback is used if the extension is not enabled.
+  DescriptorWriter fallback;
+};
+
+// TextureArray packs many textures of the same size and format, such as
+// voxel block textures, into the layers of a 2D array Image with mipmaps. A
+// shader samples it with a sampler2DArray and the index add() returned as
+// the layer, so a whole world is drawn with one descriptor.
+//
+// One array Image (a page) holds layersPerPage textures. If the Device
+// enabled VK_EXT_descriptor_indexing (see isIndexingEnabled()), a full page
+// is followed by another, up to maxPages. The pages are one binding of
+// maxPages descriptors: the shader declares sampler2DArray pages[maxPages]
+// and reads pages[nonuniformEXT(index / layersPerPage)]. Slots without a
+// page point to page 0, so the binding need not be partially bound. The
+// Device must also enable shaderSampledImageArrayNonUniformIndexing with
+// Device::enabledFeaturesNext.
+//
+// Without the extension there is only one page, and write() writes one
+// descriptor.
+//
+// Example usage:
+//   memory::TextureArray blocks(dev);
+//   blocks.extent = {16, 16};
+//   if (blocks.ctorError()) { ... }
+//   for (auto& t : blockTextures) {
+//     int32_t layer = blocks.add(t.data(), t.size());
+//     if (layer < 0) { ... }
+//   }
+//   if (blocks.flush(builder)) { ... }
+//   // Submit builder and wait before the next flush().
+//   if (blocks.write(writer, *set, binding)) { ... }
+class TextureArray {
+ public:
+  TextureArray(language::Device& dev);
+  TextureArray(TextureArray&&) = delete;
+  TextureArray(const TextureArray&) = delete;
+
+  // ctorError creates the sampler and the first page. Set extent, format,
+  // bytesPerPixel, layersPerPage, maxPages and info first.
+  WARN_UNUSED_RESULT int ctorError();
+
+  // add copies len bytes of pixels (tightly packed rows of extent.width) to
+  // be uploaded by flush(). It returns the texture's index, or -1 on error.
+  int32_t add(const void* pixels, size_t len);
+
+  // flush records the upload of every texture added since the last flush()
+  // and generates their mipmaps. Call it outside a render pass. The staging
+  // Buffer lives until the next flush(): the GPU must be done with builder
+  // by then.
+  WARN_UNUSED_RESULT int flush(command::CommandBuilder& builder);
+
+  // write adds the pages to writer for set at binding. Call it after the
+  // first flush(), and again when a flush() changes pageCount().
+  WARN_UNUSED_RESULT int write(DescriptorWriter& writer, DescriptorSet& set,
+                               uint32_t binding);
+
+  // isIndexingEnabled returns true if dev enabled VK_EXT_descriptor_indexing.
+  static bool isIndexingEnabled(const language::Device& dev);
+
+  // size is the number of textures added.
+  uint32_t size() const { return count; }
+
+  // descriptorCount is the number of descriptors write() writes.
+  uint32_t descriptorCount() const { return maxPages; }
+
+  size_t pageCount() const { return pages.size(); }
+
+  VkExtent2D extent{16, 16};
+  VkFormat format{VK_FORMAT_R8G8B8A8_UNORM};
+  uint32_t bytesPerPixel{4};
+  // layersPerPage is capped at the device's maxImageArrayLayers.
+  uint32_t layersPerPage{256};
+  // maxPages is set to 1 by ctorError() unless isIndexingEnabled().
+  uint32_t maxPages{16};
+  // mipLevels is set by ctorError() to a full mip chain, or 1 if format
+  // cannot be blitted with a linear filter.
+  uint32_t mipLevels{1};
+  VkSamplerCreateInfo info;
+  VkPtr<VkSampler> sampler;
+
+  language::Device& dev;
+
+ protected:
+  typedef struct Page {
+    Page(language::Device& dev) : image{dev}, view{dev} {}
+    Image image;
+    language::ImageView view;
+  } Page;
+
+  WARN_UNUSED_RESULT int addPage();
+  // upload records the copy and mip generation of layers first to
+  // first + n - 1 of page.
+  WARN_UNUSED_RESULT int upload(command::CommandBuilder& builder, Page& page,
+                                uint32_t first, uint32_t n,
+                                VkDeviceSize stageOffset);
+
+  std::vector<std::unique_ptr<Page>> pages;
+  uint32_t count{0};
+  // flushed is the number of textures uploaded by flush().
+  uint32_t flushed{0};
+  // pending holds the pixels of textures flushed to count - 1.
+  std::vector<char> pending;
+  std::unique_ptr<Buffer> stage;
+};
+
 }  // namespace memory
@@ -5,8 +5,26 @@
 
 namespace memory {
 
-int Sampler::ctorError(language::Device& dev, command::CommandBuilder& builder,
-                       Image& src) {
+int Sampler::ctorImage(language::Device& dev, bool genMips) {
+  // Construct image as a USAGE_SAMPLED | TRANSFER_DST, then copy its
+  // contents into it.
+  image.info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image.info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  image.info.usage =
+      VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  if (genMips) {
+    if (Image::canGenerateMips(dev, image.info.format)) {
+      // generateMips() blits from each level, so it is also a TRANSFER_SRC.
+      image.info.mipLevels = Image::fullMipLevels(image.info.extent);
+      image.info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    } else {
+      image.info.mipLevels = 1;
+    }
+  }
+  if (mipmap) {
+    info.maxLod = image.info.mipLevels;
+  }
+
   vk.reset();
   VkResult v = vkCreateSampler(dev.dev, &info, dev.dev.allocator, &vk);
   if (v != VK_SUCCESS) {
@@ -14,23 +32,49 @@ int Sampler::ctorError(language::Device& dev, command::CommandBuilder& builder,
     return 1;
   }
 
-  // Construct image as a USAGE_SAMPLED | TRANSFER_DST, then use
-  // CommandBuilder::copyImage() to transfer its contents into it.
-  image.info.extent = src.info.extent;
-  image.info.format = src.info.format;
-  image.info.tiling = VK_IMAGE_TILING_OPTIMAL;
-  image.info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  image.info.usage =
-      VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-
   if (image.ctorDeviceLocal(dev) || image.bindMemory(dev)) {
     fprintf(stderr, "ctorDeviceLocal or bindMemory failed\n");
     return 1;
   }
+  imageView.info.subresourceRange.levelCount = image.info.mipLevels;
+  imageView.info.subresourceRange.layerCount = image.info.arrayLayers;
+  if (image.info.arrayLayers > 1) {
+    imageView.info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+  }
   if (imageView.ctorError(dev, image.vk, image.info.format)) {
     fprintf(stderr, "imageView.ctorError failed\n");
     return 1;
   }
+  return 0;
+}
+
+int Sampler::finishImage(command::CommandBuilder& builder, bool genMips) {
+  if (genMips && image.generateMips(builder)) {
+    fprintf(stderr, "image.generateMips failed\n");
+    return 1;
+  }
+
+  command::CommandBuilder::BarrierSet bsetShader;
+  bsetShader.img.push_back(
+      image.makeTransition(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL));
+  if (builder.barrier(bsetShader, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT)) {
+    fprintf(stderr, "builder.barrier(shader) failed\n");
+    return 1;
+  }
+  image.currentLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  return 0;
+}
+
+int Sampler::ctorError(language::Device& dev, command::CommandBuilder& builder,
+                       Image& src) {
+  image.info.extent = src.info.extent;
+  image.info.format = src.info.format;
+  image.info.mipLevels = 1;
+  image.info.arrayLayers = 1;
+  if (ctorImage(dev, mipmap)) {
+    return 1;
+  }
 
   command::CommandBuilder::BarrierSet bsetSrc;
   bsetSrc.img.push_back(
@@ -38,7 +82,7 @@ int Sampler::ctorError(language::Device& dev, command::CommandBuilder& builder,
   bsetSrc.img.push_back(
       image.makeTransition(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL));
   if (builder.barrier(bsetSrc, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                      VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT)) {
+                      VK_PIPELINE_STAGE_TRANSFER_BIT)) {
     fprintf(stderr, "builder.barrier(src) failed\n");
     return 1;
   }
@@ -55,17 +99,50 @@ int Sampler::ctorError(language::Device& dev, command::CommandBuilder& builder,
     fprintf(stderr, "builder.copyImage failed\n");
     return 1;
   }
+  return finishImage(builder, mipmap);
+}
 
-  command::CommandBuilder::BarrierSet bsetShader;
-  bsetShader.img.push_back(
-      image.makeTransition(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL));
-  if (builder.barrier(bsetShader, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                      VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT)) {
-    fprintf(stderr, "builder.barrier(shader) failed\n");
+int Sampler::ctorError(language::Device& dev, command::CommandBuilder& builder,
+                       Buffer& src, std::vector<VkBufferImageCopy> regions) {
+  if (regions.empty()) {
+    // src is all layers of mip level 0, tightly packed.
+    regions.emplace_back();
+    VkBufferImageCopy& region = regions.back();
+    memset(&region, 0, sizeof(region));
+    science::Subres(region.imageSubresource)
+        .addColor()
+        .setLayer(0, image.info.arrayLayers);
+    region.imageExtent = image.info.extent;
+  }
+  // Generate mip levels only if src has none, and do not shrink
+  // image.info.mipLevels if src has them.
+  bool genMips = mipmap;
+  for (auto& region : regions) {
+    if (region.imageSubresource.mipLevel) {
+      genMips = false;
+    }
+  }
+  if (ctorImage(dev, genMips)) {
     return 1;
   }
-  image.currentLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  return 0;
+
+  command::CommandBuilder::BarrierSet bsetDst;
+  bsetDst.img.push_back(
+      image.makeTransition(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL));
+  if (builder.barrier(bsetDst, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT)) {
+    fprintf(stderr, "builder.barrier(dst) failed\n");
+    return 1;
+  }
+  image.currentLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+
+  if (builder.copyBufferToImage(src.vk, image.vk,
+                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                regions)) {
+    fprintf(stderr, "builder.copyBufferToImage failed\n");
+    return 1;
+  }
+  return finishImage(builder, genMips);
 }
 
 }  // namespace memory
@@ -0,0 +1,211 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include <lib/science/science.h>
+#include <string.h>
+#include <algorithm>
+#include "memory.h"
+
+namespace memory {
+
+TextureArray::TextureArray(language::Device& dev)
+    : sampler{dev.dev, vkDestroySampler}, dev(dev) {
+  sampler.allocator = dev.dev.allocator;
+  VkOverwrite(info);
+  // Block textures are pixel art: keep magnified texels sharp, but blend
+  // the mipmaps in the distance.
+  info.magFilter = VK_FILTER_NEAREST;
+  info.minFilter = VK_FILTER_LINEAR;
+  info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  info.anisotropyEnable = dev.enabledFeatures.samplerAnisotropy;
+  info.maxAnisotropy = dev.physProp.limits.maxSamplerAnisotropy;
+  info.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+  info.unnormalizedCoordinates = VK_FALSE;
+  info.compareEnable = VK_FALSE;
+  info.compareOp = VK_COMPARE_OP_ALWAYS;
+}
+
+bool TextureArray::isIndexingEnabled(const language::Device& dev) {
+  // The name is spelled out because older vulkan.h lack the #define.
+  for (auto name : dev.extensionRequests) {
+    if (!strcmp(name, "VK_EXT_descriptor_indexing")) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int TextureArray::ctorError() {
+  if (!extent.width || !extent.height || !bytesPerPixel || !layersPerPage) {
+    fprintf(stderr, "TextureArray: extent, bytesPerPixel or layersPerPage "
+                    "is 0\n");
+    return 1;
+  }
+  auto& limits = dev.physProp.limits;
+  layersPerPage = std::min(layersPerPage, limits.maxImageArrayLayers);
+  if (isIndexingEnabled(dev)) {
+    maxPages = std::min(std::max(maxPages, 1u),
+                        limits.maxPerStageDescriptorSampledImages);
+  } else {
+    maxPages = 1;
+  }
+
+  mipLevels = 1;
+  if (Image::canGenerateMips(dev, format)) {
+    mipLevels = Image::fullMipLevels({extent.width, extent.height, 1});
+  } else {
+    fprintf(stderr, "TextureArray: %s cannot be blitted, so no mipmaps\n",
+            string_VkFormat(format));
+  }
+  info.maxLod = mipLevels;
+
+  sampler.reset();
+  VkResult v = vkCreateSampler(dev.dev, &info, dev.dev.allocator, &sampler);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateSampler failed: %d (%s)\n", v, string_VkResult(v));
+    return 1;
+  }
+  pages.clear();
+  count = flushed = 0;
+  pending.clear();
+  return addPage();
+}
+
+int TextureArray::addPage() {
+  pages.emplace_back(new Page(dev));
+  Page& page = *pages.back();
+  Image& img = page.image;
+  img.info.extent = {extent.width, extent.height, 1};
+  img.info.format = format;
+  img.info.mipLevels = mipLevels;
+  img.info.arrayLayers = layersPerPage;
+  img.info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  img.info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  img.info.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                   VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  if (img.ctorDeviceLocal(dev) || img.bindMemory(dev)) {
+    fprintf(stderr, "TextureArray: page %zu ctorDeviceLocal failed\n",
+            pages.size() - 1);
+    pages.pop_back();
+    return 1;
+  }
+  page.view.info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+  page.view.info.subresourceRange.levelCount = mipLevels;
+  page.view.info.subresourceRange.layerCount = layersPerPage;
+  if (page.view.ctorError(dev, img.vk, format)) {
+    pages.pop_back();
+    return 1;
+  }
+  return 0;
+}
+
+int32_t TextureArray::add(const void* pixels, size_t len) {
+  size_t want = (size_t)extent.width * extent.height * bytesPerPixel;
+  if (!pixels || len != want) {
+    fprintf(stderr, "TextureArray::add: len=%zu, want %zu\n", len, want);
+    return -1;
+  }
+  if (count / layersPerPage >= maxPages) {
+    fprintf(stderr, "TextureArray::add: full with %u pages of %u\n", maxPages,
+            layersPerPage);
+    return -1;
+  }
+  pending.insert(pending.end(), (const char*)pixels,
+                 (const char*)pixels + len);
+  return count++;
+}
+
+int TextureArray::flush(command::CommandBuilder& builder) {
+  if (flushed == count) {
+    return 0;
+  }
+  stage.reset(new Buffer(dev));
+  stage->info.size = pending.size();
+  if (stage->ctorHostCoherent(dev) || stage->bindMemory(dev) ||
+      stage->copyFromHost(dev, pending.data(), pending.size())) {
+    fprintf(stderr, "TextureArray::flush: stage failed\n");
+    return 1;
+  }
+  VkDeviceSize layerBytes = pending.size() / (count - flushed);
+  for (uint32_t i = flushed; i < count;) {
+    uint32_t p = i / layersPerPage;
+    while (p >= pages.size()) {
+      if (addPage()) {
+        return 1;
+      }
+    }
+    uint32_t first = i % layersPerPage;
+    uint32_t n = std::min(count - i, layersPerPage - first);
+    if (upload(builder, *pages.at(p), first, n, (i - flushed) * layerBytes)) {
+      return 1;
+    }
+    i += n;
+  }
+  pending.clear();
+  flushed = count;
+  return 0;
+}
+
+int TextureArray::upload(command::CommandBuilder& builder, Page& page,
+                         uint32_t first, uint32_t n,
+                         VkDeviceSize stageOffset) {
+  Image& img = page.image;
+  // Move all of page to TRANSFER_DST_OPTIMAL. Layers uploaded by an earlier
+  // flush() keep their contents, since the old layout is not UNDEFINED.
+  command::CommandBuilder::BarrierSet bset;
+  bset.img.push_back(img.makeTransition(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL));
+  if (builder.barrier(bset, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT)) {
+    return 1;
+  }
+  img.currentLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+
+  // The n layers are packed one after another in stage, so one region
+  // copies them all.
+  std::vector<VkBufferImageCopy> regions(1);
+  VkBufferImageCopy& region = regions.at(0);
+  memset(&region, 0, sizeof(region));
+  region.bufferOffset = stageOffset;
+  science::Subres(region.imageSubresource).addColor().setLayer(first, n);
+  region.imageExtent = {extent.width, extent.height, 1};
+  if (builder.copyBufferToImage(stage->vk, img.vk,
+                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                regions)) {
+    return 1;
+  }
+
+  if (img.generateMips(builder, first, n)) {
+    return 1;
+  }
+
+  bset.img.clear();
+  bset.img.push_back(
+      img.makeTransition(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL));
+  if (builder.barrier(bset, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT)) {
+    return 1;
+  }
+  img.currentLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  return 0;
+}
+
+int TextureArray::write(DescriptorWriter& writer, DescriptorSet& set,
+                        uint32_t binding) {
+  if (pages.empty() || pages.at(0)->image.currentLayout !=
+                           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+    fprintf(stderr, "TextureArray::write: call flush() first\n");
+    return 1;
+  }
+  std::vector<VkDescriptorImageInfo> imageInfo(maxPages);
+  for (uint32_t i = 0; i < maxPages; i++) {
+    Page& page = *pages.at(i < pages.size() ? i : 0);
+    imageInfo.at(i).sampler = sampler;
+    imageInfo.at(i).imageView = page.view.vk;
+    imageInfo.at(i).imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  }
+  return writer.write(set, binding, imageInfo);
+}
+
+}  // namespace memory
@@ -0,0 +1,304 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "memory.h"
+
+namespace memory {
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// chooseQueueFamily returns TRANSFER if the device was opened with a
+// transfer-only queue, and GRAPHICS otherwise.
+language::SurfaceSupport chooseQueueFamily(language::Device& dev) {
+  for (auto& fam : dev.qfams) {
+    if (fam.isTransferOnly() && fam.queues.size()) {
+      return language::TRANSFER;
+    }
+  }
+  return language::GRAPHICS;
+}
+
+// accessFromUsage returns how the GRAPHICS queue may read a Buffer after it
+// is uploaded, based on the Buffer's usage bits.
+VkAccessFlags accessFromUsage(VkBufferUsageFlags usage) {
+  VkAccessFlags access = 0;
+  if (usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT) {
+    access |= VK_ACCESS_TRANSFER_READ_BIT;
+  }
+  if (usage & (VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT |
+               VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT |
+               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)) {
+    access |= VK_ACCESS_SHADER_READ_BIT;
+  }
+  if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
+    access |= VK_ACCESS_UNIFORM_READ_BIT;
+  }
+  if (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT) {
+    access |= VK_ACCESS_INDEX_READ_BIT;
+  }
+  if (usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT) {
+    access |= VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+  }
+  if (usage & VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT) {
+    access |= VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  }
+  return access ? access : (VkAccessFlags)VK_ACCESS_MEMORY_READ_BIT;
+}
+
+// acquireStages is every stage on the GRAPHICS queue that might read an
+// uploaded Buffer.
+const VkPipelineStageFlags acquireStages =
+    VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+    VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+}  // anonymous namespace
+
+TransferQueue::TransferQueue(language::Device& dev)
+    : dev(dev), pool(dev, chooseQueueFamily(dev)), builder(pool) {}
+
+constexpr VkDeviceSize TransferQueue::jobBytes;
+
+TransferQueue::~TransferQueue() {
+  // Do not destroy the staging buffers while the GPU is reading them, or
+  // while a job is writing them.
+  for (auto& b : batches) {
+    if (jobs && jobs->wait(b.writes)) {
+      fprintf(stderr, "~TransferQueue: a memcpy job failed\n");
+    }
+    if (b.ticket && b.fence.wait(dev)) {
+      fprintf(stderr, "~TransferQueue: fence.wait failed\n");
+    }
+  }
+}
+
+int TransferQueue::ctorError(language::Device& dev,
+                             VkDeviceSize batchSize /*= 4MiB*/,
+                             size_t batchCount /*= 3*/) {
+  if (!batchSize || !batchCount) {
+    fprintf(stderr, "TransferQueue::ctorError(0x%lx, %zu): invalid\n",
+            batchSize, batchCount);
+    return 1;
+  }
+  auto transferI = dev.getQfamI(pool.queueFamily);
+  auto graphicsI = dev.getQfamI(language::GRAPHICS);
+  if (transferI == (decltype(transferI)) - 1 ||
+      graphicsI == (decltype(graphicsI)) - 1) {
+    return 1;
+  }
+  transferQfamI = transferI;
+  graphicsQfamI = graphicsI;
+
+  if (pool.ctorError(dev) || builder.resize(batchCount)) {
+    return 1;
+  }
+  batches.clear();
+  batches.reserve(batchCount);
+  for (size_t i = 0; i < batchCount; i++) {
+    batches.emplace_back(dev);
+    auto& b = batches.back();
+    b.staging.info.size = batchSize;
+    if (b.staging.ctorHostVisible(dev) || b.staging.bindMemory(dev) ||
+        b.staging.mem.mapPersistent(dev) || b.fence.ctorError(dev)) {
+      return 1;
+    }
+  }
+  batchI = 0;
+  recording = false;
+  return 0;
+}
+
+int TransferQueue::poll() {
+  uint64_t oldest = nextTicket;
+  for (auto& b : batches) {
+    if (!b.ticket) {
+      continue;
+    }
+    VkResult v = b.fence.getStatus(dev);
+    if (v == VK_NOT_READY) {
+      oldest = std::min(oldest, b.ticket);
+      continue;
+    }
+    if (v != VK_SUCCESS) {
+      fprintf(stderr, "vkGetFenceStatus failed: %d (%s)\n", v,
+              string_VkResult(v));
+      return 1;
+    }
+    ready.insert(ready.end(), b.acquires.begin(), b.acquires.end());
+    b.acquires.clear();
+    b.ticket = 0;
+  }
+  // Everything submitted before the oldest batch still in flight is done.
+  doneTicket = oldest - 1;
+  return 0;
+}
+
+int TransferQueue::nextBatch() {
+  // Batches are used round-robin, so batchI is the oldest batch.
+  auto& b = batches.at(batchI);
+  if (b.ticket && (b.fence.wait(dev) || poll())) {
+    return 1;
+  }
+  builder.use(batchI);
+  if (builder.beginOneTimeUse()) {
+    return 1;
+  }
+  b.used = 0;
+  recording = true;
+  return 0;
+}
+
+int TransferQueue::write(Batch& b, const char* src, VkDeviceSize n) {
+  if (!jobs || n < jobBytes) {
+    return b.staging.copyFromHost(dev, src, n, b.used);
+  }
+  // The staging buffer is already mapped (see ctorError), so copyFromHost
+  // is safe on any thread as long as the ranges do not overlap.
+  language::Device* d = &dev;
+  Buffer* staging = &b.staging;
+  for (VkDeviceSize done = 0; done < n; done += jobBytes) {
+    VkDeviceSize len = std::min(jobBytes, n - done);
+    VkDeviceSize at = b.used + done;
+    const char* p = src + done;
+    b.writes.emplace_back(jobs->submit([d, staging, p, len, at]() -> int {
+      return staging->copyFromHost(*d, p, len, at);
+    }));
+  }
+  return 0;
+}
+
+int TransferQueue::copy(Buffer& dst, const void* src, size_t len,
+                        VkDeviceSize dstOffset /*= 0*/) {
+  if (batches.empty()) {
+    fprintf(stderr, "BUG: TransferQueue::copy before ctorError\n");
+    return 1;
+  }
+  if (dstOffset + len > dst.info.size) {
+    fprintf(stderr, "TransferQueue::copy(len=0x%zx, dstOffset=0x%lx) > 0x%lx\n",
+            len, dstOffset, dst.info.size);
+    return 1;
+  }
+  const char* p = (const char*)src;
+  while (len) {
+    if (!recording && nextBatch()) {
+      return 1;
+    }
+    auto& b = batches.at(batchI);
+    VkDeviceSize room = b.staging.info.size - b.used;
+    if (!room) {
+      if (flush()) {
+        return 1;
+      }
+      continue;
+    }
+    VkDeviceSize n = std::min(room, (VkDeviceSize)len);
+
+    VkBufferCopy region = {};
+    region.srcOffset = b.used;
+    region.dstOffset = dstOffset;
+    region.size = n;
+    if (write(b, p, n) ||
+        builder.copyBuffer(b.staging.vk, dst.vk,
+                           std::vector<VkBufferCopy>{region})) {
+      return 1;
+    }
+
+    VkBufferMemoryBarrier VkInit(acq);
+    if (isDedicated()) {
+      acq.srcAccessMask = 0;
+      acq.srcQueueFamilyIndex = transferQfamI;
+      acq.dstQueueFamilyIndex = graphicsQfamI;
+    } else {
+      acq.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      acq.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      acq.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    }
+    acq.dstAccessMask = accessFromUsage(dst.info.usage);
+    acq.buffer = dst.vk;
+    acq.offset = dstOffset;
+    acq.size = n;
+    b.acquires.emplace_back(acq);
+
+    b.used += n;
+    p += n;
+    len -= n;
+    dstOffset += n;
+  }
+  return 0;
+}
+
+int TransferQueue::flush(uint64_t* ticket /*= nullptr*/) {
+  if (recording) {
+    auto& b = batches.at(batchI);
+    if (jobs) {
+      // The render thread helps with the memcpys instead of sleeping.
+      int r = jobs->wait(b.writes);
+      b.writes.clear();
+      if (r) {
+        return 1;
+      }
+    }
+    if (isDedicated() && !b.acquires.empty()) {
+      // The release half of the queue family ownership transfer. The
+      // acquire half is recorded by acquire().
+      command::CommandBuilder::BarrierSet bset;
+      bset.buf = b.acquires;
+      for (auto& rel : bset.buf) {
+        rel.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        rel.dstAccessMask = 0;
+      }
+      if (builder.barrier(bset, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT)) {
+        return 1;
+      }
+    }
+    if (builder.end() || b.fence.reset(dev) ||
+        builder.submit(0, {}, {}, {}, b.fence.vk)) {
+      return 1;
+    }
+    b.ticket = nextTicket++;
+    recording = false;
+    batchI = (batchI + 1) % batches.size();
+  }
+  if (ticket) {
+    *ticket = nextTicket - 1;
+  }
+  return 0;
+}
+
+bool TransferQueue::isDone(uint64_t ticket) {
+  if (ticket > doneTicket && poll()) {
+    return false;
+  }
+  return ticket <= doneTicket;
+}
+
+int TransferQueue::wait(uint64_t ticket) {
+  if (ticket >= nextTicket) {
+    fprintf(stderr, "TransferQueue::wait(%llu): not submitted yet\n",
+            (unsigned long long)ticket);
+    return 1;
+  }
+  for (auto& b : batches) {
+    if (b.ticket && b.ticket <= ticket && b.fence.wait(dev)) {
+      return 1;
+    }
+  }
+  return poll();
+}
+
+int TransferQueue::acquire(command::CommandBuilder& graphics) {
+  if (poll()) {
+    return 1;
+  }
+  if (ready.empty()) {
+    return 0;
+  }
+  command::CommandBuilder::BarrierSet bset;
+  bset.buf.swap(ready);
+  return graphics.barrier(bset,
+                          isDedicated() ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT
+                                        : VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          acquireStages);
+}
+
+}  // namespace memory
@@ -0,0 +1,134 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include <chrono>
+#include "science.h"
+
+namespace science {
+
+int FrameScheduler::ctorError(size_t framesInFlight /*= 2*/) {
+  if (framesInFlight < 1 || framesInFlight > 3) {
+    fprintf(stderr, "FrameScheduler::ctorError(%zu): must be 1, 2, or 3\n",
+            framesInFlight);
+    return 1;
+  }
+  frames.clear();
+  frames.reserve(framesInFlight);
+  for (size_t i = 0; i < framesInFlight; i++) {
+    frames.emplace_back(dev);
+    auto& frame = frames.back();
+    // The fence starts out signalled so the first acquire() does not wait.
+    if (frame.fence.ctorError(dev, VK_FENCE_CREATE_SIGNALED_BIT) ||
+        frame.imageAvailable.ctorError(dev) || frame.renderDone.ctorError()) {
+      return 1;
+    }
+  }
+  frameI = 0;
+  imageFence.clear();
+  return 0;
+}
+
+int FrameScheduler::acquire(uint32_t& imageI, bool& outOfDate) {
+  if (frames.empty()) {
+    fprintf(stderr, "BUG: FrameScheduler::acquire before ctorError\n");
+    return 1;
+  }
+  outOfDate = false;
+  auto& frame = frames.at(frameI);
+  auto start = std::chrono::high_resolution_clock::now();
+  if (frame.fence.wait(dev)) {
+    return 1;
+  }
+
+  VkResult v = vkAcquireNextImageKHR(dev.dev, dev.swapChain, UINT64_MAX,
+                                     frame.imageAvailable.vk, VK_NULL_HANDLE,
+                                     &imageI);
+  if (v == VK_ERROR_OUT_OF_DATE_KHR) {
+    // frame.fence is still signalled, so the next acquire() will not hang.
+    outOfDate = true;
+    return 0;
+  }
+  if (v != VK_SUCCESS && v != VK_SUBOPTIMAL_KHR) {
+    fprintf(stderr, "vkAcquireNextImageKHR failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+
+  // The swapChain may hand out images in any order. If an earlier frame in
+  // flight is still rendering to imageI, wait for it too.
+  if (imageFence.size() != dev.framebufs.size()) {
+    imageFence.clear();
+    imageFence.resize(dev.framebufs.size(), VK_NULL_HANDLE);
+  }
+  if (imageI >= imageFence.size()) {
+    fprintf(stderr, "FrameScheduler::acquire: image %u >= %zu framebufs\n",
+            imageI, imageFence.size());
+    return 1;
+  }
+  VkFence prev = imageFence.at(imageI);
+  if (prev != VK_NULL_HANDLE && prev != frame.fence.vk) {
+    v = vkWaitForFences(dev.dev, 1, &prev, VK_TRUE, UINT64_MAX);
+    if (v != VK_SUCCESS) {
+      fprintf(stderr, "vkWaitForFences failed: %d (%s)\n", v,
+              string_VkResult(v));
+      return 1;
+    }
+  }
+  imageFence.at(imageI) = frame.fence.vk;
+
+  waitNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::high_resolution_clock::now() - start)
+                  .count();
+  totalWaitNanos += waitNanos;
+  frameCount++;
+  return 0;
+}
+
+int FrameScheduler::submitAndPresent(command::CommandBuilder& builder,
+                                     uint32_t imageI,
+                                     size_t poolQindex /*= 0*/) {
+  auto& frame = frames.at(frameI);
+  // Only reset the fence now that something is certain to signal it.
+  if (frame.fence.reset(dev)) {
+    return 1;
+  }
+  if (builder.submit(poolQindex, {frame.imageAvailable.vk},
+                     {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT},
+                     {frame.renderDone.vk}, frame.fence.vk)) {
+    // Nothing will signal the fence now. Replace it with a signalled fence
+    // so acquire() and onResized() do not wait for it forever.
+    for (auto& f : imageFence) {
+      if (f == frame.fence.vk) {
+        f = VK_NULL_HANDLE;
+      }
+    }
+    frame.fence.vk.reset();
+    if (frame.fence.ctorError(dev, VK_FENCE_CREATE_SIGNALED_BIT)) {
+      fprintf(stderr, "FrameScheduler: failed to replace the fence\n");
+    }
+    return 1;
+  }
+  if (frame.renderDone.present(imageI)) {
+    return 1;
+  }
+  frameI = (frameI + 1) % frames.size();
+  return 0;
+}
+
+int FrameScheduler::onResized(language::Instance& instance,
+                              language::Device& dev,
+                              command::CommandBuilder& builder,
+                              VkExtent2D newSize) {
+  for (auto& frame : frames) {
+    // Every fence is either signalled or about to be signalled: the fence is
+    // only reset in submitAndPresent, which replaces it with a signalled
+    // fence if the submit fails.
+    if (frame.fence.wait(dev)) {
+      return 1;
+    }
+  }
+  // The swapChain may have a different number of images after the resize.
+  imageFence.clear();
+  return 0;
+}
+
+}  // namespace science
@@ -0,0 +1,120 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "science.h"
+
+namespace science {
+
+int OffscreenTarget::ctorError(size_t count /*= 1*/) {
+  if (!dev.headless) {
+    fprintf(stderr, "OffscreenTarget: dev has a swapChain, not headless\n");
+    return 1;
+  }
+  if (!count) {
+    fprintf(stderr, "OffscreenTarget::ctorError(0): invalid\n");
+    return 1;
+  }
+  const VkExtent2D& extent = dev.swapChainExtent;
+  dev.framebufs.clear();
+  targets.clear();
+  targets.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    targets.emplace_back(dev);
+    auto& t = targets.back();
+    t.image.info.extent = {extent.width, extent.height, 1};
+    t.image.info.format = dev.format.format;
+    t.image.info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    t.image.info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    t.image.info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                         VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    t.pixels.info.size = (VkDeviceSize)extent.width * extent.height * 4;
+    t.pixels.info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (t.image.ctorDeviceLocal(dev) || t.image.bindMemory(dev) ||
+        t.pixels.ctorError(dev, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
+        t.pixels.bindMemory(dev) || t.pixels.mem.mapPersistent(dev)) {
+      fprintf(stderr, "OffscreenTarget: target %zu failed\n", i);
+      return 1;
+    }
+
+    // Framebuf::image does not own the VkImage. targets does.
+    dev.framebufs.emplace_back(dev);
+    auto& framebuf = dev.framebufs.back();
+    framebuf.image = t.image.vk;
+    if (framebuf.imageView0.ctorError(dev, framebuf.image, dev.format.format)) {
+      return 1;
+    }
+    framebuf.attachments.emplace_back(framebuf.imageView0.vk);
+  }
+  return 0;
+}
+
+int OffscreenTarget::readback(command::CommandBuilder& builder, size_t i) {
+  if (i >= targets.size()) {
+    fprintf(stderr, "OffscreenTarget::readback(%zu): only %zu targets\n", i,
+            targets.size());
+    return 1;
+  }
+  auto& t = targets.at(i);
+
+  // The RenderPass already changed the layout. Wait for it to finish
+  // writing before the copy reads the image.
+  command::CommandBuilder::BarrierSet bset;
+  VkImageMemoryBarrier VkInit(imb);
+  imb.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  imb.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  imb.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  imb.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  imb.image = t.image.vk;
+  Subres(imb.subresourceRange).addColor();
+  bset.img.emplace_back(imb);
+  if (builder.barrier(bset, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT)) {
+    return 1;
+  }
+
+  std::vector<VkBufferImageCopy> regions(1);
+  auto& region = regions.at(0);
+  region.bufferOffset = 0;
+  region.bufferRowLength = 0;    // Tightly packed.
+  region.bufferImageHeight = 0;  // Tightly packed.
+  Subres(region.imageSubresource).addColor();
+  region.imageOffset = {0, 0, 0};
+  region.imageExtent = t.image.info.extent;
+  if (builder.copyImageToBuffer(t.image.vk,
+                                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                t.pixels.vk, regions)) {
+    return 1;
+  }
+
+  // Make the copy visible to the host.
+  command::CommandBuilder::BarrierSet hset;
+  VkBufferMemoryBarrier VkInit(bmb);
+  bmb.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  bmb.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  bmb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bmb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bmb.buffer = t.pixels.vk;
+  bmb.offset = 0;
+  bmb.size = VK_WHOLE_SIZE;
+  hset.buf.emplace_back(bmb);
+  return builder.barrier(hset, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT);
+}
+
+int OffscreenTarget::read(size_t i, std::vector<uint8_t>& out) {
+  if (i >= targets.size()) {
+    fprintf(stderr, "OffscreenTarget::read(%zu): only %zu targets\n", i,
+            targets.size());
+    return 1;
+  }
+  auto& t = targets.at(i);
+  if (t.pixels.mem.invalidate(dev)) {
+    return 1;
+  }
+  out.resize(t.pixels.info.size);
+  memcpy(out.data(), t.pixels.mem.mapped, out.size());
+  return 0;
+}
+
+}  // namespace science
@@ -2,11 +2,8 @@
  * This file is only built if "use_spirv_cross_reflection" is enabled.
  */
 #include "reflect.h"
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
+#include <lib/file/file.h>
+#include <algorithm>
 #include <map>
 #include <vendor/spirv_cross/spirv_glsl.hpp>
 #include "science.h"
@@ -50,10 +47,39 @@ static void print_stage(spirv_cross::CompilerGLSL& compiler,
   print_resources("separate_samplers", resources.separate_samplers, compiler);
 }
 
+// addPushConstants merges r into ranges. Vulkan allows only one range per
+// stage, so every range that has one of r's stages is first folded into r,
+// growing it to cover them all. Then stages that declare the same block
+// share one range.
+static void addPushConstants(vector<VkPushConstantRange>& ranges,
+                             const VkPushConstantRange& r) {
+  VkPushConstantRange m = r;
+  for (size_t i = 0; i < ranges.size();) {
+    auto& e = ranges.at(i);
+    if (!(e.stageFlags & m.stageFlags)) {
+      i++;
+      continue;
+    }
+    uint32_t end = std::max(e.offset + e.size, m.offset + m.size);
+    m.offset = std::min(e.offset, m.offset);
+    m.size = end - m.offset;
+    m.stageFlags |= e.stageFlags;
+    ranges.erase(ranges.begin() + i);
+  }
+  for (auto& e : ranges) {
+    if (e.offset == m.offset && e.size == m.size) {
+      e.stageFlags |= m.stageFlags;
+      return;
+    }
+  }
+  ranges.emplace_back(m);
+}
+
 }  // anonymous namespace
 
 struct ShaderLibraryInternal {
-  ShaderLibraryInternal(ShaderLibrary* self) : self{*self} {}
+  ShaderLibraryInternal(ShaderLibrary* self, language::Device& dev)
+      : self{*self}, dev{dev} {}
 
   struct ShaderState {
     ShaderState(const void* bytes, uint32_t len)
@@ -111,7 +137,19 @@ struct ShaderLibraryInternal {
       }
       VkDescriptorSetLayoutBinding VkInit(layoutBinding);
       layoutBinding.binding = bindingI;
+      // An array of resources, such as sampler2D tex[4], is one binding
+      // with a descriptor per element.
       layoutBinding.descriptorCount = 1;
+      for (auto n : compiler.get_type(res.type_id).array) {
+        if (!n) {
+          fprintf(stderr,
+                  "WARNING: shader at stage %s:\n"
+                  "WARNING: binding=%u is a runtime array, assuming 1\n",
+                  string_VkShaderStageFlagBits(stageBits), bindingI);
+          continue;
+        }
+        layoutBinding.descriptorCount *= n;
+      }
       layoutBinding.descriptorType = rtm.descriptorType;
       layoutBinding.pImmutableSamplers = nullptr;
       // layoutBinding1.stageFlags is set in
@@ -121,8 +159,45 @@ struct ShaderLibraryInternal {
     return 0;
   }
 
+  // reflectPushConstants adds the push constant block of a stage (there can
+  // only be one) to pushConstants. The range starts at the first member's
+  // offset, so a stage that uses layout(offset = N) to skip the bytes of
+  // another stage gets a range that starts at N.
+  int reflectPushConstants(VkShaderStageFlagBits stageBits,
+                           spirv_cross::CompilerGLSL& compiler,
+                           const vector<spirv_cross::Resource>& resources,
+                           vector<VkPushConstantRange>& pushConstants) {
+    for (auto& res : resources) {
+      auto& type = compiler.get_type(res.base_type_id);
+      if (type.member_types.empty()) {
+        continue;
+      }
+      uint32_t offset = ~0u;
+      for (uint32_t i = 0; i < type.member_types.size(); i++) {
+        offset = std::min(offset,
+                          compiler.get_member_decoration(
+                              res.base_type_id, i, spv::DecorationOffset));
+      }
+      uint32_t end = compiler.get_declared_struct_size(type);
+      if (end <= offset || end > dev.physProp.limits.maxPushConstantsSize) {
+        fprintf(stderr,
+                "push constants at stage %s: offset %u size %u (max %u)\n",
+                string_VkShaderStageFlagBits(stageBits), offset, end - offset,
+                dev.physProp.limits.maxPushConstantsSize);
+        return 1;
+      }
+      VkPushConstantRange r;
+      r.stageFlags = stageBits;
+      r.offset = offset;
+      r.size = end - offset;
+      addPushConstants(pushConstants, r);
+    }
+    return 0;
+  }
+
   int addStage(shared_ptr<Shader> shader, ShaderState& state,
-               VkShaderStageFlagBits stageBits) {
+               VkShaderStageFlagBits stageBits,
+               vector<VkPushConstantRange>& pushConstants) {
     state.isStaged = true;
 
     // Decompile the shader and reflect the shader layouts.
@@ -152,19 +227,20 @@ struct ShaderLibraryInternal {
         return 1;
       }
     }
-
-    return 0;
+    return reflectPushConstants(stageBits, compiler,
+                                resources.push_constant_buffers, pushConstants);
   }
 
   map<shared_ptr<Shader>, ShaderState> states;
   vector<ShaderBinding> bindings;
   ShaderLibrary& self;
+  language::Device& dev;
 };
 
 shared_ptr<Shader> ShaderLibrary::load(const void* spvBegin,
                                        const void* spvEnd) {
   if (!_i) {
-    _i = new ShaderLibraryInternal(this);
+    _i = new ShaderLibraryInternal(this, dev);
   }
 
   auto shader = shared_ptr<Shader>(new Shader(dev));
@@ -179,65 +255,30 @@ shared_ptr<Shader> ShaderLibrary::load(const void* spvBegin,
 
 shared_ptr<Shader> ShaderLibrary::load(const char* filename) {
   if (!_i) {
-    _i = new ShaderLibraryInternal(this);
-  }
-  // All this mmap() machinery is duplicated in command/shader.cpp.
-  // Other than creating a file-layer-abstraction library to factor this out,
-  // the only way to grab the mmaped bytes is to duplicate the mmap code.
-  int infile = open(filename, O_RDONLY);
-  if (infile < 0) {
-    fprintf(stderr, "ShaderLibrary::load: open(%s) failed: %d %s\n", filename,
-            errno, strerror(errno));
-    // Failed. Return a null shared_ptr.
-    return shared_ptr<Shader>();
-  }
-  struct stat s;
-  if (fstat(infile, &s) == -1) {
-    fprintf(stderr, "ShaderLibrary::load: fstat(%s) failed: %d %s\n", filename,
-            errno, strerror(errno));
-    // Failed. Return a null shared_ptr.
-    return shared_ptr<Shader>();
+    _i = new ShaderLibraryInternal(this, dev);
   }
-  char* map =
-      (char*)mmap(0, s.st_size, PROT_READ, MAP_SHARED, infile, 0 /*offset*/);
-  if (!map) {
-    fprintf(stderr, "ShaderLibrary::load: mmap(%s) failed: %d %s\n", filename,
-            errno, strerror(errno));
-    close(infile);
+  file::MappedFile f;
+  if (f.open(filename)) {
+    fprintf(stderr, "ShaderLibrary::load(%s) failed\n", filename);
     // Failed. Return a null shared_ptr.
     return shared_ptr<Shader>();
   }
 
   auto shader = shared_ptr<Shader>(new Shader(dev));
-  int r = shader->loadSPV(map, map + s.st_size);
-  if (!r && _i->addShaderState(shader, map, s.st_size)) {
+  int r = shader->loadSPV(f.data, f.data + f.size);
+  if (!r && _i->addShaderState(shader, f.data, f.size)) {
     r = 1;
   }
-  if (munmap(map, s.st_size) < 0) {
-    fprintf(stderr, "ShaderLibrary::load: munmap(%s) failed: %d %s\n", filename,
-            errno, strerror(errno));
-    close(infile);
+  if (f.close() || r) {
     // Failed. Return a null shared_ptr.
     return shared_ptr<Shader>();
   }
-  if (close(infile) < 0) {
-    fprintf(stderr, "ShaderLibrary::load: close(%s) failed: %d %s\n", filename,
-            errno, strerror(errno));
-    // Failed. Return a null shared_ptr.
-    return shared_ptr<Shader>();
-  }
-  if (r) {
-    // shader->loadSPV() or _i->addShaderState() failed. Return a null
-    // shared_ptr.
-    return shared_ptr<Shader>();
-  }
   return shader;
 }
 
-int ShaderLibrary::stage(RenderPass& renderPass, PipeBuilder& pipe,
-                         VkShaderStageFlagBits stageBits,
-                         shared_ptr<Shader> shader,
-                         string entryPointName /*= "main"*/) {
+int ShaderLibrary::reflectStage(shared_ptr<Shader> shader,
+                                VkShaderStageFlagBits stageBits,
+                                vector<VkPushConstantRange>& pushConstants) {
   if (!_i) {
     fprintf(stderr, "BUG: ShaderLibrary::stage before ShaderLibrary::load\n");
     return 1;
@@ -253,12 +294,64 @@ int ShaderLibrary::stage(RenderPass& renderPass, PipeBuilder& pipe,
             "BUG: where did this shared_ptr<Shader> come from?\n");
     return 1;
   }
+  return _i->addStage(state->first, state->second, stageBits, pushConstants);
+}
 
-  return _i->addStage(state->first, state->second, stageBits) ||
+int ShaderLibrary::stage(RenderPass& renderPass, PipeBuilder& pipe,
+                         VkShaderStageFlagBits stageBits,
+                         shared_ptr<Shader> shader,
+                         string entryPointName /*= "main"*/) {
+  return reflectStage(shader, stageBits, pipe.pipeline.info.pushConstants) ||
          pipe.pipeline.info.addShader(shader, dev, renderPass, stageBits,
                                       entryPointName);
 }
 
+int ShaderLibrary::stage(ComputePipeline& pipe, shared_ptr<Shader> shader,
+                         string entryPointName /*= "main"*/) {
+  if (reflectStage(shader, VK_SHADER_STAGE_COMPUTE_BIT, pipe.pushConstants)) {
+    return 1;
+  }
+  pipe.shader = shader;
+  pipe.entryPointName = entryPointName;
+  return 0;
+}
+
+int ShaderLibrary::makeDynamic(uint32_t setI, uint32_t binding) {
+  if (!_i || setI >= _i->bindings.size()) {
+    fprintf(stderr, "ShaderLibrary::makeDynamic(%u, %u): set not found\n",
+            setI, binding);
+    return 1;
+  }
+  // Every stage that uses the binding added its own copy. Change them all.
+  bool found = false;
+  for (auto& layout : _i->bindings.at(setI).layouts) {
+    if (layout.binding != binding) {
+      continue;
+    }
+    switch (layout.descriptorType) {
+      case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+      case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+        layout.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        break;
+      case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+      case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+        layout.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+        break;
+      default:
+        fprintf(stderr, "ShaderLibrary::makeDynamic(%u, %u): type is %s\n",
+                setI, binding, string_VkDescriptorType(layout.descriptorType));
+        return 1;
+    }
+    found = true;
+  }
+  if (!found) {
+    fprintf(stderr, "ShaderLibrary::makeDynamic(%u, %u): binding not found\n",
+            setI, binding);
+    return 1;
+  }
+  return 0;
+}
+
 int ShaderLibrary::makeDescriptorLibrary(DescriptorLibrary& descriptorLibrary) {
   if (!_i) {
     fprintf(stderr,
@@ -282,21 +375,19 @@ int ShaderLibrary::makeDescriptorLibrary(DescriptorLibrary& descriptorLibrary) {
             unusedCount, unusedCount == 1 ? "" : "s");
   }
 
-  // Estimate max count of DescriptorSet objects the DescriptorLibrary will use
-  uint32_t maxSets = 0;
-  // Collect all types for DescriptorLibrary::ctorError
-  vector<VkDescriptorType> types;
+  // Size each DescriptorPool by the average descriptors per layout: each
+  // makeSet uses one layout.
+  map<VkDescriptorType, uint32_t> typeCounts;
 
   descriptorLibrary.layouts.clear();
   descriptorLibrary.layouts.reserve(_i->bindings.size());
   for (size_t bindingI = 0; bindingI < _i->bindings.size(); bindingI++) {
     auto binding = _i->bindings.at(bindingI);
-    maxSets++;
 
     vector<VkDescriptorSetLayoutBinding> libBindings(binding.layouts.size());
     for (size_t layoutI = 0; layoutI < binding.layouts.size(); layoutI++) {
       auto& layout = binding.layouts.at(layoutI);
-      types.emplace_back(layout.descriptorType);
+      typeCounts[layout.descriptorType] += layout.descriptorCount;
 
       // This could be more efficient if stage bits could be broken down
       // to per-stage granularity.
@@ -314,40 +405,50 @@ int ShaderLibrary::makeDescriptorLibrary(DescriptorLibrary& descriptorLibrary) {
     }
   }
 
-  if (descriptorLibrary.pool.ctorError(maxSets, types)) {
-    fprintf(stderr, "DescriptorPool::ctorError failed\n");
-    return 1;
+  auto& ratios = descriptorLibrary.pool.ratios;
+  ratios.clear();
+  for (auto& t : typeCounts) {
+    ratios.emplace_back();
+    ratios.back().type = t.first;
+    ratios.back().perSet = t.second / (float)_i->bindings.size();
   }
   return 0;
 }
 
 unique_ptr<memory::DescriptorSet> DescriptorLibrary::makeSet(
     PipeBuilder& pipe, size_t layoutI /*= 0*/) {
-  if (!pool.vk) {
+  return makeSet(pipe.pipeline.info.setLayouts, layoutI);
+}
+
+unique_ptr<memory::DescriptorSet> DescriptorLibrary::makeSet(
+    ComputePipeline& pipe, size_t layoutI /*= 0*/) {
+  return makeSet(pipe.setLayouts, layoutI);
+}
+
+unique_ptr<memory::DescriptorSet> DescriptorLibrary::makeSet(
+    vector<VkDescriptorSetLayout>& setLayouts, size_t layoutI) {
+  if (layouts.empty()) {
     fprintf(stderr,
             "BUG: DescriptorLibrary::makeSet(%zu) "
             "before ShaderLibrary::makeDescriptorLibrary\n",
             layoutI);
     return unique_ptr<memory::DescriptorSet>();
   }
-  if (layoutI > layouts.size()) {
+  if (layoutI >= layouts.size()) {
     fprintf(stderr, "BUG: DescriptorLibrary::makeSet(%zu) with %zu layouts\n",
             layoutI, layouts.size());
     return unique_ptr<memory::DescriptorSet>();
   }
   auto& layout = layouts.at(layoutI);
 
-  auto* set = new memory::DescriptorSet(pool);
-  if (set->ctorError(layout)) {
-    // TODO: set may fail if DescriptorPool is full.
-    // Allocate another DescriptorPool and retry.
-    fprintf(stderr, "DescriptorSet::ctorError failed\n");
-    delete set;
-    return unique_ptr<memory::DescriptorSet>();
+  auto set = pool.alloc(layout);
+  if (!set) {
+    fprintf(stderr, "DescriptorLibrary::makeSet(%zu) failed\n", layoutI);
+    return set;
   }
 
-  pipe.pipeline.info.setLayouts.emplace_back(layout.vk);
-  return unique_ptr<memory::DescriptorSet>(set);
+  setLayouts.emplace_back(layout.vk);
+  return set;
 }
 
 ShaderLibrary::~ShaderLibrary() {
@@ -55,6 +55,16 @@ int PipeBuilder::onResized(language::Instance& unusedInstance,
                            language::Device& dev,
                            command::CommandBuilder& builder,
                            VkExtent2D unusedNewSize) {
+  // The viewport and scissor are dynamic state, so just patch the values
+  // that CommandBuilder::setViewport() and setScissor() will use.
+  for (auto& viewport : pipeline.info.viewports) {
+    viewport.width = (float)dev.swapChainExtent.width;
+    viewport.height = (float)dev.swapChainExtent.height;
+  }
+  for (auto& scissor : pipeline.info.scissors) {
+    scissor.extent = dev.swapChainExtent;
+  }
+
   // if addDepthImage() was called, recreate the depthImage.
   if (depthImage.info.format != VK_FORMAT_UNDEFINED) {
     depthImage.info.extent = {1, 1, 1};
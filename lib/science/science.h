@@ -12,6 +12,7 @@
 #include <lib/memory/memory.h>
 #include <string.h>
 #include <unistd.h>
+#include <algorithm>
 #include <memory>
 
 #pragma once
@@ -184,7 +185,9 @@ class SwapChainResizeObserver {
 };
 
 // ResizeDeviceWaitIdle is a convenient SwapChainResizeObserver  which
-// just calls vkDeviceWaitIdle.
+// just calls vkDeviceWaitIdle. An application that uses FrameScheduler should
+// replace it with the FrameScheduler, which only waits for the frames in
+// flight (see SwapChainResizeList::replace).
 struct ResizeDeviceWaitIdle : public SwapChainResizeObserver {
   WARN_UNUSED_RESULT virtual int onResized(language::Instance& instance,
                                            language::Device& dev,
@@ -225,12 +228,34 @@ struct SwapChainResizeList {
   // list contains all SwapChainResizeObserver to be notified in onResized.
   std::vector<SwapChainResizeObserver*> list;
 
+  // replace swaps observer 'from' in list for 'to'. For example, to let a
+  // FrameScheduler wait for its frames in flight instead of calling
+  // vkDeviceWaitIdle:
+  //   resizeList.replace(&resizeList.resizeDeviceWaitIdle, &frameScheduler);
+  WARN_UNUSED_RESULT int replace(SwapChainResizeObserver* from,
+                                 SwapChainResizeObserver* to) {
+    for (auto& observer : list) {
+      if (observer == from) {
+        observer = to;
+        return 0;
+      }
+    }
+    fprintf(stderr, "SwapChainResizeList::replace: observer not found\n");
+    return 1;
+  }
+
   // syncResize notifies all SwapChainResizeObserver in list and waits until
-  // the device has completed any command buffers.
+  // the setup commands they recorded have completed.
+  //
+  // The RenderPass and Pipeline objects are not rebuilt: call
+  // PipeBuilder::dynamicViewport() so only the swapChain, framebuffers and
+  // depth image need to be recreated. The old swapChain is passed to the
+  // new one as oldSwapchain.
   int syncResize(command::CommandPool& pool, VkExtent2D newSize,
                  size_t poolQindex = 0) {
     command::CommandBuilder rebuilder(pool);
-    if (rebuilder.beginOneTimeUse()) {
+    command::Fence done(pool.dev);
+    if (done.ctorError(pool.dev) || rebuilder.beginOneTimeUse()) {
       fprintf(stderr, "SwapChainResizeList: beginOneTimeUse failed\n");
       return 1;
     }
@@ -241,15 +266,150 @@ struct SwapChainResizeList {
         return 1;
       }
     }
-    if (rebuilder.end() || rebuilder.submit(0)) {
+    // Wait for rebuilder only, not the whole queue.
+    if (rebuilder.end() ||
+        rebuilder.submit(poolQindex, {}, {}, {}, done.vk) ||
+        done.wait(pool.dev)) {
       fprintf(stderr, "SwapChainResizeList: rebuilder failed\n");
       return 1;
     }
-    vkQueueWaitIdle(pool.q(poolQindex));
     return 0;
   }
 };
 
+// FrameScheduler runs the acquire-submit-present cycle with a bounded number
+// of frames in flight. Each frame in flight has its own Fence, an
+// imageAvailable Semaphore and a renderDone PresentSemaphore, so the CPU can
+// record frame N+1 while the GPU renders frame N, but never gets more than
+// framesInFlight frames ahead of the GPU.
+//
+// Fewer frames in flight means lower input latency. More frames in flight
+// keeps the GPU busier when the CPU's frame time varies. waitNanos measures
+// how long the CPU blocked in acquire(); if it is consistently large the
+// application is GPU bound and framesInFlight could be lowered.
+//
+// Example usage:
+//   science::FrameScheduler frames(dev);
+//   if (frames.ctorError(2)) { ... }
+//   while (...) {
+//     uint32_t imageI;
+//     bool outOfDate;
+//     if (frames.acquire(imageI, outOfDate)) { ... }
+//     if (outOfDate) { ... resize ...; continue; }
+//     builder.use(imageI);
+//     if (frames.submitAndPresent(builder, imageI)) { ... }
+//   }
+typedef struct FrameScheduler : public SwapChainResizeObserver {
+  FrameScheduler(language::Device& dev) : dev(dev) {}
+  FrameScheduler(FrameScheduler&&) = default;
+  FrameScheduler(const FrameScheduler&) = delete;
+
+  // Two-stage constructor: check the return code of ctorError().
+  // framesInFlight must be 1, 2, or 3.
+  WARN_UNUSED_RESULT int ctorError(size_t framesInFlight = 2);
+
+  // acquire() waits until the next frame in flight is done on the GPU, then
+  // calls vkAcquireNextImageKHR. It also waits for any frame still rendering
+  // to the same swapChain image.
+  //
+  // When acquire() returns 0, imageI is the swapChain image to render to and
+  // all previous GPU work that used imageI is complete. If outOfDate is set,
+  // the swapChain must be rebuilt (see SwapChainResizeList) and nothing
+  // should be submitted this frame.
+  WARN_UNUSED_RESULT int acquire(uint32_t& imageI, bool& outOfDate);
+
+  // submitAndPresent() submits the current command buffer of builder, then
+  // presents imageI. imageI must be the value returned by acquire(). If the
+  // submit fails, the frame's fence is replaced with a signalled one, so a
+  // later acquire() or onResized() does not hang.
+  WARN_UNUSED_RESULT int submitAndPresent(command::CommandBuilder& builder,
+                                          uint32_t imageI,
+                                          size_t poolQindex = 0);
+
+  // onResized waits for the frames in flight, which are the only GPU work
+  // that can use the old swapChain images and framebuffers. Unlike
+  // ResizeDeviceWaitIdle it does not wait for other queues, such as a
+  // memory::TransferQueue.
+  WARN_UNUSED_RESULT virtual int onResized(language::Instance& instance,
+                                           language::Device& dev,
+                                           command::CommandBuilder& builder,
+                                           VkExtent2D newSize);
+
+  size_t framesInFlight() const { return frames.size(); }
+
+  language::Device& dev;
+  // frameI is the frame in flight (not the swapChain image) in use.
+  size_t frameI{0};
+
+  // waitNanos is how long the CPU waited for the GPU in the last acquire().
+  uint64_t waitNanos{0};
+  // totalWaitNanos and frameCount accumulate waitNanos for averaging. The
+  // application may reset them at any time.
+  uint64_t totalWaitNanos{0};
+  uint64_t frameCount{0};
+
+ protected:
+  typedef struct Frame {
+    Frame(language::Device& dev)
+        : fence(dev), imageAvailable(dev), renderDone(dev) {}
+    Frame(Frame&&) = default;
+    Frame(const Frame&) = delete;
+
+    command::Fence fence;
+    command::Semaphore imageAvailable;
+    command::PresentSemaphore renderDone;
+  } Frame;
+  std::vector<Frame> frames;
+  // imageFence maps each swapChain image to the Fence of the last frame that
+  // rendered to it, or VK_NULL_HANDLE.
+  std::vector<VkFence> imageFence;
+} FrameScheduler;
+
+// OffscreenTarget renders into memory::Image color targets instead of a
+// swapChain, for a headless language::Device (see Instance::ctorError).
+// ctorError() fills dev.framebufs with one Framebuf per Image, so
+// RenderPass and CommandBuilder work the same as with a swapChain. The
+// RenderPass leaves each Image in VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL.
+//
+// Example usage:
+//   science::OffscreenTarget offscreen(dev);
+//   if (offscreen.ctorError(2)) { ... }
+//   // Record the render pass for framebuf i, then:
+//   if (builder.endRenderPass() || offscreen.readback(builder, i) ||
+//       builder.end()) { ... }
+//   // After the fence for command buffer i has signalled:
+//   std::vector<uint8_t> rgba;
+//   if (offscreen.read(i, rgba)) { ... }
+typedef struct OffscreenTarget {
+  OffscreenTarget(language::Device& dev) : dev(dev) {}
+  OffscreenTarget(OffscreenTarget&&) = default;
+  OffscreenTarget(const OffscreenTarget&) = delete;
+
+  // Two-stage constructor: check the return code of ctorError().
+  // count is how many framebufs to create. The size is dev.swapChainExtent.
+  WARN_UNUSED_RESULT int ctorError(size_t count = 1);
+
+  // readback records a copy of framebuf i into a host-visible buffer. Call
+  // it after the RenderPass has ended.
+  WARN_UNUSED_RESULT int readback(command::CommandBuilder& builder, size_t i);
+
+  // read copies the pixels of framebuf i, as 4 bytes per pixel in
+  // dev.format, into out. Call it only after the commands recorded by
+  // readback() have completed.
+  WARN_UNUSED_RESULT int read(size_t i, std::vector<uint8_t>& out);
+
+  language::Device& dev;
+
+ protected:
+  typedef struct Target {
+    Target(language::Device& dev) : image(dev), pixels(dev) {}
+
+    memory::Image image;
+    memory::Buffer pixels;
+  } Target;
+  std::vector<Target> targets;
+} OffscreenTarget;
+
 // PipeBuilder is a builder for command::Pipeline.
 // PipeBuilder immediately installs a new command::Pipeline in the
 // command::RenderPass it gets in its constructor, so instantiating a
@@ -265,6 +425,19 @@ typedef struct PipeBuilder : public SwapChainResizeObserver {
 
   command::Pipeline& pipeline;
 
+  // dynamicViewport makes the viewport and scissor dynamic state, so a
+  // resize only has to update pipeline.info.viewports and scissors (see
+  // onResized) and not rebuild the Pipeline. The command buffers must then
+  // call CommandBuilder::setViewport() and setScissor() before drawing.
+  void dynamicViewport() {
+    auto& states = pipeline.info.dynamicStates;
+    for (auto s : {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR}) {
+      if (std::find(states.begin(), states.end(), s) == states.end()) {
+        states.emplace_back(s);
+      }
+    }
+  }
+
   // addDepthImage adds a depth buffer to the pipeline, choosing the first
   // of formatChoices that is available.
   // Because addDepthImage automatically calls recreateSwapChainExtent, you must
@@ -315,7 +488,9 @@ typedef struct PipeBuilder : public SwapChainResizeObserver {
   }
 
   // onResized allows PipeBuilder to rebuild itself when the swapChain is
-  // resized.
+  // resized. It updates the viewport and scissor extent and recreates the
+  // depth image. It does not rebuild the Pipeline, so without
+  // dynamicViewport() the Pipeline keeps its old viewport.
   WARN_UNUSED_RESULT virtual int onResized(language::Instance& unusedInstance,
                                            language::Device& dev,
                                            command::CommandBuilder& builder,
@@ -329,8 +504,9 @@ typedef struct PipeBuilder : public SwapChainResizeObserver {
 
 #ifdef USE_SPIRV_CROSS_REFLECTION
 
-// DescriptorLibrary is the DescriptorSet objects and DescriptorPool they are
-// allocated from.
+// DescriptorLibrary is the DescriptorSet objects and the DescriptorAllocator
+// they are allocated from. It adds DescriptorPools as needed, so makeSet can
+// be called any number of times.
 class DescriptorLibrary {
  public:
   DescriptorLibrary(language::Device& dev) : pool{dev} {}
@@ -352,9 +528,18 @@ class DescriptorLibrary {
   std::unique_ptr<memory::DescriptorSet> makeSet(PipeBuilder& pipe,
                                                  size_t layoutI = 0);
 
+  // makeSet creates a new DescriptorSet from layouts[layoutI] for a
+  // ComputePipeline. Call it before pipe.ctorError().
+  std::unique_ptr<memory::DescriptorSet> makeSet(command::ComputePipeline& pipe,
+                                                 size_t layoutI = 0);
+
  protected:
   friend class ShaderLibrary;
-  memory::DescriptorPool pool;
+  // makeSet adds layouts[layoutI] to setLayouts and creates a DescriptorSet.
+  std::unique_ptr<memory::DescriptorSet> makeSet(
+      std::vector<VkDescriptorSetLayout>& setLayouts, size_t layoutI);
+
+  memory::DescriptorAllocator pool;
 };
 
 struct ShaderLibraryInternal;
@@ -403,13 +588,30 @@ class ShaderLibrary {
     return load(filename.c_str());
   }
 
-  // stage puts a shader into a pipeline at the specified stageBits.
+  // stage puts a shader into a pipeline at the specified stageBits. It also
+  // adds the shader's push constant block, if any, to
+  // pipe.pipeline.info.pushConstants. Push constants from different stages
+  // may share one block, or use layout(offset = N) to split the bytes.
   WARN_UNUSED_RESULT int stage(command::RenderPass& renderPass,
                                PipeBuilder& pipe,
                                VkShaderStageFlagBits stageBits,
                                std::shared_ptr<command::Shader> shader,
                                std::string entryPointName = "main");
 
+  // stage sets the shader of a ComputePipeline and reflects its layouts and
+  // push constants.
+  // Call it before makeDescriptorLibrary and pipe.ctorError().
+  WARN_UNUSED_RESULT int stage(command::ComputePipeline& pipe,
+                               std::shared_ptr<command::Shader> shader,
+                               std::string entryPointName = "main");
+
+  // makeDynamic changes layout(set = setI, binding = binding) from a
+  // UNIFORM_BUFFER to UNIFORM_BUFFER_DYNAMIC (or STORAGE_BUFFER to
+  // STORAGE_BUFFER_DYNAMIC). The shader source is the same either way, so
+  // reflection cannot tell. Call makeDynamic after stage() and before
+  // makeDescriptorLibrary.
+  WARN_UNUSED_RESULT int makeDynamic(uint32_t setI, uint32_t binding);
+
   // makeDescriptorLibrary inits a DescriptorLibrary to the ShaderLibrary and
   // inits its layouts from the layouts in the shaders in ShaderLibrary.
   //
@@ -418,6 +620,12 @@ class ShaderLibrary {
   int makeDescriptorLibrary(DescriptorLibrary& descriptorLibrary);
 
  protected:
+  // reflectStage adds the layouts of shader to the ShaderLibrary, and merges
+  // its push constant range into pushConstants.
+  WARN_UNUSED_RESULT int reflectStage(
+      std::shared_ptr<command::Shader> shader, VkShaderStageFlagBits stageBits,
+      std::vector<VkPushConstantRange>& pushConstants);
+
   language::Device& dev;
   ShaderLibraryInternal* _i;
 };
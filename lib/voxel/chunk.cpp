@@ -0,0 +1,265 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "voxel.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace voxel {
+
+// C++14 needs a definition of static constexpr members that are odr-used.
+constexpr int Chunk::bits;
+constexpr uint32_t Chunk::size;
+constexpr uint32_t Chunk::volume;
+constexpr size_t Chunk::lookupAbove;
+constexpr size_t Chunk::maxSerialWords;
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// bitsFor returns the smallest valid indexBits that can index n entries.
+uint8_t bitsFor(size_t n) {
+  if (n <= 1) return 0;
+  if (n <= 2) return 1;
+  if (n <= 4) return 2;
+  if (n <= 16) return 4;
+  if (n <= 256) return 8;
+  return 16;
+}
+
+// serialVersion is stored in the first word written by Chunk::serialize.
+constexpr uint64_t serialVersion = 1;
+
+}  // anonymous namespace
+
+void Chunk::setI(uint32_t i, Block b) {
+  if (!indexBits) {
+    if (palette[0] == b) {
+      return;  // Uniform fast path: nothing to do.
+    }
+    repack(1, {});
+  }
+  uint32_t old = readIndex(i);
+  if (palette[old] == b) {
+    return;
+  }
+  uint32_t p = paletteIndex(b);  // May call repack(), but does not change old.
+  writeIndex(i, p);
+  counts[p]++;
+  if (!--counts[old]) {
+    freeSlots.emplace_back(old);
+    if (lookup) {
+      lookup->erase(palette[old]);
+    }
+  }
+}
+
+uint32_t Chunk::paletteIndex(Block b) {
+  if (lookup) {
+    auto it = lookup->find(b);
+    if (it != lookup->end()) {
+      return it->second;
+    }
+  } else {
+    for (uint32_t p = 0; p < palette.size(); p++) {
+      if (counts[p] && palette[p] == b) {
+        return p;
+      }
+    }
+  }
+
+  uint32_t p;
+  if (!freeSlots.empty()) {
+    p = freeSlots.back();
+    freeSlots.pop_back();
+    palette[p] = b;
+  } else {
+    p = palette.size();
+    palette.emplace_back(b);
+    counts.emplace_back(0);
+    if (p >= (1u << indexBits)) {
+      repack(indexBits * 2, {});
+    }
+  }
+  if (!lookup && palette.size() > lookupAbove) {
+    lookup.reset(new std::unordered_map<Block, uint32_t>());
+    for (uint32_t q = 0; q < palette.size(); q++) {
+      if (counts[q] || q == p) {
+        lookup->emplace(palette[q], q);
+      }
+    }
+  } else if (lookup) {
+    lookup->emplace(b, p);
+  }
+  return p;
+}
+
+void Chunk::repack(uint8_t newBits, const std::vector<uint32_t>& remap) {
+  std::vector<uint64_t> out;
+  uint8_t newShift = 0;
+  if (newBits) {
+    while ((64u >> newShift) > newBits) {
+      newShift++;
+    }
+    out.resize(volume >> newShift, 0);
+    for (uint32_t i = 0; i < volume; i++) {
+      uint64_t v = indexBits ? readIndex(i) : 0;
+      if (!remap.empty()) {
+        v = remap[v];
+      }
+      uint32_t shift = (i & ((1u << newShift) - 1)) * newBits;
+      out[i >> newShift] |= v << shift;
+    }
+  }
+  data.swap(out);
+  indexBits = newBits;
+  wordShift = newShift;
+}
+
+void Chunk::fill(Block b) {
+  palette.assign(1, b);
+  counts.assign(1, volume);
+  freeSlots.clear();
+  lookup.reset();
+  data.clear();
+  data.shrink_to_fit();
+  indexBits = 0;
+  wordShift = 0;
+}
+
+void Chunk::compact() {
+  if (!indexBits) {
+    return;
+  }
+  std::vector<uint32_t> remap(palette.size(), 0);
+  std::vector<Block> newPalette;
+  std::vector<uint32_t> newCounts;
+  for (uint32_t p = 0; p < palette.size(); p++) {
+    if (counts[p]) {
+      remap[p] = newPalette.size();
+      newPalette.emplace_back(palette[p]);
+      newCounts.emplace_back(counts[p]);
+    }
+  }
+  if (newPalette.size() == 1) {
+    fill(newPalette[0]);
+    return;
+  }
+  uint8_t newBits = bitsFor(newPalette.size());
+  if (newBits != indexBits || newPalette.size() != palette.size()) {
+    repack(newBits, remap);
+  }
+  palette.swap(newPalette);
+  counts.swap(newCounts);
+  palette.shrink_to_fit();
+  counts.shrink_to_fit();
+  data.shrink_to_fit();
+  freeSlots.clear();
+  freeSlots.shrink_to_fit();
+  lookup.reset();
+  if (palette.size() > lookupAbove) {
+    lookup.reset(new std::unordered_map<Block, uint32_t>());
+    for (uint32_t p = 0; p < palette.size(); p++) {
+      lookup->emplace(palette[p], p);
+    }
+  }
+}
+
+size_t Chunk::memoryUsage() const {
+  size_t n = sizeof(*this) + palette.capacity() * sizeof(palette[0]) +
+             counts.capacity() * sizeof(counts[0]) +
+             freeSlots.capacity() * sizeof(freeSlots[0]) +
+             data.capacity() * sizeof(data[0]);
+  if (lookup) {
+    // Estimate one heap node per entry (key, value, next pointer, and the
+    // cached hash) plus the bucket array.
+    n += sizeof(*lookup) + lookup->size() * (sizeof(Block) + 2 * sizeof(void*) +
+                                             sizeof(uint32_t) + sizeof(size_t));
+    n += lookup->bucket_count() * sizeof(void*);
+  }
+  return n;
+}
+
+void Chunk::serialize(std::vector<uint64_t>& out) const {
+  // Word 0: version, indexBits, and the palette size. Then the palette and
+  // counts, packed into words. Then data.
+  const size_t n = palette.size();
+  out.emplace_back(serialVersion | ((uint64_t)indexBits << 8) |
+                   ((uint64_t)n << 16));
+  size_t at = out.size();
+  size_t bytes = n * (sizeof(palette[0]) + sizeof(counts[0]));
+  out.resize(at + (bytes + 7) / 8, 0);
+  char* p = (char*)&out[at];
+  memcpy(p, palette.data(), n * sizeof(palette[0]));
+  memcpy(p + n * sizeof(palette[0]), counts.data(), n * sizeof(counts[0]));
+  out.insert(out.end(), data.begin(), data.end());
+}
+
+int Chunk::deserialize(const uint64_t* words, size_t n) {
+  if (n < 1 || (words[0] & 0xff) != serialVersion) {
+    fprintf(stderr, "Chunk::deserialize: bad version\n");
+    return 1;
+  }
+  uint8_t newBits = (uint8_t)(words[0] >> 8);
+  size_t entries = (size_t)(words[0] >> 16);
+  uint8_t newShift = 0;
+  while (newBits && newShift < 6 && (64u >> newShift) > newBits) {
+    newShift++;
+  }
+  size_t paletteWords =
+      (entries * (sizeof(palette[0]) + sizeof(counts[0])) + 7) / 8;
+  size_t dataWords = newBits ? volume >> newShift : 0;
+  if ((newBits && (64u >> newShift) != newBits) || newBits > 16 ||
+      !entries || entries > ((size_t)1 << newBits) ||
+      n != 1 + paletteWords + dataWords) {
+    fprintf(stderr, "Chunk::deserialize: bad header %llx, %zu words\n",
+            (unsigned long long)words[0], n);
+    return 1;
+  }
+  std::vector<Block> newPalette(entries);
+  memcpy(newPalette.data(), &words[1], entries * sizeof(palette[0]));
+  // Recount the indices instead of trusting the counts in words: this also
+  // checks that every index is inside the palette, so getI() cannot read
+  // past it.
+  std::vector<uint32_t> newCounts(entries, 0);
+  const uint64_t* d = &words[1 + paletteWords];
+  if (!newBits) {
+    newCounts[0] = volume;
+  }
+  const uint64_t mask = newBits ? ((uint64_t)1 << newBits) - 1 : 0;
+  for (size_t w = 0; w < dataWords; w++) {
+    uint64_t word = d[w];
+    for (uint32_t k = 0; k < 64u / newBits; k++, word >>= newBits) {
+      size_t i = (size_t)(word & mask);
+      if (i >= entries) {
+        fprintf(stderr, "Chunk::deserialize: index %zu of %zu entries\n", i,
+                entries);
+        return 1;
+      }
+      newCounts[i]++;
+    }
+  }
+
+  palette.swap(newPalette);
+  counts.swap(newCounts);
+  data.assign(d, d + dataWords);
+  indexBits = newBits;
+  wordShift = newShift;
+  freeSlots.clear();
+  lookup.reset();
+  for (uint32_t q = 0; q < palette.size(); q++) {
+    if (!counts[q]) {
+      freeSlots.emplace_back(q);
+    }
+  }
+  if (palette.size() > lookupAbove) {
+    lookup.reset(new std::unordered_map<Block, uint32_t>());
+    for (uint32_t q = 0; q < palette.size(); q++) {
+      if (counts[q]) {
+        lookup->emplace(palette[q], q);
+      }
+    }
+  }
+  return 0;
+}
+
+}  // namespace voxel
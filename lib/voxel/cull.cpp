@@ -0,0 +1,415 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "cull.h"
+
+#include <string.h>
+#include <algorithm>
+#include "lib/voxel/cull.comp.h"
+#include "lib/voxel/hiz.comp.h"
+
+namespace voxel {
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// maxHizLevels is enough levels for a 65536 x 65536 depth buffer.
+constexpr uint32_t maxHizLevels = 16;
+
+// localSize is local_size_x in cull.comp. hizLocalSize is local_size_x and
+// local_size_y in hiz.comp.
+constexpr uint32_t localSize = 64;
+constexpr uint32_t hizLocalSize = 8;
+
+VkDescriptorSetLayoutBinding computeBinding(uint32_t binding,
+                                            VkDescriptorType type) {
+  VkDescriptorSetLayoutBinding VkInit(b);
+  b.binding = binding;
+  b.descriptorType = type;
+  b.descriptorCount = 1;
+  b.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  return b;
+}
+
+VkMemoryBarrier memoryBarrier(VkAccessFlags src, VkAccessFlags dst) {
+  VkMemoryBarrier VkInit(b);
+  b.srcAccessMask = src;
+  b.dstAccessMask = dst;
+  return b;
+}
+
+}  // anonymous namespace
+
+GpuCuller::GpuCuller(language::Device& dev)
+    : dev(dev),
+      chunks(dev),
+      params(dev),
+      draws(dev),
+      drawCount(dev),
+      hiz(dev),
+      hizAll(dev),
+      sampler{dev.dev, vkDestroySampler},
+      hizLayout(dev),
+      cullLayout(dev),
+      pool(dev),
+      hizPipe(dev),
+      cullPipe(dev) {
+  sampler.allocator = dev.dev.allocator;
+}
+
+GpuCuller::~GpuCuller() {}
+
+int GpuCuller::ctorError(size_t framesInFlight, uint32_t maxDraws,
+                         command::PipelineCache* cache) {
+  if (!framesInFlight || !maxDraws) {
+    fprintf(stderr, "GpuCuller::ctorError(%zu, %u): invalid\n", framesInFlight,
+            maxDraws);
+    return 1;
+  }
+  if (dev.enabledFeatures.multiDrawIndirect &&
+      maxDraws > dev.physProp.limits.maxDrawIndirectCount) {
+    fprintf(stderr, "GpuCuller::ctorError: maxDraws %u > %u\n", maxDraws,
+            dev.physProp.limits.maxDrawIndirectCount);
+    return 1;
+  }
+  this->maxDraws = maxDraws;
+  chunkCount.assign(framesInFlight, 0);
+
+  // chunks is written by the host and read as a STORAGE_BUFFER_DYNAMIC, so
+  // each slice starts on minStorageBufferOffsetAlignment.
+  VkDeviceSize align = dev.physProp.limits.minStorageBufferOffsetAlignment;
+  if (!align) {
+    align = 1;
+  }
+  chunkSlice = (maxDraws * sizeof(ChunkDraw) + align - 1) / align * align;
+  chunks.info.size = chunkSlice * framesInFlight;
+  chunks.info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  draws.info.size = maxDraws * sizeof(VkDrawIndexedIndirectCommand);
+  draws.info.usage =
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+  drawCount.info.size = sizeof(uint32_t);
+  drawCount.info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  if (chunks.ctorError(dev, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) ||
+      chunks.bindMemory(dev) ||
+      params.ctorError(dev, sizeof(Params), framesInFlight) ||
+      draws.ctorDeviceLocal(dev) || draws.bindMemory(dev) ||
+      drawCount.ctorDeviceLocal(dev) || drawCount.bindMemory(dev)) {
+    return 1;
+  }
+
+  // sampler reads one texel: the Hi-Z test takes the max of 4 texels itself.
+  VkSamplerCreateInfo VkInit(sci);
+  sci.magFilter = VK_FILTER_NEAREST;
+  sci.minFilter = VK_FILTER_NEAREST;
+  sci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sci.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sci.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sci.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sci.maxLod = (float)maxHizLevels;
+  sampler.reset();
+  VkResult v = vkCreateSampler(dev.dev, &sci, dev.dev.allocator, &sampler);
+  if (v != VK_SUCCESS) {
+    fprintf(stderr, "vkCreateSampler failed: %d (%s)\n", v,
+            string_VkResult(v));
+    return 1;
+  }
+
+  std::vector<VkDescriptorType> types;
+  for (uint32_t i = 0; i < maxHizLevels; i++) {
+    types.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    types.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  }
+  types.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC);
+  types.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  types.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  types.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  types.emplace_back(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+
+  hizPipe.shader = std::make_shared<command::Shader>(dev);
+  cullPipe.shader = std::make_shared<command::Shader>(dev);
+  if (hizLayout.ctorError(
+          dev,
+          {
+              computeBinding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER),
+              computeBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE),
+          }) ||
+      cullLayout.ctorError(
+          dev,
+          {
+              computeBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC),
+              computeBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER),
+              computeBinding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER),
+              computeBinding(3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER),
+              computeBinding(4, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC),
+          }) ||
+      pool.ctorError(maxHizLevels + 1, types) ||
+      hizPipe.shader->loadSPV(spv_hiz_comp, sizeof(spv_hiz_comp)) ||
+      cullPipe.shader->loadSPV(spv_cull_comp, sizeof(spv_cull_comp))) {
+    return 1;
+  }
+  hizPipe.setLayouts.emplace_back(hizLayout.vk);
+  cullPipe.setLayouts.emplace_back(cullLayout.vk);
+  if (hizPipe.ctorError(dev, cache) || cullPipe.ctorError(dev, cache)) {
+    return 1;
+  }
+  cullSet.reset(new memory::DescriptorSet(pool));
+  return cullSet->ctorError(cullLayout);
+}
+
+int GpuCuller::setDepth(VkImageView depth, VkImageLayout depthLayout,
+                        VkExtent2D extent) {
+  if (!cullSet) {
+    fprintf(stderr, "BUG: GpuCuller::setDepth before ctorError\n");
+    return 1;
+  }
+  if (!depth || !extent.width || !extent.height) {
+    fprintf(stderr, "GpuCuller::setDepth(%u x %u): invalid\n", extent.width,
+            extent.height);
+    return 1;
+  }
+  this->depth = depth;
+  this->depthLayout = depthLayout;
+  depthValid = false;
+
+  // Level 0 is half the depth buffer, so buildHiZ() reads every depth texel
+  // once and never writes a level as big as the depth buffer.
+  uint32_t w = std::max(1u, (extent.width + 1) / 2);
+  uint32_t h = std::max(1u, (extent.height + 1) / 2);
+  uint32_t levels = 1;
+  while ((std::max(w, h) >> levels) && levels < maxHizLevels) {
+    levels++;
+  }
+
+  hizSets.clear();
+  hizLevels.clear();
+  hiz.info.extent = {w, h, 1};
+  hiz.info.mipLevels = levels;
+  hiz.info.format = VK_FORMAT_R32_SFLOAT;
+  hiz.info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  hiz.info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  hiz.info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  if (hiz.ctorDeviceLocal(dev) || hiz.bindMemory(dev)) {
+    return 1;
+  }
+
+  hizAll.info.subresourceRange.levelCount = levels;
+  if (hizAll.ctorError(dev, hiz.vk, hiz.info.format)) {
+    return 1;
+  }
+  for (uint32_t i = 0; i < levels; i++) {
+    hizLevels.emplace_back(dev);
+    auto& view = hizLevels.back();
+    view.info.subresourceRange.baseMipLevel = i;
+    if (view.ctorError(dev, hiz.vk, hiz.info.format)) {
+      return 1;
+    }
+  }
+
+  // Level i reads level i - 1, or the depth buffer for level 0. All the
+  // levels are written with one vkUpdateDescriptorSets.
+  memory::DescriptorWriter writer(dev);
+  for (uint32_t i = 0; i < levels; i++) {
+    VkDescriptorImageInfo src;
+    src.sampler = sampler;
+    src.imageView = i ? hizLevels.at(i - 1).vk : depth;
+    src.imageLayout = i ? VK_IMAGE_LAYOUT_GENERAL : depthLayout;
+    VkDescriptorImageInfo dst;
+    dst.sampler = VK_NULL_HANDLE;
+    dst.imageView = hizLevels.at(i).vk;
+    dst.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    hizSets.emplace_back(new memory::DescriptorSet(pool));
+    auto& set = *hizSets.back();
+    if (set.ctorError(hizLayout) || writer.write(set, 0, {src}) ||
+        writer.write(set, 1, {dst})) {
+      return 1;
+    }
+  }
+  writer.flush();
+  return writeCullSet();
+}
+
+int GpuCuller::writeCullSet() {
+  VkDescriptorBufferInfo chunkInfo;
+  chunkInfo.buffer = chunks.vk;
+  chunkInfo.offset = 0;
+  chunkInfo.range = maxDraws * sizeof(ChunkDraw);
+  VkDescriptorImageInfo hizInfo;
+  hizInfo.sampler = sampler;
+  hizInfo.imageView = hizAll.vk;
+  hizInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+  return cullSet->write(0, {chunkInfo}) ||
+         cullSet->write(1, std::vector<memory::Buffer*>{&draws}) ||
+         cullSet->write(2, std::vector<memory::Buffer*>{&drawCount}) ||
+         cullSet->write(3, {hizInfo}) ||
+         cullSet->write(4, {params.toDescriptor()});
+}
+
+int GpuCuller::update(size_t i, const float viewProj[16],
+                      const std::vector<ChunkDraw>& chunkDraws) {
+  if (i >= chunkCount.size()) {
+    fprintf(stderr, "GpuCuller::update(%zu) with only %zu frames\n", i,
+            chunkCount.size());
+    return 1;
+  }
+  if (chunkDraws.size() > maxDraws) {
+    fprintf(stderr, "GpuCuller::update: %zu draws > maxDraws %u\n",
+            chunkDraws.size(), maxDraws);
+    return 1;
+  }
+  Params p;
+  memcpy(p.viewProj, viewProj, sizeof(p.viewProj));
+  Frustum f(viewProj);
+  memcpy(p.planes, f.plane, sizeof(p.planes));
+  p.hizSize[0] = hiz.info.extent.width;
+  p.hizSize[1] = hiz.info.extent.height;
+  p.chunkCount = chunkDraws.size();
+  p.useHiZ = occlusion && depthValid;
+  chunkCount.at(i) = chunkDraws.size();
+  if (params.select(i) || params.write(dev, p)) {
+    return 1;
+  }
+  if (chunkDraws.empty()) {
+    return 0;
+  }
+  return chunks.copyFromHost(dev, chunkDraws, i * chunkSlice);
+}
+
+int GpuCuller::buildHiZ(command::CommandBuilder& builder) {
+  if (hizSets.empty()) {
+    fprintf(stderr, "BUG: GpuCuller::buildHiZ before setDepth\n");
+    return 1;
+  }
+  command::CommandBuilder::BarrierSet bset;
+  if (hiz.currentLayout != VK_IMAGE_LAYOUT_GENERAL) {
+    // The first buildHiZ() after setDepth() moves every level to GENERAL.
+    VkImageMemoryBarrier VkInit(b);
+    b.srcAccessMask = 0;
+    b.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    b.oldLayout = hiz.currentLayout;
+    b.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    b.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    b.image = hiz.vk;
+    b.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    b.subresourceRange.levelCount = hiz.info.mipLevels;
+    b.subresourceRange.layerCount = 1;
+    bset.img.emplace_back(b);
+    hiz.currentLayout = VK_IMAGE_LAYOUT_GENERAL;
+  }
+  if (!depthValid) {
+    // There is no depth yet. cull() will not use hiz until the next frame.
+    return bset.img.empty()
+               ? 0
+               : builder.barrier(bset, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+  }
+
+  // Wait for the last cull() to stop reading hiz before overwriting it.
+  bset.mem.emplace_back(memoryBarrier(VK_ACCESS_SHADER_READ_BIT,
+                                      VK_ACCESS_SHADER_WRITE_BIT));
+  if (builder.barrier(bset, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT)) {
+    return 1;
+  }
+  bset.img.clear();
+  bset.mem.at(0) = memoryBarrier(VK_ACCESS_SHADER_WRITE_BIT,
+                                 VK_ACCESS_SHADER_READ_BIT);
+  for (size_t i = 0; i < hizSets.size(); i++) {
+    uint32_t w = std::max(1u, hiz.info.extent.width >> i);
+    uint32_t h = std::max(1u, hiz.info.extent.height >> i);
+    VkDescriptorSet set = hizSets.at(i)->vk;
+    if (builder.bindComputePipelineAndDescriptors(hizPipe, 0, 1, &set) ||
+        builder.dispatch((w + hizLocalSize - 1) / hizLocalSize,
+                         (h + hizLocalSize - 1) / hizLocalSize, 1) ||
+        // Level i must be written before level i + 1 (or cull) reads it.
+        builder.barrier(bset, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int GpuCuller::cull(command::CommandBuilder& builder, size_t i) {
+  if (hizSets.empty()) {
+    fprintf(stderr, "BUG: GpuCuller::cull before setDepth\n");
+    return 1;
+  }
+  if (i >= chunkCount.size()) {
+    fprintf(stderr, "GpuCuller::cull(%zu) with only %zu frames\n", i,
+            chunkCount.size());
+    return 1;
+  }
+  // Wait for the last draw() to read draws, then clear draws and drawCount.
+  // Entries cull.comp does not write keep instanceCount = 0, so draw() can
+  // draw all maxDraws and the culled ones cost nothing.
+  command::CommandBuilder::BarrierSet bset;
+  bset.mem.emplace_back(memoryBarrier(
+      VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT |
+          VK_ACCESS_SHADER_WRITE_BIT,
+      VK_ACCESS_TRANSFER_WRITE_BIT));
+  if (builder.barrier(bset,
+                      VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT) ||
+      builder.fillBuffer(draws.vk, 0, VK_WHOLE_SIZE, 0) ||
+      builder.fillBuffer(drawCount.vk, 0, VK_WHOLE_SIZE, 0)) {
+    return 1;
+  }
+  bset.mem.at(0) = memoryBarrier(
+      VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+  if (builder.barrier(bset, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT)) {
+    return 1;
+  }
+
+  if (chunkCount.at(i)) {
+    // Dynamic offsets are in binding order: chunks, then params.
+    uint32_t offsets[2] = {(uint32_t)(i * chunkSlice),
+                           params.dynamicOffset(i)};
+    VkDescriptorSet set = cullSet->vk;
+    if (builder.bindComputePipelineAndDescriptors(cullPipe, 0, 1, &set, 2,
+                                                  offsets) ||
+        builder.dispatch((chunkCount.at(i) + localSize - 1) / localSize, 1,
+                         1)) {
+      return 1;
+    }
+  }
+  bset.mem.at(0) = memoryBarrier(VK_ACCESS_SHADER_WRITE_BIT |
+                                     VK_ACCESS_TRANSFER_WRITE_BIT,
+                                 VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+  if (builder.barrier(bset,
+                      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT)) {
+    return 1;
+  }
+  // The depth buffer this frame renders is what the next buildHiZ() reads.
+  depthValid = true;
+  return 0;
+}
+
+int GpuCuller::draw(command::CommandBuilder& builder, size_t i) {
+  if (i >= chunkCount.size()) {
+    fprintf(stderr, "GpuCuller::draw(%zu) with only %zu frames\n", i,
+            chunkCount.size());
+    return 1;
+  }
+  // At most chunkCount draws were written. The rest of them have
+  // instanceCount = 0, so a chunk that was culled costs almost nothing.
+  const uint32_t n = chunkCount.at(i);
+  const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+  if (dev.enabledFeatures.multiDrawIndirect) {
+    return n ? builder.drawIndexedIndirect(draws.vk, 0, n, stride) : 0;
+  }
+  // Without multiDrawIndirect, drawCount must be 0 or 1. Recording n
+  // commands still never waits for the GPU.
+  for (uint32_t j = 0; j < n; j++) {
+    if (builder.drawIndexedIndirect(draws.vk, j * stride, 1, stride)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+}  // namespace voxel
@@ -0,0 +1,147 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * lib/voxel/cull.h culls chunks on the GPU. A compute shader tests every
+ * chunk against the view frustum and a Hi-Z (hierarchical depth) pyramid
+ * built from the previous frame's depth buffer, and writes the draws that
+ * pass into an indirect buffer. The CPU records one drawIndexedIndirect no
+ * matter how many chunks are visible, and never reads the result back.
+ *
+ * Like lib/voxel/stream.h it uses lib/memory, so it is a separate target:
+ * //lib/voxel:cull.
+ */
+
+#include <lib/command/command.h>
+#include <lib/memory/memory.h>
+#include <lib/voxel/stream.h>
+
+#pragma once
+
+namespace voxel {
+
+// ChunkDraw is one chunk for GpuCuller: its bounding box and where its
+// indices are. It matches struct ChunkDraw in cull.comp (std430).
+typedef struct ChunkDraw {
+  // lo and hi are the corners of the chunk's bounding box, in world space.
+  float lo[3];
+  uint32_t indexCount;
+  float hi[3];
+  uint32_t firstIndex;
+  int32_t vertexOffset;
+  // firstInstance is passed through to the draw, so the vertex shader can
+  // find per-chunk data with gl_InstanceIndex.
+  uint32_t firstInstance;
+  uint32_t pad[2];
+} ChunkDraw;
+static_assert(sizeof(ChunkDraw) == 48, "ChunkDraw must match cull.comp");
+
+// GpuCuller builds the Hi-Z pyramid, culls, and draws. All chunks are drawn
+// from one vertex buffer and one index buffer, which the caller binds before
+// draw(): each ChunkDraw says where its geometry is in them.
+//
+// The Hi-Z pyramid is built from the previous frame's depth, so a chunk that
+// was hidden and is suddenly uncovered by a fast camera move can be missing
+// for one frame. The first frame after setDepth() only uses the frustum.
+//
+// Example usage:
+//   voxel::GpuCuller culler(dev);
+//   if (culler.ctorError(dev.framebufs.size(), maxChunks, &pipelineCache) ||
+//       culler.setDepth(depthView, depthLayout, dev.swapChainExtent)) {
+//     ...
+//   }
+//   // Each frame, when the GPU is done with frame i:
+//   if (culler.update(i, &viewProj[0][0], chunks)) { ... }
+//   // Outside the render pass, after the depth buffer is readable:
+//   if (culler.buildHiZ(builder) || culler.cull(builder, i)) { ... }
+//   // Inside the render pass, with the pipeline and buffers bound:
+//   if (culler.draw(builder, i)) { ... }
+class GpuCuller {
+ public:
+  GpuCuller(language::Device& dev);
+  GpuCuller(GpuCuller&&) = delete;
+  GpuCuller(const GpuCuller&) = delete;
+  virtual ~GpuCuller();
+
+  // Two-stage constructor: check the return code of ctorError().
+  // framesInFlight is how many frames may be recorded before the GPU is done
+  // with the first, usually dev.framebufs.size(). maxDraws is the most
+  // chunks update() accepts. cache is optional.
+  WARN_UNUSED_RESULT int ctorError(size_t framesInFlight, uint32_t maxDraws,
+                                   command::PipelineCache* cache = nullptr);
+
+  // setDepth() (re)creates the Hi-Z pyramid for a depth buffer of the given
+  // extent. depth must have VK_IMAGE_USAGE_SAMPLED_BIT and only the depth
+  // aspect, and be in depthLayout when buildHiZ() runs. Call it again after
+  // the swapChain is resized, when the GPU is idle.
+  WARN_UNUSED_RESULT int setDepth(VkImageView depth, VkImageLayout depthLayout,
+                                  VkExtent2D extent);
+
+  // update() writes the chunks and viewProj for frame i. The GPU must be done
+  // with the last frame i. viewProj is column-major, as in voxel::Frustum.
+  WARN_UNUSED_RESULT int update(size_t i, const float viewProj[16],
+                                const std::vector<ChunkDraw>& draws);
+
+  // buildHiZ() records the Hi-Z pyramid build from the depth buffer. Call it
+  // outside a render pass, before cull(). The last frame's depth writes must
+  // be visible to VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, for example with a
+  // VkSubpassDependency to VK_SUBPASS_EXTERNAL.
+  WARN_UNUSED_RESULT int buildHiZ(command::CommandBuilder& builder);
+
+  // cull() records the cull for frame i. Call it outside a render pass.
+  WARN_UNUSED_RESULT int cull(command::CommandBuilder& builder, size_t i);
+
+  // draw() records the indirect draws for frame i. Call it inside a render
+  // pass after binding a graphics pipeline, the vertex buffer and the index
+  // buffer. If dev.enabledFeatures.multiDrawIndirect is set, it is a single
+  // vkCmdDrawIndexedIndirect.
+  WARN_UNUSED_RESULT int draw(command::CommandBuilder& builder, size_t i);
+
+  // occlusion turns the Hi-Z test on or off. The frustum test is always on.
+  bool occlusion{true};
+
+  language::Device& dev;
+
+ protected:
+  // Params matches the uniform block in cull.comp (std140).
+  typedef struct Params {
+    float viewProj[16];
+    float planes[6][4];
+    float hizSize[2];
+    uint32_t chunkCount;
+    uint32_t useHiZ;
+  } Params;
+
+  WARN_UNUSED_RESULT int writeCullSet();
+
+  uint32_t maxDraws{0};
+  std::vector<uint32_t> chunkCount;
+  // chunks holds framesInFlight slices of maxDraws ChunkDraws each.
+  memory::Buffer chunks;
+  VkDeviceSize chunkSlice{0};
+  memory::UniformRing params;
+  // draws is the VkDrawIndexedIndirectCommand array cull.comp writes.
+  memory::Buffer draws;
+  // drawCount is the atomic counter cull.comp uses to compact draws.
+  memory::Buffer drawCount;
+
+  memory::Image hiz;
+  std::vector<language::ImageView> hizLevels;
+  language::ImageView hizAll;
+  VkPtr<VkSampler> sampler;
+  VkImageView depth{VK_NULL_HANDLE};
+  VkImageLayout depthLayout{VK_IMAGE_LAYOUT_UNDEFINED};
+  // depthValid means a frame was culled since setDepth(), so the depth
+  // buffer holds something buildHiZ() can use.
+  bool depthValid{false};
+
+  memory::DescriptorSetLayout hizLayout;
+  memory::DescriptorSetLayout cullLayout;
+  memory::DescriptorPool pool;
+  // hizSets has one DescriptorSet per level of hiz. It must be destroyed
+  // before pool.
+  std::vector<std::unique_ptr<memory::DescriptorSet>> hizSets;
+  std::unique_ptr<memory::DescriptorSet> cullSet;
+  command::ComputePipeline hizPipe;
+  command::ComputePipeline cullPipe;
+};
+
+}  // namespace voxel
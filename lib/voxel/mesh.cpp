@@ -0,0 +1,243 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "mesh.h"
+
+#include <stddef.h>
+#include <algorithm>
+
+namespace voxel {
+
+constexpr uint32_t Mesher::padded;
+
+std::vector<VkVertexInputAttributeDescription> MeshVertex::getAttributes() {
+  std::vector<VkVertexInputAttributeDescription> attributes(3);
+  attributes.at(0).binding = 0;
+  attributes.at(0).location = 0;
+  attributes.at(0).format = VK_FORMAT_R8G8B8A8_UINT;
+  attributes.at(0).offset = offsetof(MeshVertex, x);
+
+  attributes.at(1).binding = 0;
+  attributes.at(1).location = 1;
+  attributes.at(1).format = VK_FORMAT_R16_UINT;
+  attributes.at(1).offset = offsetof(MeshVertex, block);
+
+  attributes.at(2).binding = 0;
+  attributes.at(2).location = 2;
+  attributes.at(2).format = VK_FORMAT_R8G8_UINT;
+  attributes.at(2).offset = offsetof(MeshVertex, u);
+  return attributes;
+}
+
+Mesher::Mesher()
+    : simd(bestSimdPath()),
+      vox(padded * padded * padded, air),
+      solid(padded * padded),
+      faces(6 * Chunk::size * Chunk::size),
+      mask(Chunk::size * Chunk::size) {}
+
+bool Mesher::load(const World& world, const ChunkPos& pos) {
+  const Chunk* c = world.find(pos);
+  if (!c || (c->isUniform() && c->get(0, 0, 0) == air)) {
+    return false;
+  }
+  const uint32_t n = Chunk::size;
+  std::fill(vox.begin(), vox.end(), air);
+  if (c->isUniform()) {
+    Block b = c->get(0, 0, 0);
+    for (uint32_t y = 0; y < n; y++) {
+      for (uint32_t z = 0; z < n; z++) {
+        auto row = vox.begin() + paddedIndex(1, y + 1, z + 1);
+        std::fill(row, row + n, b);
+      }
+    }
+  } else {
+    // Chunk::indexOf() and paddedIndex() both have x fastest, then z, y.
+    uint32_t i = 0;
+    for (uint32_t y = 0; y < n; y++) {
+      for (uint32_t z = 0; z < n; z++) {
+        Block* row = &vox[paddedIndex(1, y + 1, z + 1)];
+        for (uint32_t x = 0; x < n; x++, i++) {
+          row[x] = c->getI(i);
+        }
+      }
+    }
+  }
+
+  // Copy the layer of each neighbor that touches this chunk.
+  bool allSolid = true;
+  for (int d = 0; d < 3; d++) {
+    for (int side = 0; side < 2; side++) {
+      ChunkPos np = pos;
+      int32_t* npAxis = d == 0 ? &np.x : (d == 1 ? &np.y : &np.z);
+      *npAxis += side ? 1 : -1;
+      const Chunk* nc = world.find(np);
+      if (!nc) {
+        allSolid = false;
+        continue;
+      }
+      // src is the coordinate inside nc, dst is the coordinate in vox.
+      uint32_t src = side ? 0 : n - 1;
+      uint32_t dst = side ? n + 1 : 0;
+      for (uint32_t j = 0; j < n; j++) {
+        for (uint32_t i = 0; i < n; i++) {
+          uint32_t s[3], t[3];
+          s[d] = src;
+          t[d] = dst;
+          s[(d + 1) % 3] = i;
+          t[(d + 1) % 3] = i + 1;
+          s[(d + 2) % 3] = j;
+          t[(d + 2) % 3] = j + 1;
+          Block b = nc->get(s[0], s[1], s[2]);
+          vox[paddedIndex(t[0], t[1], t[2])] = b;
+          allSolid &= b != air;
+        }
+      }
+    }
+  }
+  // A solid chunk surrounded by solid neighbors has no visible faces.
+  return !(c->isUniform() && allSolid);
+}
+
+bool Mesher::addFaces(int face, uint32_t layer) {
+  const uint32_t n = Chunk::size;
+  const uint32_t* words = &faces[face * n * n];
+  const bool neg = face & 1;
+  bool any = false;
+  // mask[j * n + i] is at u = i, v = j. See sweep().
+  switch (face / 2) {
+    case 0:  // u = y, v = z: test bit layer of every word.
+      for (uint32_t y = 0; y < n; y++) {
+        for (uint32_t z = 0; z < n; z++) {
+          if (!((words[y * n + z] >> layer) & 1)) {
+            continue;
+          }
+          int32_t b = vox[paddedIndex(layer + 1, y + 1, z + 1)];
+          mask[z * n + y] = neg ? -b : b;
+          any = true;
+        }
+      }
+      break;
+    case 1:  // u = z, v = x: the words of y = layer.
+      for (uint32_t z = 0; z < n; z++) {
+        for (uint32_t w = words[layer * n + z]; w; w &= w - 1) {
+          uint32_t x = __builtin_ctz(w);
+          int32_t b = vox[paddedIndex(x + 1, layer + 1, z + 1)];
+          mask[x * n + z] = neg ? -b : b;
+          any = true;
+        }
+      }
+      break;
+    case 2:  // u = x, v = y: the words of z = layer.
+      for (uint32_t y = 0; y < n; y++) {
+        for (uint32_t w = words[y * n + layer]; w; w &= w - 1) {
+          uint32_t x = __builtin_ctz(w);
+          int32_t b = vox[paddedIndex(x + 1, y + 1, layer + 1)];
+          mask[y * n + x] = neg ? -b : b;
+          any = true;
+        }
+      }
+      break;
+  }
+  return any;
+}
+
+void Mesher::sweep(int d, Mesh& out) {
+  const uint32_t n = Chunk::size;
+  const int u = (d + 1) % 3;
+  const int v = (d + 2) % 3;
+
+  for (uint32_t s = 0; s <= n; s++) {
+    // Build the mask for the plane between voxel s - 1 and voxel s. Only
+    // faces of voxels inside this chunk are emitted, so a face on the chunk
+    // border is emitted by exactly one chunk. A +d face and a -d face never
+    // share a cell: one needs voxel s - 1 solid and s air, the other the
+    // opposite.
+    std::fill(mask.begin(), mask.end(), 0);
+    bool any = false;
+    if (s > 0) {
+      any |= addFaces(d * 2, s - 1);
+    }
+    if (s < n) {
+      any |= addFaces(d * 2 + 1, s);
+    }
+    if (!any) {
+      continue;
+    }
+
+    // Greedy merge: grow each quad along u, then along v.
+    for (uint32_t j = 0; j < n; j++) {
+      for (uint32_t i = 0; i < n;) {
+        int32_t m = mask[j * n + i];
+        if (!m) {
+          i++;
+          continue;
+        }
+        uint32_t w = 1;
+        while (i + w < n && mask[j * n + i + w] == m) {
+          w++;
+        }
+        uint32_t h = 1;
+        for (; j + h < n; h++) {
+          uint32_t k = 0;
+          while (k < w && mask[(j + h) * n + i + k] == m) {
+            k++;
+          }
+          if (k < w) {
+            break;
+          }
+        }
+        for (uint32_t y = 0; y < h; y++) {
+          std::fill_n(&mask[(j + y) * n + i], w, 0);
+        }
+
+        // Emit the quad. u x v points along +d, so p0, p1, p2 is
+        // counter-clockwise seen from +d.
+        bool neg = m < 0;
+        MeshVertex vert;
+        vert.face = d * 2 + (neg ? 1 : 0);
+        vert.block = neg ? -m : m;
+        uint32_t first = out.vertices.size();
+        const uint32_t cu[4] = {0, w, w, 0};
+        const uint32_t cv[4] = {0, 0, h, h};
+        for (int c = 0; c < 4; c++) {
+          uint32_t p[3];
+          p[d] = s;
+          p[u] = i + cu[c];
+          p[v] = j + cv[c];
+          vert.x = p[0];
+          vert.y = p[1];
+          vert.z = p[2];
+          vert.u = cu[c];
+          vert.v = cv[c];
+          out.vertices.emplace_back(vert);
+        }
+        static const uint32_t pos[6] = {0, 1, 2, 2, 3, 0};
+        static const uint32_t neg6[6] = {0, 3, 2, 2, 1, 0};
+        const uint32_t* order = neg ? neg6 : pos;
+        for (int k = 0; k < 6; k++) {
+          out.indices.emplace_back(first + order[k]);
+        }
+        i += w;
+      }
+    }
+  }
+}
+
+void Mesher::mesh(const World& world, const ChunkPos& pos, Mesh& out) {
+  out.clear();
+  if (!load(world, pos)) {
+    return;
+  }
+  if (!occupancy(simd, vox.data(), solid.data()) ||
+      !faceVisibility(simd, solid.data(), faces.data())) {
+    // simd is not supported by this build. Use the scalar path.
+    simd = SIMD_SCALAR;
+    occupancy(simd, vox.data(), solid.data());
+    faceVisibility(simd, solid.data(), faces.data());
+  }
+  for (int d = 0; d < 3; d++) {
+    sweep(d, out);
+  }
+}
+
+}  // namespace voxel
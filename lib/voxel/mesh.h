@@ -0,0 +1,129 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * lib/voxel/mesh.h turns voxel chunks into vertex and index buffers.
+ */
+
+#include <lib/voxel/voxel.h>
+#include <vulkan/vulkan.h>
+
+#pragma once
+
+namespace voxel {
+
+// MeshVertex is one corner of a quad. It is 8 bytes. x, y, and z are
+// relative to the Chunk origin, 0 - Chunk::size inclusive. Upload it to a
+// memory::Buffer and pass getAttributes() to PipeBuilder::addVertexInput:
+//   pipe0->addVertexInput<voxel::MeshVertex>(
+//       voxel::MeshVertex::getAttributes())
+typedef struct MeshVertex {
+  uint8_t x, y, z;
+  // face is the direction the quad faces: 0 = +x, 1 = -x, 2 = +y, 3 = -y,
+  // 4 = +z, 5 = -z.
+  uint8_t face;
+  Block block;
+  // u and v count blocks across the quad, so a texture can repeat once per
+  // block after greedy merging.
+  uint8_t u, v;
+
+  // getAttributes returns the shader inputs:
+  // location 0: uvec4 (x, y, z, face)
+  // location 1: uint block
+  // location 2: uvec2 (u, v)
+  static std::vector<VkVertexInputAttributeDescription> getAttributes();
+} MeshVertex;
+
+// Mesh is the output of Mesher. Draw it with CommandBuilder::bindAndDraw()
+// and a VK_INDEX_TYPE_UINT32 index buffer.
+typedef struct Mesh {
+  void clear() {
+    vertices.clear();
+    indices.clear();
+  }
+  size_t quads() const { return vertices.size() / 4; }
+
+  std::vector<MeshVertex> vertices;
+  std::vector<uint32_t> indices;
+} Mesh;
+
+// SimdPath selects the implementation of the face visibility kernel. All
+// paths produce identical output.
+enum SimdPath {
+  SIMD_SCALAR = 0,
+  SIMD_SSE2 = 1,
+  SIMD_AVX2 = 2,
+};
+
+// bestSimdPath returns the fastest SimdPath this CPU supports.
+SimdPath bestSimdPath();
+
+// simdPathName returns a printable name for path.
+const char* simdPathName(SimdPath path);
+
+// occupancy sets bit x of solid[y * Mesher::padded + z] if vox (a
+// Mesher::padded^3 array, x fastest, then z, then y) is not air at x, y, z.
+// It returns false if path is not supported by this build.
+bool occupancy(SimdPath path, const Block* vox, uint64_t* solid);
+
+// faceVisibility computes the exposed faces of each voxel inside the chunk
+// from the occupancy words. Bit x of faces[face * 1024 + y * 32 + z] is set
+// if voxel x, y, z is solid and its neighbor in direction face is air. face
+// is numbered like MeshVertex::face.
+// It returns false if path is not supported by this build.
+bool faceVisibility(SimdPath path, const uint64_t* solid, uint32_t* faces);
+
+// Mesher builds a Mesh for one Chunk at a time. It culls faces between two
+// solid voxels (any Block that is not air), including across the chunk
+// border, and merges coplanar faces of the same Block into larger quads
+// with greedy meshing, one axis slice at a time.
+//
+// Mesher keeps its scratch buffers between calls. Use one Mesher per
+// thread.
+//
+// Front faces are counter-clockwise seen from outside the solid voxel.
+//
+// Face culling does not test one voxel at a time. Each row of voxels along
+// x is one occupancy word, and the exposed faces of a whole row come from a
+// few shifts, ANDs and NOTs. simd selects SSE2 or AVX2 to do several rows
+// at once.
+class Mesher {
+ public:
+  Mesher();
+  Mesher(Mesher&&) = default;
+  Mesher(const Mesher&) = delete;
+
+  // mesh replaces out with the Mesh of the Chunk at pos. A missing Chunk
+  // produces an empty Mesh.
+  void mesh(const World& world, const ChunkPos& pos, Mesh& out);
+
+  // padded is Chunk::size + 2: the chunk plus one voxel of each neighbor.
+  static constexpr uint32_t padded = Chunk::size + 2;
+
+  // simd defaults to bestSimdPath().
+  SimdPath simd;
+
+ protected:
+  // load copies the chunk and the facing layer of its 6 neighbors into vox.
+  // Returns false if the chunk cannot produce any faces.
+  bool load(const World& world, const ChunkPos& pos);
+  // sweep builds the mask for each slice along axis d from faces, and
+  // merges it into quads.
+  void sweep(int d, Mesh& out);
+  // addFaces writes the faces of direction face in one layer to mask.
+  bool addFaces(int face, uint32_t layer);
+
+  static uint32_t paddedIndex(uint32_t x, uint32_t y, uint32_t z) {
+    return (y * padded + z) * padded + x;
+  }
+
+  // vox holds padded^3 voxels. Index it with paddedIndex(x + 1, ...).
+  std::vector<Block> vox;
+  // solid holds padded^2 occupancy words (see occupancy()).
+  std::vector<uint64_t> solid;
+  // faces holds 6 * Chunk::size^2 face words (see faceVisibility()).
+  std::vector<uint32_t> faces;
+  // mask is one slice: > 0 is a +d face of Block mask, < 0 is a -d face of
+  // Block -mask, 0 is no face.
+  std::vector<int32_t> mask;
+};
+
+}  // namespace voxel
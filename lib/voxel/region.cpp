@@ -0,0 +1,396 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "region.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace voxel {
+
+// C++14 needs a definition of static constexpr members that are odr-used.
+constexpr int Region::bits;
+constexpr int32_t Region::size;
+constexpr size_t Region::count;
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+const char magic[8] = {'v', '0', 'l', 'u', 'm', '3', 'r', 0};
+constexpr uint32_t version = 1;
+
+typedef struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+} Header;
+static_assert(sizeof(Header) == 16, "Header must match the file");
+
+// tableAt is where the table starts in the file. payloadsAt is where the
+// first payload goes. Every payload starts on a multiple of 8 bytes, so
+// load() can read it from the mapping as uint64_t.
+constexpr uint64_t tableAt = sizeof(Header);
+constexpr uint64_t entryBytes = 16;
+constexpr uint64_t payloadsAt = tableAt + Region::count * entryBytes;
+
+// garbageMin is the least garbage worth a compact().
+constexpr uint64_t garbageMin = 64 * 1024;
+
+// The payload is compressed with a run-length encoding of uint64_t words:
+// chunks are mostly air, and their palette indices repeat a lot. Each token
+// is a word with bit 63 set for a run and the number of words in the low
+// bits. A run token is followed by the word to repeat. A literal token is
+// followed by that many words.
+constexpr uint64_t runBit = 1ull << 63;
+
+void compress(const std::vector<uint64_t>& in, std::vector<uint64_t>& out) {
+  out.clear();
+  size_t literal = 0;  // Index in out of the current literal token, or 0.
+  bool inLiteral = false;
+  for (size_t i = 0; i < in.size();) {
+    size_t run = 1;
+    while (i + run < in.size() && in[i + run] == in[i]) {
+      run++;
+    }
+    if (run >= 3) {
+      out.emplace_back(runBit | run);
+      out.emplace_back(in[i]);
+      inLiteral = false;
+      i += run;
+      continue;
+    }
+    if (!inLiteral) {
+      literal = out.size();
+      out.emplace_back(0);
+      inLiteral = true;
+    }
+    for (size_t j = 0; j < run; j++) {
+      out.emplace_back(in[i + j]);
+    }
+    out[literal] += run;
+    i += run;
+  }
+}
+
+int decompress(const uint64_t* in, size_t n, std::vector<uint64_t>& out,
+               size_t rawWords) {
+  out.clear();
+  if (rawWords > Chunk::maxSerialWords) {
+    return 1;
+  }
+  out.reserve(rawWords);
+  for (size_t i = 0; i < n;) {
+    uint64_t len = in[i] & ~runBit;
+    if (in[i] & runBit) {
+      if (i + 1 >= n || out.size() + len > rawWords) {
+        return 1;
+      }
+      out.insert(out.end(), len, in[i + 1]);
+      i += 2;
+      continue;
+    }
+    if (i + 1 + len > n || out.size() + len > rawWords) {
+      return 1;
+    }
+    out.insert(out.end(), &in[i + 1], &in[i + 1 + len]);
+    i += 1 + len;
+  }
+  return out.size() != rawWords;
+}
+
+int writeAll(int fd, const void* buf, size_t len, uint64_t offset,
+             const std::string& filename) {
+  const char* p = (const char*)buf;
+  while (len) {
+    ssize_t r = pwrite(fd, p, len, offset);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Region: pwrite(%s) failed: %d %s\n", filename.c_str(),
+              errno, strerror(errno));
+      return 1;
+    }
+    p += r;
+    len -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+}  // anonymous namespace
+
+Region::~Region() {
+  if (close()) {
+    fprintf(stderr, "~Region: close failed\n");
+  }
+}
+
+int Region::close() {
+  int r = map.close();
+  if (fd >= 0 && ::close(fd) < 0) {
+    fprintf(stderr, "Region: close(%s) failed: %d %s\n", filename.c_str(),
+            errno, strerror(errno));
+    r = 1;
+  }
+  fd = -1;
+  return r;
+}
+
+int Region::open(const char* filename, bool create) {
+  if (close()) {
+    return 1;
+  }
+  this->filename = filename;
+  fd = ::open(filename, O_RDWR | (create ? O_CREAT : 0), 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Region: open(%s) failed: %d %s\n", filename, errno,
+            strerror(errno));
+    return 1;
+  }
+  if (map.map(fd, filename)) {
+    return 1;
+  }
+  static_assert(sizeof(Entry) == entryBytes, "Entry must match the file");
+  table.assign(count, Entry{0, 0, 0});
+  if (!map.size) {
+    // A new file. Write the header and an empty table.
+    Header h;
+    memcpy(h.magic, magic, sizeof(h.magic));
+    h.version = version;
+    h.count = count;
+    std::vector<char> empty(payloadsAt, 0);
+    memcpy(empty.data(), &h, sizeof(h));
+    if (writeAll(fd, empty.data(), empty.size(), 0, this->filename) ||
+        map.map(fd, filename)) {
+      return 1;
+    }
+    fileBytes = liveBytes = payloadsAt;
+    return 0;
+  }
+
+  const Header* h = (const Header*)map.data;
+  if (map.size < payloadsAt || memcmp(h->magic, magic, sizeof(magic)) ||
+      h->version != version || h->count != count) {
+    fprintf(stderr, "Region: %s is not a region file\n", filename);
+    return 1;
+  }
+  memcpy(table.data(), map.data + tableAt, count * entryBytes);
+  fileBytes = map.size;
+  liveBytes = payloadsAt;
+  for (auto& e : table) {
+    if (!e.words) {
+      continue;
+    }
+    if (e.offset < payloadsAt || e.offset % 8 || e.offset > fileBytes ||
+        e.offset + e.words * 8ull > fileBytes) {
+      fprintf(stderr, "Region: %s table entry %zu is invalid\n", filename,
+              &e - table.data());
+      return 1;
+    }
+    liveBytes += e.words * 8ull;
+  }
+  return 0;
+}
+
+int Region::load(const ChunkPos& pos, Chunk& c) {
+  const Entry& e = table.at(indexOf(pos));
+  if (!e.words) {
+    fprintf(stderr, "BUG: Region::load(%d, %d, %d) not in %s\n", pos.x, pos.y,
+            pos.z, filename.c_str());
+    return 1;
+  }
+  if (e.offset + e.words * 8ull > map.size) {
+    // save() appended e after map was created.
+    if (map.map(fd, filename.c_str())) {
+      return 1;
+    }
+    if (e.offset + e.words * 8ull > map.size) {
+      fprintf(stderr, "Region: %s chunk (%d, %d, %d) is past the end\n",
+              filename.c_str(), pos.x, pos.y, pos.z);
+      return 1;
+    }
+  }
+  const uint64_t* p = (const uint64_t*)(map.data + e.offset);
+  if (decompress(p, e.words, raw, e.rawWords) ||
+      c.deserialize(raw.data(), raw.size())) {
+    fprintf(stderr, "Region: %s chunk (%d, %d, %d) is corrupt\n",
+            filename.c_str(), pos.x, pos.y, pos.z);
+    return 1;
+  }
+  return 0;
+}
+
+int Region::writeEntry(size_t i, const Entry& e) {
+  return writeAll(fd, &e, entryBytes, tableAt + i * entryBytes, filename);
+}
+
+int Region::save(const ChunkPos& pos, const Chunk& c) {
+  raw.clear();
+  c.serialize(raw);
+  compress(raw, packed);
+  // Write and sync the payload before the table entry that points to it.
+  // table is only updated once both are written, so a failed write leaves
+  // the old Chunk in place.
+  size_t i = indexOf(pos);
+  Entry e;
+  e.offset = fileBytes;
+  e.words = packed.size();
+  e.rawWords = raw.size();
+  if (writeAll(fd, packed.data(), packed.size() * 8, e.offset, filename)) {
+    return 1;
+  }
+  if (fsync(fd) < 0) {
+    fprintf(stderr, "Region: fsync(%s) failed: %d %s\n", filename.c_str(),
+            errno, strerror(errno));
+    return 1;
+  }
+  if (writeEntry(i, e)) {
+    return 1;
+  }
+  liveBytes -= table.at(i).words * 8ull;
+  table.at(i) = e;
+  fileBytes += e.words * 8ull;
+  liveBytes += e.words * 8ull;
+  return 0;
+}
+
+int Region::remove(const ChunkPos& pos) {
+  size_t i = indexOf(pos);
+  Entry& e = table.at(i);
+  if (!e.words) {
+    return 0;
+  }
+  if (writeEntry(i, Entry{0, 0, 0})) {
+    return 1;
+  }
+  liveBytes -= e.words * 8ull;
+  e = Entry{0, 0, 0};
+  return 0;
+}
+
+bool Region::needsCompact() const {
+  uint64_t garbage = fileBytes - liveBytes;
+  return garbage >= garbageMin && garbage >= liveBytes;
+}
+
+int Region::compact() {
+  if (map.size < fileBytes && map.map(fd, filename.c_str())) {
+    return 1;
+  }
+  // Build the new file in memory: region files are at most a few MiB.
+  std::vector<Entry> newTable(table);
+  std::vector<char> out(payloadsAt, 0);
+  memcpy(out.data(), map.data, tableAt);
+  for (auto& e : newTable) {
+    if (!e.words) {
+      continue;
+    }
+    const char* p = map.data + e.offset;
+    e.offset = out.size();
+    out.insert(out.end(), p, p + e.words * 8ull);
+  }
+  memcpy(&out[tableAt], newTable.data(), count * entryBytes);
+
+  std::string tmp = filename + ".tmp";
+  int tmpfd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (tmpfd < 0) {
+    fprintf(stderr, "Region: open(%s) failed: %d %s\n", tmp.c_str(), errno,
+            strerror(errno));
+    return 1;
+  }
+  if (writeAll(tmpfd, out.data(), out.size(), 0, tmp) || fsync(tmpfd) < 0 ||
+      rename(tmp.c_str(), filename.c_str()) < 0) {
+    fprintf(stderr, "Region::compact(%s) failed: %d %s\n", filename.c_str(),
+            errno, strerror(errno));
+    ::close(tmpfd);
+    unlink(tmp.c_str());
+    return 1;
+  }
+  // Switch to the new file.
+  std::string name = filename;
+  if (close()) {
+    ::close(tmpfd);
+    return 1;
+  }
+  fd = tmpfd;
+  filename = name;
+  table.swap(newTable);
+  fileBytes = liveBytes = out.size();
+  return map.map(fd, filename.c_str());
+}
+
+Region* RegionStore::regionOf(const ChunkPos& pos, bool create, int* err) {
+  *err = 0;
+  ChunkPos rpos = Region::posOf(pos);
+  auto i = regions.find(rpos);
+  if (i != regions.end()) {
+    return i->second.get();
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "/r.%d.%d.%d.v0r", rpos.x, rpos.y, rpos.z);
+  std::string filename = dir + name;
+  if (!create && access(filename.c_str(), F_OK) < 0) {
+    return nullptr;  // Nothing has been saved in this region.
+  }
+  std::unique_ptr<Region> r(new Region());
+  if (r->open(filename.c_str(), create)) {
+    *err = 1;
+    return nullptr;
+  }
+  Region* result = r.get();
+  regions.emplace(rpos, std::move(r));
+  return result;
+}
+
+int RegionStore::load(World& world, const ChunkPos& pos) {
+  int err;
+  Region* r = regionOf(pos, false /*create*/, &err);
+  if (!r || !r->has(pos)) {
+    return err;
+  }
+  std::unique_ptr<Chunk> c(new Chunk());
+  if (r->load(pos, *c)) {
+    return 1;
+  }
+  world.chunks[pos] = std::move(c);
+  return 0;
+}
+
+int RegionStore::save(const World& world, const ChunkPos& pos) {
+  const Chunk* c = world.find(pos);
+  int err;
+  Region* r = regionOf(pos, c != nullptr /*create*/, &err);
+  if (!r) {
+    return err;
+  }
+  if (c ? r->save(pos, *c) : r->remove(pos)) {
+    return 1;
+  }
+  return r->needsCompact() ? r->compact() : 0;
+}
+
+int RegionStore::saveAll(const World& world) {
+  for (auto& c : world.chunks) {
+    int err;
+    Region* r = regionOf(c.first, true /*create*/, &err);
+    if (!r || r->save(c.first, *c.second)) {
+      return 1;
+    }
+  }
+  return compact();
+}
+
+int RegionStore::compact() {
+  for (auto& r : regions) {
+    if (r.second->needsCompact() && r.second->compact()) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+}  // namespace voxel
@@ -0,0 +1,154 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * lib/voxel/region.h saves a World to disk and loads it back.
+ *
+ * The World is split into regions of 8^3 chunks, one file per region. A
+ * region file is:
+ *   Header: magic, version, and the number of table entries.
+ *   Table: for each Chunk, the offset and size of its payload (or 0).
+ *   Payloads: one compressed Chunk::serialize() per Chunk.
+ *
+ * The file is opened with mmap(), so opening a region only reads the
+ * table. A Chunk's payload is read and decompressed the first time it is
+ * loaded. The payload is the Chunk's palette and bit-packed indices, so
+ * loading a Chunk is a decompress, a memcpy and a bounds check of each
+ * index, not a parse.
+ *
+ * Saving a Chunk appends a new payload to the end of the file, syncs it to
+ * disk and then updates its table entry, so a crash never leaves a
+ * half-written Chunk in the table. The old payload becomes garbage. When
+ * there is as much garbage as live data, compact() rewrites the file.
+ */
+
+#include <lib/file/file.h>
+#include <lib/voxel/voxel.h>
+#include <string>
+
+#pragma once
+
+namespace voxel {
+
+// Region is one region file. Chunk positions passed to Region are the
+// global ChunkPos, which must be inside the region.
+class Region {
+ public:
+  // bits is log2 of the region size in chunks.
+  static constexpr int bits = 3;
+  static constexpr int32_t size = 1 << bits;
+  static constexpr size_t count = size * size * size;
+
+  Region() = default;
+  Region(Region&&) = delete;
+  Region(const Region&) = delete;
+  virtual ~Region();
+
+  // posOf returns the region that contains the Chunk at pos.
+  static ChunkPos posOf(const ChunkPos& pos) {
+    return ChunkPos{pos.x >> bits, pos.y >> bits, pos.z >> bits};
+  }
+
+  // open() opens filename. If it does not exist and create is true, an
+  // empty region is created. Otherwise open() fails.
+  WARN_UNUSED_RESULT int open(const char* filename, bool create);
+
+  // has returns true if the region has a saved Chunk at pos.
+  bool has(const ChunkPos& pos) const { return table.at(indexOf(pos)).words; }
+
+  // load() replaces c with the saved Chunk at pos. It fails if !has(pos).
+  WARN_UNUSED_RESULT int load(const ChunkPos& pos, Chunk& c);
+
+  // save() writes c as the Chunk at pos.
+  WARN_UNUSED_RESULT int save(const ChunkPos& pos, const Chunk& c);
+
+  // remove() removes the Chunk at pos, if any.
+  WARN_UNUSED_RESULT int remove(const ChunkPos& pos);
+
+  // needsCompact returns true if compact() would shrink the file by at
+  // least half.
+  bool needsCompact() const;
+
+  // compact() rewrites the file without garbage. It writes a new file and
+  // renames it over the old one.
+  WARN_UNUSED_RESULT int compact();
+
+  // liveBytes is the size of the header, table, and live payloads.
+  uint64_t liveBytes{0};
+  // fileBytes is the size of the file.
+  uint64_t fileBytes{0};
+  std::string filename;
+
+ protected:
+  typedef struct Entry {
+    // offset is where the payload starts in the file.
+    uint64_t offset;
+    // words is the compressed size of the payload in uint64_t. If words is
+    // 0, there is no Chunk.
+    uint32_t words;
+    // rawWords is the size of the payload after decompression.
+    uint32_t rawWords;
+  } Entry;
+
+  // indexOf returns the table index of the Chunk at pos.
+  static size_t indexOf(const ChunkPos& pos) {
+    const int32_t m = size - 1;
+    return ((pos.y & m) << (2 * bits)) | ((pos.z & m) << bits) | (pos.x & m);
+  }
+
+  // writeEntry() writes e to table entry i in the file. It does not change
+  // table.
+  WARN_UNUSED_RESULT int writeEntry(size_t i, const Entry& e);
+  WARN_UNUSED_RESULT int close();
+
+  int fd{-1};
+  // map is all of the file, mapped read-only. load() maps it again if a
+  // payload is past the end of map.
+  file::MappedFile map;
+  // table is a copy of the table in the file.
+  std::vector<Entry> table;
+  // raw and packed are scratch space for load() and save().
+  std::vector<uint64_t> raw;
+  std::vector<uint64_t> packed;
+};
+
+// RegionStore is a directory of region files for one World.
+//
+// Example usage:
+//   voxel::RegionStore store("saves/world1");
+//   // Load chunks as the camera moves.
+//   if (store.load(world, pos)) { ... }
+//   // Save every chunk before exiting.
+//   if (store.saveAll(world)) { ... }
+class RegionStore {
+ public:
+  // dir must exist.
+  RegionStore(const std::string& dir) : dir(dir) {}
+  RegionStore(RegionStore&&) = default;
+  RegionStore(const RegionStore&) = delete;
+
+  // load() replaces the Chunk at pos in world with the saved Chunk. If no
+  // Chunk was saved at pos, world is not changed and load() returns 0.
+  WARN_UNUSED_RESULT int load(World& world, const ChunkPos& pos);
+
+  // save() writes the Chunk at pos in world, or removes the saved Chunk if
+  // there is none in world. It compacts the region file when
+  // Region::needsCompact() says so.
+  WARN_UNUSED_RESULT int save(const World& world, const ChunkPos& pos);
+
+  // saveAll() writes every Chunk in world.
+  WARN_UNUSED_RESULT int saveAll(const World& world);
+
+  // compact() compacts every open region file that needs it.
+  WARN_UNUSED_RESULT int compact();
+
+  const std::string dir;
+
+ protected:
+  // regionOf returns the Region for the Chunk at pos, or nullptr if there
+  // is no region file and create is false. It also returns nullptr on
+  // error, and sets *err.
+  Region* regionOf(const ChunkPos& pos, bool create, int* err);
+
+  std::unordered_map<ChunkPos, std::unique_ptr<Region>, ChunkPosHash> regions;
+};
+
+}  // namespace voxel
@@ -0,0 +1,361 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "stream.h"
+
+#include <math.h>
+#include <algorithm>
+
+namespace voxel {
+
+Frustum::Frustum() {
+  for (int i = 0; i < 6; i++) {
+    plane[i][0] = plane[i][1] = plane[i][2] = 0;
+    plane[i][3] = 1;
+  }
+}
+
+Frustum::Frustum(const float viewProj[16]) {
+  // Gribb and Hartmann: each plane is a sum of rows of viewProj. Row i of a
+  // column-major matrix is viewProj[i], [4 + i], [8 + i], [12 + i].
+  // Vulkan clip space is -w <= x, y <= w and 0 <= z <= w.
+  static const int row[6] = {0, 0, 1, 1, 2, 2};
+  static const float sign[6] = {1, -1, 1, -1, 1, -1};
+  for (int i = 0; i < 6; i++) {
+    for (int j = 0; j < 4; j++) {
+      const float* col = &viewProj[j * 4];
+      // The near plane (i == 4) is just z >= 0, without adding row 3.
+      plane[i][j] = (i == 4 ? 0 : col[3]) + sign[i] * col[row[i]];
+    }
+  }
+}
+
+bool Frustum::intersects(const float lo[3], const float hi[3]) const {
+  for (int i = 0; i < 6; i++) {
+    // Test the corner of the box that is farthest along the plane normal.
+    float d = plane[i][3];
+    for (int j = 0; j < 3; j++) {
+      d += plane[i][j] * (plane[i][j] >= 0 ? hi[j] : lo[j]);
+    }
+    if (d < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+// chunkBox returns the corners of the Chunk at pos, in voxels.
+void chunkBox(const ChunkPos& pos, float lo[3], float hi[3]) {
+  lo[0] = (float)pos.x * Chunk::size;
+  lo[1] = (float)pos.y * Chunk::size;
+  lo[2] = (float)pos.z * Chunk::size;
+  for (int i = 0; i < 3; i++) {
+    hi[i] = lo[i] + Chunk::size;
+  }
+}
+
+int64_t distanceSquared(const ChunkPos& a, const ChunkPos& b) {
+  int64_t dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+}  // anonymous namespace
+
+Streamer::Streamer(language::Device& dev, World& world, job::Scheduler& jobs,
+                   memory::TransferQueue& transfer,
+                   memory::DeviceMemoryAllocator& allocator)
+    : dev(dev),
+      world(world),
+      jobs(jobs),
+      transfer(transfer),
+      allocator(allocator) {}
+
+Streamer::~Streamer() {
+  // Jobs hold pointers into resident. The application must also wait for
+  // the GPU to finish drawing before it destroys the Streamer.
+  if (wait()) {
+    fprintf(stderr, "~Streamer: wait failed\n");
+  }
+  uint64_t last = 0;
+  for (auto& r : resident) {
+    last = std::max(last, r.second->next.ticket);
+  }
+  for (auto& r : retired) {
+    last = std::max(last, r.up.ticket);
+  }
+  if (last && transfer.wait(last)) {
+    fprintf(stderr, "~Streamer: transfer.wait failed\n");
+  }
+}
+
+int Streamer::ctorError(size_t framesInFlight) {
+  if (!jobs.threadCount()) {
+    fprintf(stderr, "Streamer::ctorError: call jobs.ctorError first\n");
+    return 1;
+  }
+  this->framesInFlight = framesInFlight;
+  meshers.clear();
+  meshers.resize(jobs.threadCount());
+  return 0;
+}
+
+int64_t Streamer::priority(const ChunkPos& pos, const ChunkPos& center) const {
+  float lo[3], hi[3];
+  chunkBox(pos, lo, hi);
+  int64_t d = distanceSquared(pos, center);
+  // A chunk outside the frustum loads as if it were twice as far away, so
+  // turning around quickly still finds the nearest chunks loaded.
+  return frustum.intersects(lo, hi) ? d : d * 4;
+}
+
+void Streamer::startMeshing(Resident& r) {
+  r.state = MESHING;
+  r.dirty = false;
+  Resident* p = &r;
+  r.job = jobs.submit([this, p]() -> int {
+    meshers.at(job::Scheduler::threadIndex()).mesh(world, p->pos, p->mesh);
+    return 0;
+  });
+}
+
+int Streamer::upload(Resident& r) {
+  r.next = Upload();
+  if (!r.mesh.vertices.empty()) {
+    VkDeviceSize vbytes = r.mesh.vertices.size() * sizeof(r.mesh.vertices[0]);
+    VkDeviceSize ibytes = r.mesh.indices.size() * sizeof(r.mesh.indices[0]);
+    r.next.buf.reset(new memory::Buffer(dev));
+    memory::Buffer& buf = *r.next.buf;
+    buf.info.size = vbytes + ibytes;
+    buf.info.usage =
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+    buf.suballocator = &allocator;
+    if (buf.ctorDeviceLocal(dev) || buf.bindMemory(dev) ||
+        transfer.copy(buf, r.mesh.vertices) ||
+        transfer.copy(buf, r.mesh.indices, vbytes)) {
+      return 1;
+    }
+    r.next.indexOffset = vbytes;
+    r.next.indexCount = r.mesh.indices.size();
+  }
+  r.state = UPLOADING;
+  return 0;
+}
+
+void Streamer::retire(Upload& up) {
+  if (up.buf) {
+    retired.emplace_back();
+    retired.back().up = std::move(up);
+    retired.back().frame = frame + framesInFlight;
+  }
+  up = Upload();
+}
+
+void Streamer::evict(const ChunkPos& center) {
+  const int64_t far = (int64_t)(viewDistance + evictMargin) *
+                      (viewDistance + evictMargin);
+  for (auto i = resident.begin(); i != resident.end();) {
+    Resident& r = *i->second;
+    // A meshing job still points to r. Evict it next frame.
+    if (r.state == MESHING || distanceSquared(r.pos, center) <= far) {
+      i++;
+      continue;
+    }
+    retire(r.drawn);
+    retire(r.next);
+    i = resident.erase(i);
+  }
+}
+
+void Streamer::load(const ChunkPos& center) {
+  size_t meshing = 0;
+  for (auto& r : resident) {
+    meshing += r.second->state == MESHING;
+  }
+  if (meshing >= maxMeshesPerFrame) {
+    return;
+  }
+  const size_t budget = maxMeshesPerFrame - meshing;
+
+  // Find every chunk in the sphere that exists but is not resident.
+  const int32_t n = viewDistance;
+  std::vector<std::pair<int64_t, ChunkPos>> todo;
+  for (int32_t dy = -n; dy <= n; dy++) {
+    for (int32_t dz = -n; dz <= n; dz++) {
+      for (int32_t dx = -n; dx <= n; dx++) {
+        if (dx * dx + dy * dy + dz * dz > n * n) {
+          continue;
+        }
+        ChunkPos pos{center.x + dx, center.y + dy, center.z + dz};
+        if (resident.count(pos) || !world.find(pos)) {
+          continue;
+        }
+        todo.emplace_back(priority(pos, center), pos);
+      }
+    }
+  }
+  auto end = todo.begin() + std::min(budget, todo.size());
+  std::partial_sort(todo.begin(), end, todo.end(),
+                    [](const std::pair<int64_t, ChunkPos>& a,
+                       const std::pair<int64_t, ChunkPos>& b) {
+                      return a.first < b.first;
+                    });
+  for (auto i = todo.begin(); i != end; i++) {
+    std::unique_ptr<Resident> r(new Resident());
+    r->pos = i->second;
+    startMeshing(*r);
+    resident.emplace(i->second, std::move(r));
+  }
+}
+
+int Streamer::update(const float eye[3], const float viewProj[16]) {
+  if (meshers.empty()) {
+    fprintf(stderr, "BUG: Streamer::update before ctorError\n");
+    return 1;
+  }
+  frame++;
+  frustum = Frustum(viewProj);
+  ChunkPos center = World::posOf((int32_t)floorf(eye[0]),
+                                 (int32_t)floorf(eye[1]),
+                                 (int32_t)floorf(eye[2]));
+
+  // evict() first: meshed below must not point to an evicted Resident.
+  evict(center);
+
+  // Move each Resident along as its job or upload completes.
+  std::vector<std::pair<int64_t, Resident*>> meshed;
+  for (auto& i : resident) {
+    Resident& r = *i.second;
+    if (r.state == MESHING && r.job->done) {
+      if (jobs.wait(r.job)) {
+        return 1;
+      }
+      r.job.reset();
+      r.state = MESHED;
+      if (r.dirty) {
+        startMeshing(r);
+      }
+    }
+    if (r.state == UPLOADING && transfer.isDone(r.next.ticket)) {
+      retire(r.drawn);
+      r.drawn = std::move(r.next);
+      r.next = Upload();
+      r.state = READY;
+      if (r.dirty) {
+        startMeshing(r);
+      }
+    }
+    if (r.state == MESHED) {
+      meshed.emplace_back(priority(r.pos, center), &r);
+    }
+  }
+
+  load(center);
+
+  // Upload the nearest meshes first, up to maxUploadBytesPerFrame.
+  std::sort(meshed.begin(), meshed.end(),
+            [](const std::pair<int64_t, Resident*>& a,
+               const std::pair<int64_t, Resident*>& b) {
+              return a.first < b.first;
+            });
+  VkDeviceSize bytes = 0;
+  std::vector<Resident*> uploaded;
+  for (auto& m : meshed) {
+    Resident& r = *m.second;
+    VkDeviceSize size = r.mesh.vertices.size() * sizeof(r.mesh.vertices[0]) +
+                        r.mesh.indices.size() * sizeof(r.mesh.indices[0]);
+    if (!uploaded.empty() && bytes + size > maxUploadBytesPerFrame) {
+      break;
+    }
+    if (upload(r)) {
+      return 1;
+    }
+    bytes += size;
+    uploaded.emplace_back(&r);
+  }
+  uint64_t ticket;
+  if (transfer.flush(&ticket)) {
+    return 1;
+  }
+  for (auto r : uploaded) {
+    r->next.ticket = ticket;
+    // flush() has copied the mesh to staging memory.
+    r->mesh = Mesh();
+  }
+
+  // Destroy retired Buffers the GPU is done with. Their memory goes back to
+  // allocator.
+  retired.erase(std::remove_if(retired.begin(), retired.end(),
+                               [this](Retired& r) {
+                                 return frame >= r.frame &&
+                                        (!r.up.ticket ||
+                                         transfer.isDone(r.up.ticket));
+                               }),
+                retired.end());
+  return 0;
+}
+
+void Streamer::invalidate(const ChunkPos& pos) {
+  auto i = resident.find(pos);
+  if (i == resident.end()) {
+    return;  // load() will find it if it is close enough.
+  }
+  Resident& r = *i->second;
+  if (r.state == MESHING || r.state == UPLOADING) {
+    r.dirty = true;
+  } else {
+    startMeshing(r);
+  }
+}
+
+int Streamer::wait() {
+  int result = 0;
+  for (auto& r : resident) {
+    if (r.second->job && jobs.wait(r.second->job)) {
+      result = 1;
+    }
+  }
+  return result;
+}
+
+void Streamer::visible(std::vector<Drawable>& out) const {
+  out.clear();
+  for (auto& i : resident) {
+    const Resident& r = *i.second;
+    float lo[3], hi[3];
+    chunkBox(r.pos, lo, hi);
+    if (!r.drawn.buf || !frustum.intersects(lo, hi)) {
+      continue;
+    }
+    out.emplace_back();
+    Drawable& d = out.back();
+    d.pos = r.pos;
+    d.buf = r.drawn.buf->vk;
+    d.indexOffset = r.drawn.indexOffset;
+    d.indexCount = r.drawn.indexCount;
+  }
+}
+
+Streamer::Stats Streamer::stats() const {
+  Stats s;
+  s.resident = resident.size();
+  s.retired = retired.size();
+  for (auto& i : resident) {
+    const Resident& r = *i.second;
+    s.meshing += r.state == MESHING;
+    s.uploading += r.state == UPLOADING;
+    s.drawable += !!r.drawn.buf;
+    if (r.drawn.buf) {
+      s.gpuBytes += r.drawn.buf->info.size;
+    }
+    if (r.next.buf) {
+      s.gpuBytes += r.next.buf->info.size;
+    }
+  }
+  for (auto& r : retired) {
+    s.gpuBytes += r.up.buf->info.size;
+  }
+  return s;
+}
+
+}  // namespace voxel
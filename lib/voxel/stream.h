@@ -0,0 +1,184 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * lib/voxel/stream.h keeps the chunks around the camera meshed and on the
+ * GPU. Unlike the rest of lib/voxel it uses lib/memory and lib/job, so it is
+ * a separate target: //lib/voxel:stream.
+ */
+
+#include <lib/job/job.h>
+#include <lib/memory/memory.h>
+#include <lib/voxel/mesh.h>
+
+#pragma once
+
+namespace voxel {
+
+// Frustum is the 6 clip planes of a view-projection matrix, for culling
+// chunks on the CPU.
+typedef struct Frustum {
+  // Frustum() contains everything.
+  Frustum();
+  // viewProj is proj * view, column-major (for example &m[0][0] of a
+  // glm::mat4) with Vulkan clip space depth of 0 to 1, such as ubo.proj *
+  // ubo.view in main.cpp's updateUniformBuffer().
+  Frustum(const float viewProj[16]);
+
+  // intersects returns false only if the box from lo to hi is completely
+  // outside one of the planes.
+  bool intersects(const float lo[3], const float hi[3]) const;
+
+  // plane[i] is a, b, c, d for the plane a*x + b*y + c*z + d >= 0.
+  float plane[6][4];
+} Frustum;
+
+// Streamer keeps a sphere of chunks around the camera resident: meshed by
+// jobs on worker threads and uploaded to device-local Buffers by a
+// TransferQueue. Chunks are meshed and uploaded nearest first, and chunks
+// in the view frustum before chunks behind the camera. Each update() starts
+// at most maxMeshesPerFrame meshing jobs and uploads at most
+// maxUploadBytesPerFrame, so a fast-moving camera causes holes in the
+// distance rather than a frame spike.
+//
+// Chunks beyond viewDistance + evictMargin are evicted. Their Buffers are
+// kept until the frames in flight are done with them, then destroyed, which
+// returns their memory to the DeviceMemoryAllocator for the next chunk. The
+// world can then be much bigger than VRAM.
+//
+// Example usage:
+//   voxel::Streamer stream(dev, world, jobs, transfer, allocator);
+//   if (stream.ctorError(dev.framebufs.size())) { ... }
+//   // Each frame, on the main thread:
+//   if (stream.update(eye, &viewProj[0][0]) || transfer.acquire(builder)) {
+//     ...
+//   }
+//   stream.visible(drawables);
+//   for (auto& d : drawables) {
+//     // Push d.pos, then bind d.buf and draw d.indexCount indices.
+//   }
+//
+// Do not modify world while meshing jobs may be running: call wait() first,
+// then invalidate() the chunks that changed.
+class Streamer {
+ public:
+  Streamer(language::Device& dev, World& world, job::Scheduler& jobs,
+           memory::TransferQueue& transfer,
+           memory::DeviceMemoryAllocator& allocator);
+  Streamer(Streamer&&) = delete;
+  Streamer(const Streamer&) = delete;
+  virtual ~Streamer();
+
+  // Two-stage constructor: check the return code of ctorError().
+  // framesInFlight is how many frames the GPU may still be drawing after
+  // update() returns, usually dev.framebufs.size().
+  WARN_UNUSED_RESULT int ctorError(size_t framesInFlight);
+
+  // update() moves the resident sphere to eye (in voxels), evicts far
+  // chunks, starts meshing the nearest missing chunks, uploads finished
+  // meshes, and flushes the TransferQueue. Call it once per frame on the
+  // main thread, then call TransferQueue::acquire() before drawing.
+  WARN_UNUSED_RESULT int update(const float eye[3], const float viewProj[16]);
+
+  // invalidate() meshes and uploads the chunk at pos again, for example
+  // after World::set().
+  void invalidate(const ChunkPos& pos);
+
+  // wait() blocks until no meshing jobs are running.
+  WARN_UNUSED_RESULT int wait();
+
+  // Drawable is one uploaded chunk. buf holds the MeshVertex array at
+  // offset 0, and uint32_t indices at indexOffset.
+  typedef struct Drawable {
+    ChunkPos pos;
+    VkBuffer buf;
+    VkDeviceSize indexOffset;
+    uint32_t indexCount;
+  } Drawable;
+
+  // visible() replaces out with the uploaded chunks inside the frustum
+  // passed to the last update().
+  void visible(std::vector<Drawable>& out) const;
+
+  // viewDistance is the radius, in chunks, of the resident sphere.
+  int32_t viewDistance{8};
+  // evictMargin keeps chunks a little past viewDistance, so a camera moving
+  // back and forth across a chunk border does not reload them.
+  int32_t evictMargin{2};
+  // maxMeshesPerFrame caps the meshing jobs started by one update().
+  size_t maxMeshesPerFrame{16};
+  // maxUploadBytesPerFrame caps the bytes uploaded by one update(). A mesh
+  // bigger than this is still uploaded, alone.
+  VkDeviceSize maxUploadBytesPerFrame{4 * 1024 * 1024};
+
+  typedef struct Stats {
+    size_t resident{0};
+    size_t meshing{0};
+    size_t uploading{0};
+    size_t drawable{0};
+    size_t retired{0};
+    VkDeviceSize gpuBytes{0};
+  } Stats;
+  Stats stats() const;
+
+  language::Device& dev;
+  World& world;
+  job::Scheduler& jobs;
+  memory::TransferQueue& transfer;
+  memory::DeviceMemoryAllocator& allocator;
+
+ protected:
+  enum State {
+    MESHING = 0,  // A job is writing mesh.
+    MESHED = 1,   // mesh is waiting for the upload budget.
+    UPLOADING = 2,
+    READY = 3,
+  };
+
+  // Upload is a Buffer holding one Mesh.
+  typedef struct Upload {
+    // buf is nullptr if the Mesh was empty.
+    std::unique_ptr<memory::Buffer> buf;
+    VkDeviceSize indexOffset{0};
+    uint32_t indexCount{0};
+    // ticket is the TransferQueue ticket that copies the Mesh into buf.
+    uint64_t ticket{0};
+  } Upload;
+
+  typedef struct Resident {
+    ChunkPos pos;
+    State state{MESHING};
+    // dirty means invalidate() was called while meshing or uploading.
+    bool dirty{false};
+    Mesh mesh;
+    job::Handle job;
+    // drawn is what visible() returns. next replaces drawn when its upload
+    // is done, so an invalidated chunk does not flicker.
+    Upload drawn;
+    Upload next;
+  } Resident;
+
+  // Retired is an Upload the GPU may still be reading.
+  typedef struct Retired {
+    Upload up;
+    // frame is when the frames in flight are done with up.
+    uint64_t frame;
+  } Retired;
+
+  // priority returns the load order of pos: lower loads first.
+  int64_t priority(const ChunkPos& pos, const ChunkPos& center) const;
+  void startMeshing(Resident& r);
+  WARN_UNUSED_RESULT int upload(Resident& r);
+  void retire(Upload& up);
+  void evict(const ChunkPos& center);
+  void load(const ChunkPos& center);
+
+  std::unordered_map<ChunkPos, std::unique_ptr<Resident>, ChunkPosHash>
+      resident;
+  std::vector<Retired> retired;
+  // meshers has one Mesher per thread, indexed by Scheduler::threadIndex().
+  std::vector<Mesher> meshers;
+  Frustum frustum;
+  size_t framesInFlight{0};
+  uint64_t frame{0};
+};
+
+}  // namespace voxel
@@ -0,0 +1,229 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * lib/voxel/visibility.cpp is the face visibility kernel for Mesher: it
+ * packs voxels into occupancy words, then finds exposed faces with shifts,
+ * ANDs and NOTs. The SSE2 and AVX2 versions must produce identical output
+ * to the scalar version.
+ */
+#include "mesh.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VOXEL_X86 1
+// target() compiles one function for AVX2 without -mavx2 for the whole file.
+#define VOXEL_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace voxel {
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+constexpr uint32_t n = Chunk::size;
+constexpr uint32_t P = Mesher::padded;
+
+// faceWord converts a padded row (bit 0 is the neighbor voxel at x = -1) to
+// a face word (bit 0 is x = 0).
+inline uint32_t faceWord(uint64_t t) { return (uint32_t)(t >> 1); }
+
+bool occupancyScalar(const Block* vox, uint64_t* solid) {
+  for (uint32_t row = 0; row < P * P; row++, vox += P) {
+    uint64_t w = 0;
+    for (uint32_t x = 0; x < P; x++) {
+      w |= (uint64_t)(vox[x] != air) << x;
+    }
+    solid[row] = w;
+  }
+  return true;
+}
+
+bool faceVisibilityScalar(const uint64_t* solid, uint32_t* faces) {
+  for (uint32_t y = 0; y < n; y++) {
+    const uint64_t* r = &solid[(y + 1) * P + 1];
+    for (uint32_t z = 0; z < n; z++, r++) {
+      uint32_t i = y * n + z;
+      faces[0 * n * n + i] = faceWord(*r & ~(*r >> 1));
+      faces[1 * n * n + i] = faceWord(*r & ~(*r << 1));
+      faces[2 * n * n + i] = faceWord(*r & ~r[P]);
+      faces[3 * n * n + i] = faceWord(*r & ~r[-(int)P]);
+      faces[4 * n * n + i] = faceWord(*r & ~r[1]);
+      faces[5 * n * n + i] = faceWord(*r & ~r[-1]);
+    }
+  }
+  return true;
+}
+
+#ifdef VOXEL_X86
+
+// edges returns the bits of the padded row for x = -1 and x = n, which the
+// SIMD loops do not cover.
+inline uint64_t edges(const Block* row) {
+  return (uint64_t)(row[0] != air) | ((uint64_t)(row[P - 1] != air) << (P - 1));
+}
+
+bool occupancySSE2(const Block* vox, uint64_t* solid) {
+  const __m128i zero = _mm_setzero_si128();
+  for (uint32_t row = 0; row < P * P; row++, vox += P) {
+    uint32_t airBits = 0;
+    for (uint32_t x = 0; x < n; x += 16) {
+      const __m128i* p = (const __m128i*)(vox + 1 + x);
+      __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128(p), zero);
+      __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128(p + 1), zero);
+      // packs turns each 0xffff (air) into 0xff, one byte per voxel.
+      airBits |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << x;
+    }
+    solid[row] = ((uint64_t)(uint32_t)~airBits << 1) | edges(vox);
+  }
+  return true;
+}
+
+// storeFaces2 stores the face words of 2 padded rows.
+inline void storeFaces2(uint32_t* out, __m128i t) {
+  t = _mm_srli_epi64(t, 1);
+  // Move the low 32 bits of each 64-bit lane into the low 64 bits.
+  _mm_storel_epi64((__m128i*)out,
+                   _mm_shuffle_epi32(t, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+bool faceVisibilitySSE2(const uint64_t* solid, uint32_t* faces) {
+  for (uint32_t y = 0; y < n; y++) {
+    const uint64_t* r = &solid[(y + 1) * P + 1];
+    for (uint32_t z = 0; z < n; z += 2, r += 2) {
+      uint32_t* out = &faces[y * n + z];
+      __m128i s = _mm_loadu_si128((const __m128i*)r);
+      // _mm_andnot_si128(a, b) is ~a & b.
+      storeFaces2(out + 0 * n * n,
+                  _mm_andnot_si128(_mm_srli_epi64(s, 1), s));
+      storeFaces2(out + 1 * n * n,
+                  _mm_andnot_si128(_mm_slli_epi64(s, 1), s));
+      storeFaces2(out + 2 * n * n,
+                  _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(r + P)),
+                                   s));
+      storeFaces2(out + 3 * n * n,
+                  _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(r - P)),
+                                   s));
+      storeFaces2(out + 4 * n * n,
+                  _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(r + 1)),
+                                   s));
+      storeFaces2(out + 5 * n * n,
+                  _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(r - 1)),
+                                   s));
+    }
+  }
+  return true;
+}
+
+VOXEL_AVX2 bool occupancyAVX2(const Block* vox, uint64_t* solid) {
+  const __m256i zero = _mm256_setzero_si256();
+  for (uint32_t row = 0; row < P * P; row++, vox += P) {
+    const __m256i* p = (const __m256i*)(vox + 1);
+    __m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256(p), zero);
+    __m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256(p + 1), zero);
+    // packs works in each 128-bit lane, leaving the 64-bit groups in the
+    // order a0 b0 a1 b1. Reorder them to a0 a1 b0 b1.
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b),
+                                              _MM_SHUFFLE(3, 1, 2, 0));
+    uint32_t airBits = (uint32_t)_mm256_movemask_epi8(packed);
+    solid[row] = ((uint64_t)(uint32_t)~airBits << 1) | edges(vox);
+  }
+  return true;
+}
+
+// storeFaces4 stores the face words of 4 padded rows.
+VOXEL_AVX2 inline void storeFaces4(uint32_t* out, __m256i t) {
+  t = _mm256_srli_epi64(t, 1);
+  // Move the low 32 bits of each 64-bit lane into the low 128 bits.
+  const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  _mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(
+                                      _mm256_permutevar8x32_epi32(t, even)));
+}
+
+VOXEL_AVX2 bool faceVisibilityAVX2(const uint64_t* solid, uint32_t* faces) {
+  for (uint32_t y = 0; y < n; y++) {
+    const uint64_t* r = &solid[(y + 1) * P + 1];
+    for (uint32_t z = 0; z < n; z += 4, r += 4) {
+      uint32_t* out = &faces[y * n + z];
+      __m256i s = _mm256_loadu_si256((const __m256i*)r);
+      storeFaces4(out + 0 * n * n,
+                  _mm256_andnot_si256(_mm256_srli_epi64(s, 1), s));
+      storeFaces4(out + 1 * n * n,
+                  _mm256_andnot_si256(_mm256_slli_epi64(s, 1), s));
+      storeFaces4(out + 2 * n * n,
+                  _mm256_andnot_si256(
+                      _mm256_loadu_si256((const __m256i*)(r + P)), s));
+      storeFaces4(out + 3 * n * n,
+                  _mm256_andnot_si256(
+                      _mm256_loadu_si256((const __m256i*)(r - P)), s));
+      storeFaces4(out + 4 * n * n,
+                  _mm256_andnot_si256(
+                      _mm256_loadu_si256((const __m256i*)(r + 1)), s));
+      storeFaces4(out + 5 * n * n,
+                  _mm256_andnot_si256(
+                      _mm256_loadu_si256((const __m256i*)(r - 1)), s));
+    }
+  }
+  return true;
+}
+
+#endif /* VOXEL_X86 */
+
+}  // anonymous namespace
+
+SimdPath bestSimdPath() {
+#ifdef VOXEL_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return SIMD_SSE2;
+  }
+#endif
+  return SIMD_SCALAR;
+}
+
+const char* simdPathName(SimdPath path) {
+  switch (path) {
+    case SIMD_SCALAR:
+      return "scalar";
+    case SIMD_SSE2:
+      return "sse2";
+    case SIMD_AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+bool occupancy(SimdPath path, const Block* vox, uint64_t* solid) {
+  switch (path) {
+    case SIMD_SCALAR:
+      return occupancyScalar(vox, solid);
+#ifdef VOXEL_X86
+    case SIMD_SSE2:
+      return occupancySSE2(vox, solid);
+    case SIMD_AVX2:
+      return occupancyAVX2(vox, solid);
+#else
+    default:
+      break;
+#endif
+  }
+  return false;
+}
+
+bool faceVisibility(SimdPath path, const uint64_t* solid, uint32_t* faces) {
+  switch (path) {
+    case SIMD_SCALAR:
+      return faceVisibilityScalar(solid, faces);
+#ifdef VOXEL_X86
+    case SIMD_SSE2:
+      return faceVisibilitySSE2(solid, faces);
+    case SIMD_AVX2:
+      return faceVisibilityAVX2(solid, faces);
+#else
+    default:
+      break;
+#endif
+  }
+  return false;
+}
+
+}  // namespace voxel
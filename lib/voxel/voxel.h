@@ -0,0 +1,218 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * lib/voxel is the voxel world store for the v0lum3 project. Only mesh.h
+ * uses the Vulkan headers.
+ *
+ * A World is a sparse hash map of Chunk objects. Each Chunk holds 32^3
+ * voxels as a palette of Block values plus a bit-packed index per voxel,
+ * so a Chunk with only a few distinct Block values uses only a few bits per
+ * voxel. A Chunk with a single Block value (all air, all stone) stores no
+ * indices at all.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#pragma once
+
+namespace voxel {
+
+// Block is the type of one voxel. 0 is air (empty space).
+typedef uint16_t Block;
+constexpr Block air = 0;
+
+// ChunkPos is the coordinate of a Chunk, i.e. the voxel coordinate divided
+// by Chunk::size (rounded toward negative infinity).
+typedef struct ChunkPos {
+  int32_t x, y, z;
+
+  bool operator==(const ChunkPos& other) const {
+    return x == other.x && y == other.y && z == other.z;
+  }
+  bool operator!=(const ChunkPos& other) const { return !(*this == other); }
+} ChunkPos;
+
+// ChunkPosHash lets ChunkPos be the key of a std::unordered_map.
+struct ChunkPosHash {
+  size_t operator()(const ChunkPos& p) const {
+    // Multiply by large odd constants so neighbouring chunks spread out.
+    uint64_t h = (uint64_t)(uint32_t)p.x * 0x9e3779b97f4a7c15ull;
+    h ^= (uint64_t)(uint32_t)p.y * 0xc2b2ae3d27d4eb4full;
+    h ^= (uint64_t)(uint32_t)p.z * 0x165667b19e3779f9ull;
+    return (size_t)(h ^ (h >> 29));
+  }
+};
+
+// Chunk is a cube of size^3 voxels with palette compression.
+//
+// Each voxel is an index into palette. The indices are packed into 64-bit
+// words with indexBits per index, where indexBits is 0, 1, 2, 4, 8, or 16.
+// indexBits is a power of 2 so an index never straddles two words. When the
+// palette outgrows indexBits, set() repacks the indices with twice as many
+// bits. compact() does the opposite.
+//
+// indexBits == 0 is the uniform fast path: every voxel is palette[0] and
+// data is empty.
+class Chunk {
+ public:
+  static constexpr int bits = 5;
+  static constexpr uint32_t size = 1 << bits;
+  static constexpr uint32_t volume = size * size * size;
+
+  Chunk(Block fill = air) : palette{fill}, counts{volume} {}
+  Chunk(Chunk&&) = default;
+  Chunk(const Chunk&) = delete;
+
+  // indexOf returns the index of a voxel. x, y, and z must be < size.
+  // x varies fastest, then z, then y.
+  static uint32_t indexOf(uint32_t x, uint32_t y, uint32_t z) {
+    return (y << (2 * bits)) | (z << bits) | x;
+  }
+
+  Block get(uint32_t x, uint32_t y, uint32_t z) const {
+    return getI(indexOf(x, y, z));
+  }
+  Block getI(uint32_t i) const {
+    if (!indexBits) {
+      return palette[0];
+    }
+    return palette[readIndex(i)];
+  }
+
+  void set(uint32_t x, uint32_t y, uint32_t z, Block b) {
+    setI(indexOf(x, y, z), b);
+  }
+  void setI(uint32_t i, Block b);
+
+  // fill sets every voxel to b. It frees the indices.
+  void fill(Block b);
+
+  bool isUniform() const { return !indexBits; }
+
+  // paletteSize returns the number of distinct Block values in use.
+  size_t paletteSize() const { return palette.size() - freeSlots.size(); }
+
+  // compact removes unused palette entries and repacks the indices with as
+  // few bits as possible. A Chunk with one Block value becomes uniform.
+  void compact();
+
+  // memoryUsage returns the number of bytes used by this Chunk.
+  size_t memoryUsage() const;
+
+  // serialize appends this Chunk to out. The indices are copied as they are,
+  // so serialize does not visit each voxel. The words are in host byte
+  // order.
+  void serialize(std::vector<uint64_t>& out) const;
+
+  // maxSerialWords is the most words serialize can append: a header word,
+  // a full 16-bit palette with its counts, and 16-bit indices.
+  static constexpr size_t maxSerialWords =
+      1 + ((1 << 16) * (sizeof(Block) + sizeof(uint32_t)) + 7) / 8 +
+      volume / 4;
+
+  // deserialize replaces this Chunk with one written by serialize. It
+  // returns non-zero if the words are not a valid Chunk. It checks every
+  // index against the palette and recounts the indices, so words can come
+  // from an untrusted file.
+  int deserialize(const uint64_t* words, size_t n);
+
+ protected:
+  uint32_t readIndex(uint32_t i) const {
+    uint64_t word = data[i >> wordShift];
+    uint32_t shift = (i & ((1u << wordShift) - 1)) * indexBits;
+    return (uint32_t)(word >> shift) & ((1u << indexBits) - 1);
+  }
+  void writeIndex(uint32_t i, uint32_t v) {
+    uint64_t& word = data[i >> wordShift];
+    uint32_t shift = (i & ((1u << wordShift) - 1)) * indexBits;
+    uint64_t mask = (uint64_t)((1u << indexBits) - 1) << shift;
+    word = (word & ~mask) | ((uint64_t)v << shift);
+  }
+
+  // paletteIndex returns the palette index of b, adding it if needed.
+  uint32_t paletteIndex(Block b);
+  // repack rewrites data with newBits per index. remap, if not empty, maps
+  // each old palette index to a new one.
+  void repack(uint8_t newBits, const std::vector<uint32_t>& remap);
+
+  // lookupAbove is the palette size above which lookup is used instead of a
+  // linear search of palette.
+  static constexpr size_t lookupAbove = 16;
+
+  std::vector<Block> palette;
+  // counts is the number of voxels using each palette entry.
+  std::vector<uint32_t> counts;
+  // freeSlots are palette entries with a count of 0, to be reused.
+  std::vector<uint32_t> freeSlots;
+  // lookup maps Block to palette index once the palette is large.
+  std::unique_ptr<std::unordered_map<Block, uint32_t>> lookup;
+  std::vector<uint64_t> data;
+  uint8_t indexBits{0};
+  // wordShift is log2(64 / indexBits), the number of indices per word.
+  uint8_t wordShift{0};
+};
+
+// World is a sparse set of Chunk objects. Voxels in chunks that do not
+// exist are air.
+//
+// Example usage:
+//   voxel::World world;
+//   world.set(-1, 64, 3, stone);
+//   if (world.get(-1, 64, 3) == stone) { ... }
+//   world.compact();
+//   fprintf(stderr, "%zu chunks, %zu bytes\n", world.chunks.size(),
+//           world.memoryUsage());
+class World {
+ public:
+  World() = default;
+  World(World&&) = default;
+  World(const World&) = delete;
+
+  // posOf returns the ChunkPos that contains voxel x, y, z.
+  static ChunkPos posOf(int32_t x, int32_t y, int32_t z) {
+    return ChunkPos{x >> Chunk::bits, y >> Chunk::bits, z >> Chunk::bits};
+  }
+  // localOf returns the coordinate of voxel v inside its Chunk.
+  static uint32_t localOf(int32_t v) { return (uint32_t)v & (Chunk::size - 1); }
+
+  Block get(int32_t x, int32_t y, int32_t z) const {
+    const Chunk* c = find(posOf(x, y, z));
+    if (!c) {
+      return air;
+    }
+    return c->get(localOf(x), localOf(y), localOf(z));
+  }
+
+  // set creates the Chunk if needed, unless b is air.
+  void set(int32_t x, int32_t y, int32_t z, Block b);
+
+  // find returns the Chunk at pos or nullptr if it does not exist.
+  Chunk* find(const ChunkPos& pos) {
+    auto i = chunks.find(pos);
+    return i == chunks.end() ? nullptr : i->second.get();
+  }
+  const Chunk* find(const ChunkPos& pos) const {
+    auto i = chunks.find(pos);
+    return i == chunks.end() ? nullptr : i->second.get();
+  }
+
+  // at returns the Chunk at pos, creating an all-air Chunk if needed.
+  Chunk& at(const ChunkPos& pos);
+
+  // compact calls Chunk::compact() on every Chunk and removes chunks that
+  // are all air.
+  void compact();
+
+  // memoryUsage returns the number of bytes used by all chunks, including
+  // the hash map.
+  size_t memoryUsage() const;
+
+  // chunks holds each Chunk in a unique_ptr so a Chunk& stays valid when
+  // chunks is rehashed.
+  std::unordered_map<ChunkPos, std::unique_ptr<Chunk>, ChunkPosHash> chunks;
+};
+
+}  // namespace voxel
@@ -0,0 +1,399 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * voxel_test checks Chunk and World against a plain array of Block values,
+ * and round-trips them through Chunk::serialize and region files, including
+ * corrupt ones. Build it with -fsanitize=address to catch reads outside a
+ * Chunk.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "lib/voxel/region.h"
+#include "lib/voxel/voxel.h"
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+using voxel::Block;
+using voxel::Chunk;
+using voxel::Region;
+
+// Rand is a small deterministic generator, so a failure can be reproduced.
+typedef struct Rand {
+  uint64_t s{0x2545f4914f6cdd1dull};
+  uint32_t next() {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return (uint32_t)s;
+  }
+} Rand;
+
+// check compares c to want and returns non-zero if any voxel differs.
+int check(const Chunk& c, const std::vector<Block>& want, const char* what) {
+  for (uint32_t i = 0; i < Chunk::volume; i++) {
+    if (c.getI(i) != want[i]) {
+      fprintf(stderr, "%s: voxel %u is %u want %u\n", what, i,
+              (unsigned)c.getI(i), (unsigned)want[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// testRandom sets random voxels to one of kinds Block values, so the
+// palette grows through each indexBits, and then compacts it.
+int testRandom(uint32_t kinds) {
+  Rand r;
+  Chunk c;
+  std::vector<Block> want(Chunk::volume, voxel::air);
+  for (uint32_t n = 0; n < Chunk::volume * 2; n++) {
+    uint32_t i = r.next() % Chunk::volume;
+    Block b = (Block)(r.next() % kinds);
+    c.setI(i, b);
+    want[i] = b;
+  }
+  if (check(c, want, "testRandom set")) {
+    fprintf(stderr, "testRandom(%u) failed\n", kinds);
+    return 1;
+  }
+  c.compact();
+  if (check(c, want, "testRandom compact") || c.paletteSize() > kinds) {
+    fprintf(stderr, "testRandom(%u) compact failed, palette %zu\n", kinds,
+            c.paletteSize());
+    return 1;
+  }
+  return 0;
+}
+
+// testShrink fills a Chunk with many values and then overwrites them, so
+// freed palette slots are reused and compact() can return to uniform.
+int testShrink() {
+  Chunk c;
+  std::vector<Block> want(Chunk::volume, voxel::air);
+  for (uint32_t i = 0; i < Chunk::volume; i++) {
+    want[i] = (Block)(i % 300 + 1);
+    c.setI(i, want[i]);
+  }
+  if (check(c, want, "testShrink fill") || c.paletteSize() != 300) {
+    return 1;
+  }
+  for (uint32_t i = 0; i < Chunk::volume; i++) {
+    want[i] = (Block)(i % 3);
+    c.setI(i, want[i]);
+  }
+  if (check(c, want, "testShrink overwrite") || c.paletteSize() != 3) {
+    fprintf(stderr, "testShrink: palette %zu want 3\n", c.paletteSize());
+    return 1;
+  }
+  const size_t before = c.memoryUsage();
+  c.compact();
+  if (check(c, want, "testShrink compact") || c.memoryUsage() >= before) {
+    fprintf(stderr, "testShrink: compact used %zu bytes, before %zu\n",
+            c.memoryUsage(), before);
+    return 1;
+  }
+  for (uint32_t i = 0; i < Chunk::volume; i++) {
+    c.setI(i, 7);
+  }
+  c.compact();
+  if (!c.isUniform() || c.getI(123) != 7) {
+    fprintf(stderr, "testShrink: not uniform after compact\n");
+    return 1;
+  }
+  return 0;
+}
+
+int testWorld() {
+  voxel::World world;
+  for (int32_t x = -40; x < 40; x += 3) {
+    world.set(x, -x, 2 * x, (Block)(x + 100));
+  }
+  for (int32_t x = -40; x < 40; x += 3) {
+    if (world.get(x, -x, 2 * x) != (Block)(x + 100) ||
+        world.get(x + 1, -x, 2 * x) != voxel::air) {
+      fprintf(stderr, "testWorld: wrong block at x=%d\n", x);
+      return 1;
+    }
+  }
+  for (int32_t x = -40; x < 40; x += 3) {
+    world.set(x, -x, 2 * x, voxel::air);
+  }
+  world.compact();
+  if (!world.chunks.empty()) {
+    fprintf(stderr, "testWorld: %zu chunks left after compact\n",
+            world.chunks.size());
+    return 1;
+  }
+  return 0;
+}
+
+// randomChunk fills c and want with random voxels of kinds Block values.
+void randomChunk(Rand& r, uint32_t kinds, Chunk& c, std::vector<Block>& want) {
+  want.assign(Chunk::volume, voxel::air);
+  c.fill(voxel::air);
+  for (uint32_t n = 0; n < Chunk::volume; n++) {
+    uint32_t i = r.next() % Chunk::volume;
+    Block b = (Block)(r.next() % kinds);
+    c.setI(i, b);
+    want[i] = b;
+  }
+}
+
+int testSerialize(uint32_t kinds) {
+  Rand r;
+  Chunk c;
+  std::vector<Block> want;
+  randomChunk(r, kinds, c, want);
+  for (int compacted = 0; compacted < 2; compacted++) {
+    std::vector<uint64_t> words;
+    c.serialize(words);
+    if (words.size() > Chunk::maxSerialWords) {
+      fprintf(stderr, "testSerialize: %zu words > maxSerialWords\n",
+              words.size());
+      return 1;
+    }
+    Chunk d(7);
+    if (d.deserialize(words.data(), words.size()) ||
+        check(d, want, "testSerialize") || d.paletteSize() != c.paletteSize()) {
+      fprintf(stderr, "testSerialize(%u) failed, compacted=%d\n", kinds,
+              compacted);
+      return 1;
+    }
+    // d must be fully usable: set() and compact() rely on its counts.
+    for (uint32_t i = 0; i < Chunk::volume; i += 5) {
+      d.setI(i, 1);
+      want[i] = 1;
+    }
+    d.compact();
+    if (check(d, want, "testSerialize set")) {
+      return 1;
+    }
+    c.compact();
+    for (uint32_t i = 0; i < Chunk::volume; i += 5) {
+      c.setI(i, 1);
+    }
+  }
+  return 0;
+}
+
+// testSerializeCorrupt checks that deserialize rejects words that would make
+// getI() read outside the palette, and ignores wrong counts.
+int testSerializeCorrupt() {
+  Chunk c;
+  for (uint32_t i = 0; i < Chunk::volume; i++) {
+    c.setI(i, (Block)(i % 3));  // 3 entries with 2-bit indices.
+  }
+  std::vector<uint64_t> words;
+  c.serialize(words);
+  Chunk d;
+
+  // An index of 3 is inside 2 bits but outside the palette.
+  std::vector<uint64_t> bad(words);
+  bad.back() = ~0ull;
+  if (!d.deserialize(bad.data(), bad.size())) {
+    fprintf(stderr, "testSerializeCorrupt: index past palette accepted\n");
+    return 1;
+  }
+  // A truncated chunk and a bad header.
+  if (!d.deserialize(words.data(), words.size() - 1) ||
+      !d.deserialize(words.data(), 0)) {
+    fprintf(stderr, "testSerializeCorrupt: truncated chunk accepted\n");
+    return 1;
+  }
+  bad = words;
+  bad[0] |= (uint64_t)0xffff << 16;  // Palette size does not fit indexBits.
+  if (!d.deserialize(bad.data(), bad.size())) {
+    fprintf(stderr, "testSerializeCorrupt: bad header accepted\n");
+    return 1;
+  }
+  // Wrong counts are recomputed from the indices. The counts start after
+  // the 3 Block values of the palette, 6 bytes into word 1.
+  bad = words;
+  bad[1] |= 0xffffull << 48;
+  bad[2] = 0;
+  if (d.deserialize(bad.data(), bad.size())) {
+    fprintf(stderr, "testSerializeCorrupt: wrong counts rejected\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < Chunk::volume; i++) {
+    if (i % 3 == 2) {
+      d.setI(i, 0);
+    }
+  }
+  d.compact();
+  if (d.paletteSize() != 2 || d.getI(1) != 1 || d.getI(2) != 0) {
+    fprintf(stderr, "testSerializeCorrupt: counts not recomputed\n");
+    return 1;
+  }
+  return 0;
+}
+
+// tmpDir makes a new directory for region files.
+std::string tmpDir() {
+  char dir[] = "/tmp/voxel_test.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return "";
+  }
+  return dir;
+}
+
+// removeDir removes the files in dir that testRegion creates, then dir.
+void removeDir(const std::string& dir, const std::string& filename) {
+  unlink(filename.c_str());
+  unlink((filename + ".tmp").c_str());
+  rmdir(dir.c_str());
+}
+
+int testRegion() {
+  std::string dir = tmpDir();
+  if (dir.empty()) {
+    return 1;
+  }
+  std::string filename = dir + "/r.v0r";
+  Rand r;
+  const uint32_t kinds[] = {1, 2, 3, 17, 300};
+  std::vector<Block> want[Region::size];
+  {
+    voxel::Region region;
+    if (region.open(filename.c_str(), true /*create*/)) {
+      return 1;
+    }
+    // Save each chunk many times so the file has garbage to compact.
+    for (int round = 0; round < 20; round++) {
+      for (int32_t x = 0; x < Region::size; x++) {
+        Chunk c;
+        randomChunk(r, kinds[x % 5], c, want[x]);
+        if (region.save(voxel::ChunkPos{x, 1, 2}, c)) {
+          return 1;
+        }
+      }
+    }
+    if (!region.needsCompact() || region.compact() ||
+        region.fileBytes != region.liveBytes) {
+      fprintf(stderr, "testRegion: compact failed\n");
+      return 1;
+    }
+    if (region.remove(voxel::ChunkPos{0, 1, 2})) {
+      return 1;
+    }
+  }
+  voxel::Region region;
+  if (region.open(filename.c_str(), false /*create*/)) {
+    return 1;
+  }
+  for (int32_t x = 0; x < Region::size; x++) {
+    voxel::ChunkPos pos{x, 1, 2};
+    if (region.has(pos) != (x != 0)) {
+      fprintf(stderr, "testRegion: has(%d) is wrong\n", x);
+      return 1;
+    }
+    Chunk c;
+    if (x && (region.load(pos, c) || check(c, want[x], "testRegion"))) {
+      fprintf(stderr, "testRegion: load(%d) failed\n", x);
+      return 1;
+    }
+  }
+  removeDir(dir, filename);
+  return 0;
+}
+
+// testRegionCorrupt damages a region file and checks that load() fails
+// instead of reading past the payload or the palette.
+int testRegionCorrupt() {
+  std::string dir = tmpDir();
+  if (dir.empty()) {
+    return 1;
+  }
+  std::string filename = dir + "/r.v0r";
+  // These must match region.cpp.
+  const uint64_t tableAt = 16;
+  const uint64_t entryBytes = 16;
+  const uint64_t payloadsAt = tableAt + Region::count * entryBytes;
+  const voxel::ChunkPos pos{0, 0, 0};  // Table entry 0.
+  Rand r;
+  {
+    voxel::Region region;
+    Chunk c;
+    std::vector<Block> want;
+    randomChunk(r, 3, c, want);
+    if (region.open(filename.c_str(), true /*create*/) ||
+        region.save(pos, c)) {
+      return 1;
+    }
+  }
+  int fd = open(filename.c_str(), O_RDWR);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return 1;
+  }
+  std::vector<char> good(lseek(fd, 0, SEEK_END));
+  if (pread(fd, good.data(), good.size(), 0) != (ssize_t)good.size()) {
+    perror("pread");
+    close(fd);
+    return 1;
+  }
+  int failed = 0;
+  // A huge rawWords must fail before it is used to reserve memory.
+  uint32_t rawWords = ~0u;
+  if (pwrite(fd, &rawWords, sizeof(rawWords), tableAt + 12) < 0) {
+    failed = 1;
+  }
+  voxel::Region region;
+  Chunk c;
+  if (region.open(filename.c_str(), false /*create*/) ||
+      !region.load(pos, c)) {
+    fprintf(stderr, "testRegionCorrupt: huge rawWords accepted\n");
+    failed = 1;
+  }
+  // Flip random payload words. load() may succeed if the flip lands in the
+  // palette, but must never read out of bounds.
+  const size_t payloadWords = (good.size() - payloadsAt) / 8;
+  for (int n = 0; n < 500 && !failed; n++) {
+    std::vector<char> bad(good);
+    uint64_t* w = (uint64_t*)&bad[payloadsAt];
+    for (int k = 0; k < 3; k++) {
+      w[r.next() % payloadWords] ^= (uint64_t)r.next() << (r.next() % 33);
+    }
+    if (pwrite(fd, bad.data(), bad.size(), 0) != (ssize_t)bad.size() ||
+        region.open(filename.c_str(), false /*create*/)) {
+      failed = 1;
+      break;
+    }
+    if (!region.load(pos, c)) {
+      // A Chunk that loads must be consistent.
+      c.compact();
+    }
+  }
+  close(fd);
+  removeDir(dir, filename);
+  return failed;
+}
+
+}  // anonymous namespace
+
+int main() {
+  for (uint32_t kinds : {1, 2, 3, 4, 5, 16, 17, 200, 256, 257, 5000}) {
+    if (testRandom(kinds)) {
+      return 1;
+    }
+  }
+  if (testShrink() || testWorld()) {
+    return 1;
+  }
+  for (uint32_t kinds : {1, 2, 3, 16, 17, 256, 257, 5000}) {
+    if (testSerialize(kinds)) {
+      return 1;
+    }
+  }
+  if (testSerializeCorrupt() || testRegion() || testRegionCorrupt()) {
+    return 1;
+  }
+  printf("voxel_test: pass\n");
+  return 0;
+}
@@ -0,0 +1,48 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "voxel.h"
+
+namespace voxel {
+
+void World::set(int32_t x, int32_t y, int32_t z, Block b) {
+  ChunkPos pos = posOf(x, y, z);
+  Chunk* c = find(pos);
+  if (!c) {
+    if (b == air) {
+      return;  // Do not create a Chunk just to store air.
+    }
+    c = &at(pos);
+  }
+  c->set(localOf(x), localOf(y), localOf(z), b);
+}
+
+Chunk& World::at(const ChunkPos& pos) {
+  auto& c = chunks[pos];
+  if (!c) {
+    c.reset(new Chunk());
+  }
+  return *c;
+}
+
+void World::compact() {
+  for (auto i = chunks.begin(); i != chunks.end();) {
+    Chunk& c = *i->second;
+    c.compact();
+    if (c.isUniform() && c.get(0, 0, 0) == air) {
+      i = chunks.erase(i);
+    } else {
+      i++;
+    }
+  }
+}
+
+size_t World::memoryUsage() const {
+  size_t n = sizeof(*this) + chunks.bucket_count() * sizeof(void*);
+  for (auto& kv : chunks) {
+    // Each hash map node holds the key, the unique_ptr, and a next pointer.
+    n += sizeof(kv) + sizeof(void*) + kv.second->memoryUsage();
+  }
+  return n;
+}
+
+}  // namespace voxel
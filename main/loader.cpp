@@ -0,0 +1,135 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ */
+#include "main/loader.h"
+
+#include <lib/science/science.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "SkCodec.h"
+#include "SkData.h"
+#include "SkImageInfo.h"
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+typedef std::chrono::high_resolution_clock Clock;
+
+double msSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+}  // anonymous namespace
+
+int TextureLoader::load(const std::vector<std::string>& filenames) {
+  auto start = Clock::now();
+  files.clear();
+  files.resize(filenames.size());
+  if (files.empty()) {
+    fprintf(stderr, "TextureLoader::load: no files\n");
+    return 1;
+  }
+  std::vector<std::unique_ptr<SkCodec>> codecs(files.size());
+
+  // Read every file and its header, which gives its size in stage.
+  if (jobs.parallelFor(files.size(), 1, [&](size_t begin, size_t end) -> int {
+        for (size_t i = begin; i < end; i++) {
+          auto t = Clock::now();
+          File& file = files.at(i);
+          file.filename = filenames.at(i);
+          sk_sp<SkData> data = SkData::MakeFromFileName(file.filename.c_str());
+          if (!data) {
+            fprintf(stderr, "TextureLoader: unable to read \"%s\"\n",
+                    file.filename.c_str());
+            return 1;
+          }
+          std::unique_ptr<SkCodec> codec(SkCodec::MakeFromData(data));
+          codecs.at(i) = std::move(codec);
+          if (!codecs.at(i)) {
+            fprintf(stderr, "TextureLoader: \"%s\" is not an image\n",
+                    file.filename.c_str());
+            return 1;
+          }
+          file.width = codecs.at(i)->getInfo().width();
+          file.height = codecs.at(i)->getInfo().height();
+          file.readMs = msSince(t);
+        }
+        return 0;
+      })) {
+    return 1;
+  }
+
+  // copyBufferToImage needs each offset to be a multiple of 4, and is fastest
+  // at optimalBufferCopyOffsetAlignment.
+  VkDeviceSize align =
+      std::max(dev.physProp.limits.optimalBufferCopyOffsetAlignment,
+               (VkDeviceSize)4);
+  VkDeviceSize size = 0;
+  for (auto& file : files) {
+    file.offset = size;
+    size += (VkDeviceSize)file.width * file.height * 4;
+    size = (size + align - 1) / align * align;
+  }
+  stage.info.size = size;
+  if (stage.ctorHostCoherent(dev) || stage.bindMemory(dev) ||
+      stage.mem.mapPersistent(dev)) {
+    fprintf(stderr, "TextureLoader: stage failed\n");
+    return 1;
+  }
+
+  // Decode straight into stage.
+  char* mapped = (char*)stage.mem.mapped;
+  if (jobs.parallelFor(files.size(), 1, [&](size_t begin, size_t end) -> int {
+        for (size_t i = begin; i < end; i++) {
+          auto t = Clock::now();
+          File& file = files.at(i);
+          SkImageInfo dstInfo =
+              SkImageInfo::Make(file.width, file.height, kRGBA_8888_SkColorType,
+                                kPremul_SkAlphaType);
+          SkCodec::Result r = codecs.at(i)->getPixels(
+              dstInfo, mapped + file.offset, file.width * 4);
+          if (r == SkCodec::kIncompleteInput) {
+            fprintf(stderr, "TextureLoader: \"%s\" is truncated\n",
+                    file.filename.c_str());
+          } else if (r != SkCodec::kSuccess) {
+            fprintf(stderr, "TextureLoader: \"%s\" decode failed: %d\n",
+                    file.filename.c_str(), (int)r);
+            return 1;
+          }
+          file.decodeMs = msSince(t);
+        }
+        return 0;
+      })) {
+    return 1;
+  }
+  if (stage.mem.flush(dev)) {
+    return 1;
+  }
+  totalMs = msSince(start);
+  return 0;
+}
+
+VkBufferImageCopy TextureLoader::region(size_t i, uint32_t layer) const {
+  const File& file = files.at(i);
+  VkBufferImageCopy r;
+  memset(&r, 0, sizeof(r));
+  r.bufferOffset = file.offset;
+  science::Subres(r.imageSubresource).addColor().setLayer(layer, 1);
+  r.imageExtent = {file.width, file.height, 1};
+  return r;
+}
+
+void TextureLoader::report(FILE* f) const {
+  double readMs = 0, decodeMs = 0;
+  for (auto& file : files) {
+    fprintf(f, "%8.2fms read %8.2fms decode %5ux%-5u %s\n", file.readMs,
+            file.decodeMs, file.width, file.height, file.filename.c_str());
+    readMs += file.readMs;
+    decodeMs += file.decodeMs;
+  }
+  fprintf(f,
+          "TextureLoader: %zu files in %.2fms (%.2fms read, %.2fms decode on "
+          "%zu threads)\n",
+          files.size(), totalMs, readMs, decodeMs, jobs.threadCount());
+}
@@ -0,0 +1,66 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * main/loader.h decodes image files into a staging Buffer for upload to
+ * the GPU. It uses Skia, which only main depends on.
+ */
+
+#include <lib/job/job.h>
+#include <lib/memory/memory.h>
+#include <string>
+
+#pragma once
+
+// TextureLoader decodes many image files in parallel on a job::Scheduler.
+// SkCodec decodes each file straight into its range of one host-visible
+// Buffer, so there is no intermediate SkImage and no extra copy before
+// copyBufferToImage.
+//
+// Example usage:
+//   TextureLoader loader(dev, jobs);
+//   if (loader.load({"grass.png", "dirt.png"})) { ... }
+//   loader.report(stderr);
+//   // Set sampler.image.info.{extent,format} from loader.files.at(0).
+//   if (sampler.ctorError(dev, builder, loader.stage, {loader.region(0)})) {
+//     ...
+//   }
+//   // loader.stage must stay valid until builder is done.
+class TextureLoader {
+ public:
+  TextureLoader(language::Device& dev, job::Scheduler& jobs)
+      : stage{dev}, dev(dev), jobs(jobs) {}
+  TextureLoader(TextureLoader&&) = delete;
+  TextureLoader(const TextureLoader&) = delete;
+
+  // File is one decoded file. Its pixels are at offset in stage, as
+  // tightly packed rows of VK_FORMAT_R8G8B8A8_UNORM.
+  typedef struct File {
+    std::string filename;
+    uint32_t width{0};
+    uint32_t height{0};
+    VkDeviceSize offset{0};
+    // readMs is the time to read the file and its header. decodeMs is the
+    // time to decode it into stage.
+    double readMs{0};
+    double decodeMs{0};
+  } File;
+
+  // load() replaces files and stage with filenames, decoded. It fails if
+  // any file cannot be read or decoded.
+  WARN_UNUSED_RESULT int load(const std::vector<std::string>& filenames);
+
+  // region returns the VkBufferImageCopy that copies files.at(i) from stage
+  // to mip level 0 of layer i of an Image.
+  VkBufferImageCopy region(size_t i, uint32_t layer = 0) const;
+
+  // report prints the time of each file and the total.
+  void report(FILE* f) const;
+
+  std::vector<File> files;
+  // stage holds the pixels of every file, one after another.
+  memory::Buffer stage;
+  // totalMs is the wall-clock time of the last load().
+  double totalMs{0};
+
+  language::Device& dev;
+  job::Scheduler& jobs;
+};
@@ -4,6 +4,7 @@
 
 #include <GLFW/glfw3.h>
 #include <lib/command/command.h>
+#include <lib/job/job.h>
 #include <lib/language/VkInit.h>
 #include <lib/language/VkPtr.h>
 #include <lib/language/language.h>
@@ -20,14 +21,11 @@
 #include "main/main.frag.h"
 #include "main/main.vert.h"
 
-#include "SkCanvas.h"
-#include "SkData.h"
-#include "SkImage.h"
-#include "SkImageInfo.h"
-#include "SkRefCnt.h"
+#include "main/loader.h"
 
 #include <array>
 #include <chrono>
+#include <errno.h>
 
 // TODO: change vsync on the fly (and it must work the same at init time)
 // TODO: show how to use SDL, xcb
@@ -37,7 +35,6 @@
 //   TODO: switch VK_PRESENT_MODE_MAILBOX_KHR on the fly
 //   TODO: specify an ordering of preferred present modes
 //   TODO: permit customization of the enabled instance layers.
-//   TODO: mipmapping
 //
 // TODO: show how to do GPU compute
 // TODO: passes, subpasses, secondary command buffers, and subpass dependencies
@@ -105,23 +102,46 @@ class SimplePipeline : public science::SwapChainResizeObserver {
   command::RenderPass pass;
   command::CommandPool cpool;
   command::CommandBuilder builder;
+  // parallel records the draw commands for builder on worker threads.
+  command::ParallelBuilder parallel;
   science::SwapChainResizeList resizeList;
+  // frames keeps 2 frames in flight: the CPU records frame N+1 while the GPU
+  // renders N.
+  science::FrameScheduler frames;
+  // offscreen replaces the swapChain if the device is headless.
+  science::OffscreenTarget offscreen;
 
   SimplePipeline(language::Instance& instance,
                  language::SurfaceSupport queueFamily)
       : pass(instance.at(0)),
         cpool(instance.at(0), queueFamily),
         builder(cpool),
-        resizeList(instance) {
+        parallel(instance.at(0), queueFamily),
+        resizeList(instance),
+        frames(instance.at(0)),
+        offscreen(instance.at(0)) {
     startTime = std::chrono::high_resolution_clock::now();
   };
 
+  // ctorError sets up SimplePipeline. window is nullptr if headless.
   int ctorError(GLFWwindow* window) {
-    if (cpool.ctorError(cpool.dev, 0)) {
+    if (cpool.ctorError(cpool.dev, 0) || parallel.ctorError()) {
       return 1;
     }
-    glfwSetWindowUserPointer(window, this);
-    glfwSetWindowSizeCallback(window, windowResized);
+    if (cpool.dev.headless) {
+      // 2 framebufs, so the CPU can record one while the GPU renders the other.
+      if (offscreen.ctorError(2)) {
+        return 1;
+      }
+    } else {
+      // A resize only needs to wait for the frames in flight.
+      if (frames.ctorError(2) ||
+          resizeList.replace(&resizeList.resizeDeviceWaitIdle, &frames)) {
+        return 1;
+      }
+      glfwSetWindowUserPointer(window, this);
+      glfwSetWindowSizeCallback(window, windowResized);
+    }
 
     if (buildUniform()) {
       return 1;
@@ -148,7 +168,9 @@ class SimplePipeline : public science::SwapChainResizeObserver {
   unsigned frameCount = 0;
   int timeDelta = 0;
 
-  int updateUniformBuffer() {
+  // updateUniformBuffer writes the UniformRing slice for framebuffer frameI.
+  // The GPU may still be reading the slices of other framebuffers.
+  int updateUniformBuffer(uint32_t frameI) {
     auto currentTime = std::chrono::high_resolution_clock::now();
     float time = std::chrono::duration_cast<std::chrono::milliseconds>(
                      currentTime - startTime)
@@ -182,58 +204,68 @@ class SimplePipeline : public science::SwapChainResizeObserver {
     // https://www.khronos.org/registry/vulkan/specs/1.0/html/vkspec.html#vertexpostproc-clipping
     ubo.proj[1][1] *= -1;
 
-    if (uniform.copy(cpool, &ubo, sizeof(ubo))) {
+    // FrameScheduler::acquire already waited for the GPU to finish with
+    // frameI, so its uniform slice is free.
+    if (uniform.select(frameI) || uniform.write(cpool.dev, ubo)) {
       return 1;
     }
     return 0;
   };
 
+  // allocator must be declared before (and thus outlive) the buffers that use
+  // it.
+  memory::DeviceMemoryAllocator allocator{cpool.dev};
+  // uniform has one slice per framebuffer.
+  memory::UniformRing uniform{cpool.dev};
+  // pipelineCache is loaded from and saved to pipelineCacheFilename.
+  command::PipelineCache pipelineCache{cpool.dev};
+  const char* pipelineCacheFilename = "v.pipelinecache";
+  // profiler measures GPU time of the render pass, one slot per framebuffer.
+  command::GpuProfiler profiler{cpool.dev};
+  size_t passScope{0};
+
  protected:
   science::ShaderLibrary shaders{cpool.dev};
   science::DescriptorLibrary descriptorLibrary{cpool.dev};
   std::unique_ptr<memory::DescriptorSet> descriptorSet;
-  memory::UniformBuffer uniform{cpool.dev};
   memory::Buffer vertexBuffer{cpool.dev};
   memory::Buffer indexBuffer{cpool.dev};
+  // jobs does the staging memcpys of transfer on worker threads. It must
+  // outlive transfer.
+  job::Scheduler jobs;
+  // transfer uploads vertexBuffer and indexBuffer.
+  memory::TransferQueue transfer{cpool.dev};
   memory::Sampler textureSampler{cpool.dev};
   std::unique_ptr<science::PipeBuilder> pipe0;
 
   // buildUniform builds the uniform buffers, descriptor sets, and other
   // objects needed during startup.
   int buildUniform() {
-    void* mappedMem;
     language::Device& dev = cpool.dev;
-
-    {
-      memory::Buffer stagingBuffer{dev};
-      vertexBuffer.info.size = stagingBuffer.info.size =
-          sizeof(vertices[0]) * vertices.size();
-      vertexBuffer.info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-
-      if (stagingBuffer.ctorHostCoherent(dev) ||
-          stagingBuffer.bindMemory(dev) ||
-          stagingBuffer.copyFromHost(dev, vertices) ||
-          vertexBuffer.ctorDeviceLocal(dev) || vertexBuffer.bindMemory(dev) ||
-          vertexBuffer.copy(cpool, stagingBuffer)) {
-        return 1;
-      }
-    }
-    {
-      memory::Buffer stagingBuffer{dev};
-      indexBuffer.info.size = stagingBuffer.info.size =
-          sizeof(indices[0]) * indices.size();
-      indexBuffer.info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-
-      if (stagingBuffer.ctorHostCoherent(dev) ||
-          stagingBuffer.bindMemory(dev) ||
-          stagingBuffer.copyFromHost(dev, indices) ||
-          indexBuffer.ctorDeviceLocal(dev) || indexBuffer.bindMemory(dev) ||
-          indexBuffer.copy(cpool, stagingBuffer)) {
-        return 1;
-      }
+    vertexBuffer.suballocator = &allocator;
+    indexBuffer.suballocator = &allocator;
+    uniform.suballocator = &allocator;
+
+    // Start the vertexBuffer and indexBuffer uploads. They run while the
+    // texture is decoded below, and are acquired by the setup commands.
+    vertexBuffer.info.size = sizeof(vertices[0]) * vertices.size();
+    vertexBuffer.info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    indexBuffer.info.size = sizeof(indices[0]) * indices.size();
+    indexBuffer.info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+    uint64_t uploaded;
+    transfer.jobs = &jobs;
+    if (jobs.ctorError() || vertexBuffer.ctorDeviceLocal(dev) ||
+        vertexBuffer.bindMemory(dev) || indexBuffer.ctorDeviceLocal(dev) ||
+        indexBuffer.bindMemory(dev) ||
+        transfer.ctorError(dev) || transfer.copy(vertexBuffer, vertices) ||
+        transfer.copy(indexBuffer, indices) || transfer.flush(&uploaded)) {
+      return 1;
     }
 
-    if (uniform.ctorError(dev, sizeof(UniformBufferObject))) {
+    if (uniform.ctorError(dev, sizeof(UniformBufferObject),
+                          dev.framebufs.size()) ||
+        profiler.ctorError(language::GRAPHICS, dev.framebufs.size()) ||
+        profiler.addScope("main pass", passScope)) {
       return 1;
     }
 
@@ -242,75 +274,28 @@ class SimplePipeline : public science::SwapChainResizeObserver {
     // https://skia.googlesource.com/skia/+/master/src/gpu/vk/GrVkImage.h
     // as an alternate way to create a textureSampler.
     //
-    // TODO: use SkCodec instead of SkImage
-
-    sk_sp<SkData> data = SkData::MakeFromFileName(img_filename);
-    if (!data) {
-      fprintf(stderr, "   unable to read image \"%s\"\n", img_filename);
-      return 1;
-    }
-    sk_sp<SkImage> img = SkImage::MakeFromEncoded(data);
-    if (!img) {
-      // TODO: get exact error message from skia.
-      fprintf(stderr, "   unable to decode image \"%s\"\n", img_filename);
-      return 1;
-    }
-    VkExtent3D extent = {1, 1, 1};
-    extent.width = img->width();
-    extent.height = img->height();
-
-    // TODO: Use a VkBuffer instead:
-    // http://xlgames-inc.github.io/posts/vulkantips/
-    // TODO: can the GPU create the mip levels from a non-mipmapped image?
-    memory::Image stagingImage(dev);
-    stagingImage.info.extent = extent;
-    stagingImage.info.format = VK_FORMAT_R8G8B8A8_UNORM;
-    if (stagingImage.ctorHostCoherent(dev) || stagingImage.bindMemory(dev)) {
-      fprintf(stderr, "stagingImage.ctorError or bindMemory failed\n");
+    // loader decodes img_filename into loader.stage on the worker threads,
+    // and textureSampler.ctorError() copies it with copyBufferToImage.
+    TextureLoader loader(dev, jobs);
+    if (loader.load({img_filename})) {
       return 1;
     }
-
-    VkImageSubresource subresource = {};
-    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    subresource.mipLevel = 0;
-    subresource.arrayLayer = 0;
-
-    VkSubresourceLayout stagingImageLayout;
-    {
-      // NOTE: vkGetImageSubresourceLayout is only valid for an image with
-      // LINEAR tiling.
-      //
-      // Vulkan Spec: "The layout of a subresource (mipLevel/arrayLayer) of an
-      // image created with linear tiling is queried by calling
-      // vkGetImageSubresourceLayout".
-      vkGetImageSubresourceLayout(dev.dev, stagingImage.vk, &subresource,
-                                  &stagingImageLayout);
-    }
-
-    if (stagingImage.mem.mmap(dev, &mappedMem)) {
-      fprintf(stderr, "stagingImageMemory.mmap() failed\n");
-      return 1;
-    }
-    SkImageInfo dstInfo =
-        SkImageInfo::Make(img->width(), img->height(), kRGBA_8888_SkColorType,
-                          kPremul_SkAlphaType);
-    if (!img->readPixels(dstInfo, mappedMem, stagingImageLayout.rowPitch, 0,
-                         0)) {
-      fprintf(stderr, "SkImage::readPixels() failed\n");
-      stagingImage.mem.munmap(dev);
-      return 1;
-    }
-    stagingImage.mem.munmap(dev);
+    loader.report(stderr);
+    textureSampler.image.info.extent = {loader.files.at(0).width,
+                                        loader.files.at(0).height, 1};
+    textureSampler.image.info.format = VK_FORMAT_R8G8B8A8_UNORM;
 
     textureSampler.info.magFilter = VK_FILTER_LINEAR;
     textureSampler.info.minFilter = VK_FILTER_LINEAR;
     textureSampler.info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    // textureSampler.ctorError() generates the mip levels on the GPU.
 
     command::CommandBuilder setup(cpool);
     if (setup.beginOneTimeUse()) {
       return 1;
     }
-    if (textureSampler.ctorError(dev, setup, stagingImage)) {
+    if (textureSampler.ctorError(dev, setup, loader.stage,
+                                 {loader.region(0)})) {
       fprintf(stderr, "sampler.copyFrom failed\n");
       return 1;
     }
@@ -320,6 +305,8 @@ class SimplePipeline : public science::SwapChainResizeObserver {
       return 1;
     }
     pipe0.reset(new science::PipeBuilder(dev, pass));
+    // A resize then only updates the viewport that recordDraws sets.
+    pipe0->dynamicViewport();
 
     // pipe0 should be first in resizeList. SimplePipeline assumes
     // Framebuffer attachments are already correctly resized when its
@@ -336,7 +323,8 @@ class SimplePipeline : public science::SwapChainResizeObserver {
         pipe0->addVertexInput<Vertex>(Vertex::getAttributes())) {
       return 1;
     }
-    if (setup.end() || setup.submit(0)) {
+    if (transfer.wait(uploaded) || transfer.acquire(setup) || setup.end() ||
+        setup.submit(0)) {
       return 1;
     }
     vkQueueWaitIdle(cpool.q(0));
@@ -351,6 +339,7 @@ class SimplePipeline : public science::SwapChainResizeObserver {
     if (!vshader || !fshader ||
         shaders.stage(pass, *pipe0, VK_SHADER_STAGE_VERTEX_BIT, vshader) ||
         shaders.stage(pass, *pipe0, VK_SHADER_STAGE_FRAGMENT_BIT, fshader) ||
+        shaders.makeDynamic(0 /*setI*/, 0 /*binding*/) ||
         shaders.makeDescriptorLibrary(descriptorLibrary)) {
       return 1;
     }
@@ -361,28 +350,37 @@ class SimplePipeline : public science::SwapChainResizeObserver {
       return 1;
     }
 
-    if (descriptorSet->write(0, {&uniform}) ||
+    if (descriptorSet->write(
+            0, std::vector<VkDescriptorBufferInfo>{uniform.toDescriptor()}) ||
         descriptorSet->write(1, {&textureSampler})) {
       return 1;
     }
 
-    pipe0->pipeline.info.dynamicStates.emplace_back(VK_DYNAMIC_STATE_VIEWPORT);
-    pipe0->pipeline.info.dynamicStates.emplace_back(VK_DYNAMIC_STATE_SCISSOR);
-
+    if (pipelineCache.ctorError(dev, pipelineCacheFilename)) {
+      return 1;
+    }
+    pass.pipelineCache = &pipelineCache;
     if (pass.ctorError(dev)) {
       return 1;
     }
     return 0;
   }
 
-  // onResized rebuilds RenderPass pass. This is done once on startup, then
-  // every time the window is resized.
+  // onResized rebuilds the framebuffers and re-records the command buffers.
+  // This is done once on startup, then every time the window is resized.
+  // RenderPass pass and its Pipeline are not rebuilt.
   int onResized(language::Instance& unusedInstance, language::Device& dev,
                 command::CommandBuilder& unusedSetupCommands,
                 VkExtent2D unusedNewSize) {
     // CommandBuilder has a feature to manage several VkCommandBuffers. That
     // is particularly useful when setting up per-framebuffer commands.
-    if (builder.resize(dev.framebufs.size())) {
+    if (builder.resize(dev.framebufs.size()) ||
+        parallel.resize(dev.framebufs.size())) {
+      return 1;
+    }
+    if (dev.framebufs.size() > uniform.frames) {
+      fprintf(stderr, "onResized: %zu framebufs but uniform has %zu slices\n",
+              dev.framebufs.size(), uniform.frames);
       return 1;
     }
 
@@ -395,31 +393,48 @@ class SimplePipeline : public science::SwapChainResizeObserver {
       // (The data in passBeginInfo is copied into each distinct
       // VkCommandBuffer, so patching it like this is ok.)
       pass.passBeginInfo.framebuffer = framebuf.vk;
-
-      // Patch viewport.
-      VkViewport& viewport = pass.pipelines.at(0).info.viewports.at(0);
-      viewport.width = (float)dev.swapChainExtent.width;
-      viewport.height = (float)dev.swapChainExtent.height;
-
-      // Patch scissors.
-      pass.pipelines.at(0).info.scissors.at(0).extent = dev.swapChainExtent;
+      pass.passBeginInfo.renderArea.extent = dev.swapChainExtent;
+      // pipe0 already patched the viewport and scissor in its onResized.
 
       VkBuffer vertexBuffers[] = {vertexBuffer.vk};
       VkDeviceSize offsets[] = {0};
+      uint32_t dynamicOffset = uniform.dynamicOffset(i);
+
+      // recordDraws records the draws for work items [first, last) into a
+      // secondary command buffer. Dynamic state is not inherited from the
+      // primary, so each secondary sets its own viewport and scissor.
+      // SimplePipeline only has 1 work item. A voxel world would pass its
+      // chunk count to parallel.record() instead.
+      auto recordDraws = [&](command::CommandBuilder& b, size_t first,
+                             size_t last) -> int {
+        return b.setViewport(pass) || b.setScissor(pass) ||
+               b.bindGraphicsPipelineAndDescriptors(pipe0->pipeline, 0, 1,
+                                                    &descriptorSet->vk, 1,
+                                                    &dynamicOffset) ||
+               b.bindVertexBuffers(
+                   0, sizeof(vertexBuffers) / sizeof(vertexBuffers[0]),
+                   vertexBuffers, offsets) ||
+               b.bindAndDraw(indices, indexBuffer.vk, 0 /*indexBufOffset*/) ||
+               b.draw(3, 1, 0, 0);
+      };
 
       // Switch builder to the CommandBuilder::VkCommandBuffer[i] and rebuild
       // the VkCommandBuffer.
       builder.use(i);
-      if (builder.beginSimultaneousUse() || builder.setViewport(pass) ||
-          builder.setScissor(pass) || builder.beginPrimaryPass(pass) ||
-          builder.bindGraphicsPipelineAndDescriptors(pipe0->pipeline, 0, 1,
-                                                     &descriptorSet->vk) ||
-          builder.bindVertexBuffers(
-              0, sizeof(vertexBuffers) / sizeof(vertexBuffers[0]),
-              vertexBuffers, offsets) ||
-          builder.bindAndDraw(indices, indexBuffer.vk, 0 /*indexBufOffset*/) ||
-          builder.draw(3, 1, 0, 0) || builder.endRenderPass() ||
-          builder.end()) {
+      if (builder.beginSimultaneousUse() || profiler.reset(builder, i)) {
+        fprintf(stderr, "build: failed to recreate command buffer %zu\n", i);
+        return 1;
+      }
+      {
+        command::GpuProfiler::Scope scope(profiler, builder, i, passScope);
+        if (builder.beginSecondaryPass(pass) ||
+            parallel.record(builder, pass, i, 1 /*workCount*/, recordDraws) ||
+            builder.endRenderPass()) {
+          fprintf(stderr, "build: failed to record render pass %zu\n", i);
+          return 1;
+        }
+      }
+      if ((dev.headless && offscreen.readback(builder, i)) || builder.end()) {
         fprintf(stderr, "build: failed to recreate command buffer %zu\n", i);
         return 1;
       }
@@ -435,44 +450,43 @@ int mainLoop(GLFWwindow* window, SimplePipeline& simple) {
     return 1;
   }
 
-  command::Semaphore imageAvailableSemaphore(simple.cpool.dev);
-  if (imageAvailableSemaphore.ctorError(simple.cpool.dev)) {
-    return 1;
-  }
-  command::PresentSemaphore renderSemaphore(simple.cpool.dev);
-  if (renderSemaphore.ctorError()) {
-    return 1;
-  }
-
+  science::FrameScheduler& frames = simple.frames;
   while (!glfwWindowShouldClose(window)) {
     glfwPollEvents();
-    if (simple.updateUniformBuffer()) {
-      return 1;
-    }
 
     uint32_t next_image_i;
-    VkResult v = vkAcquireNextImageKHR(
-        simple.cpool.dev.dev, simple.cpool.dev.swapChain,
-        std::numeric_limits<uint64_t>::max(), imageAvailableSemaphore.vk,
-        VK_NULL_HANDLE, &next_image_i);
-    if (v != VK_SUCCESS && v != VK_SUBOPTIMAL_KHR) {
-      if (v == VK_ERROR_OUT_OF_DATE_KHR) {
-        fprintf(stderr, "vkAcquireNextImageKHR: OUT_OF_DATE\n");
-        SimplePipeline::windowResized(window,
-                                      simple.cpool.dev.swapChainExtent.width,
-                                      simple.cpool.dev.swapChainExtent.height);
-        continue;
-      }
-      fprintf(stderr, "vkAcquireNextImageKHR returned error\n");
+    bool outOfDate;
+    if (frames.acquire(next_image_i, outOfDate)) {
+      return 1;
+    }
+    if (outOfDate) {
+      fprintf(stderr, "vkAcquireNextImageKHR: OUT_OF_DATE\n");
+      SimplePipeline::windowResized(window,
+                                    simple.cpool.dev.swapChainExtent.width,
+                                    simple.cpool.dev.swapChainExtent.height);
+      continue;
+    }
+    // acquire waited for the last frame that used next_image_i, so its GPU
+    // timestamps are ready.
+    if (simple.profiler.collect(next_image_i) ||
+        simple.updateUniformBuffer(next_image_i)) {
       return 1;
     }
     simple.builder.use(next_image_i);
-    if (simple.builder.submit(0, {imageAvailableSemaphore.vk},
-                              {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT},
-                              {renderSemaphore.vk}) ||
-        renderSemaphore.present(next_image_i)) {
+    if (frames.submitAndPresent(simple.builder, next_image_i)) {
       return 1;
     }
+    simple.profiler.markSubmitted(next_image_i);
+    if (frames.frameCount >= 600) {
+      fprintf(stderr, "avg CPU wait %.3f ms/frame\n",
+              frames.totalWaitNanos / 1e6 / frames.frameCount);
+      frames.totalWaitNanos = 0;
+      frames.frameCount = 0;
+      for (auto& scope : simple.profiler.stats) {
+        fprintf(stderr, "GPU %s: avg %.3f ms, max %.3f ms\n",
+                scope.name.c_str(), scope.mean(), scope.max());
+      }
+    }
   }
 
   VkResult v = vkDeviceWaitIdle(simple.cpool.dev.dev);
@@ -480,9 +494,102 @@ int mainLoop(GLFWwindow* window, SimplePipeline& simple) {
     fprintf(stderr, "vkDeviceWaitIdle returned %d\n", v);
     return 1;
   }
+  return simple.pipelineCache.save(simple.cpool.dev);
+}
+
+// writePPM writes the RGBA pixels as a binary PPM image.
+int writePPM(const char* filename, VkExtent2D size,
+             const std::vector<uint8_t>& rgba) {
+  FILE* f = fopen(filename, "wb");
+  if (!f) {
+    fprintf(stderr, "fopen(%s) failed: %d %s\n", filename, errno,
+            strerror(errno));
+    return 1;
+  }
+  fprintf(f, "P6\n%u %u\n255\n", size.width, size.height);
+  for (size_t i = 0; i + 4 <= rgba.size(); i += 4) {
+    fwrite(&rgba.at(i), 1, 3, f);
+  }
+  if (fclose(f)) {
+    fprintf(stderr, "fclose(%s) failed: %d %s\n", filename, errno,
+            strerror(errno));
+    return 1;
+  }
   return 0;
 }
 
+// headlessLoop renders frameCount frames with no window, then writes the
+// last frame to v.ppm. This is for benchmarks and automated tests under
+// lavapipe or SwiftShader.
+int headlessLoop(SimplePipeline& simple, size_t frameCount) {
+  if (simple.ctorError(nullptr)) {
+    return 1;
+  }
+  language::Device& dev = simple.cpool.dev;
+
+  // One fence per framebuf. Each starts out signalled.
+  std::vector<command::Fence> fences;
+  fences.reserve(dev.framebufs.size());
+  for (size_t i = 0; i < dev.framebufs.size(); i++) {
+    fences.emplace_back(dev);
+    if (fences.back().ctorError(dev, VK_FENCE_CREATE_SIGNALED_BIT)) {
+      return 1;
+    }
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  size_t i = 0;
+  for (size_t frame = 0; frame < frameCount; frame++) {
+    i = frame % fences.size();
+    auto& fence = fences.at(i);
+    if (fence.wait(dev) || simple.profiler.collect(i) ||
+        simple.updateUniformBuffer(i) || fence.reset(dev)) {
+      return 1;
+    }
+    simple.builder.use(i);
+    if (simple.builder.submit(0, {}, {}, {}, fence.vk)) {
+      return 1;
+    }
+    simple.profiler.markSubmitted(i);
+  }
+  for (auto& fence : fences) {
+    if (fence.wait(dev)) {
+      return 1;
+    }
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::high_resolution_clock::now() - start)
+                     .count();
+  fprintf(stderr, "headless: %zu frames in %.3f ms (%.3f ms/frame)\n",
+          frameCount, elapsed / 1e3, elapsed / 1e3 / frameCount);
+  for (auto& scope : simple.profiler.stats) {
+    fprintf(stderr, "GPU %s: avg %.3f ms, max %.3f ms\n", scope.name.c_str(),
+            scope.mean(), scope.max());
+  }
+
+  std::vector<uint8_t> rgba;
+  if (simple.offscreen.read(i, rgba) ||
+      writePPM("v.ppm", dev.swapChainExtent, rgba)) {
+    return 1;
+  }
+  return simple.pipelineCache.save(dev);
+}
+
+// runHeadless opens a headless language::Instance: no window or surface.
+int runHeadless(VkExtent2D size) {
+  language::Instance inst;
+  if (inst.ctorError(nullptr, 0, nullptr, nullptr) || inst.open(size)) {
+    return 1;
+  }
+  if (!inst.devs_size()) {
+    fprintf(stderr, "BUG: no devices created\n");
+    return 1;
+  }
+  auto simple = std::unique_ptr<SimplePipeline>(
+      new SimplePipeline(inst, language::GRAPHICS));
+  return headlessLoop(*simple, 600);
+}
+
 // Wrap glfwCreateWindowSurface so language::Instance inst can call it.
 VkResult createWindowSurface(language::Instance& inst, void* window) {
   return glfwCreateWindowSurface(inst.vk, (GLFWwindow*)window, inst.pAllocator,
@@ -530,10 +637,14 @@ int runGLFW() {
 }  // anonymous namespace
 
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s filename\n", argv[0]);
+  bool headless = argc == 3 && !strcmp(argv[1], "-headless");
+  if (argc != 2 && !headless) {
+    fprintf(stderr, "usage: %s [-headless] filename\n", argv[0]);
     return 1;
   }
-  img_filename = argv[1];
+  img_filename = argv[argc - 1];
+  if (headless) {
+    return runHeadless({800, 600});
+  }
   return runGLFW();
 }
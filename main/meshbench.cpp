@@ -0,0 +1,264 @@
+/* Copyright (c) David Hubbard 2017. Licensed under the GPLv3.
+ *
+ * meshbench generates a voxel world and meshes every chunk in it, to
+ * measure voxel::Mesher throughput in chunks/sec. It runs every SimdPath
+ * on terrain and on random noise, and fails if any path does not produce
+ * the same meshes as the scalar path.
+ *
+ * World generation and the last benchmark run on every core, using
+ * lib/job.
+ */
+#include <lib/job/job.h>
+#include <lib/voxel/mesh.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <functional>
+
+namespace {  // an anonymous namespace hides its contents outside this file
+
+const voxel::Block stone = 1;
+const voxel::Block dirt = 2;
+const voxel::Block grass = 3;
+const voxel::Block ore = 4;
+
+// hash3 is a cheap deterministic hash, used for caves and ore.
+uint32_t hash3(int32_t x, int32_t y, int32_t z) {
+  uint32_t h = (uint32_t)x * 374761393u + (uint32_t)y * 668265263u +
+               (uint32_t)z * 2147483647u;
+  h = (h ^ (h >> 13)) * 1274126177u;
+  return h ^ (h >> 16);
+}
+
+// fillTerrain fills c, the Chunk at pos, with rolling hills, caves, and
+// ore. height is the height of the world in voxels.
+void fillTerrain(voxel::Chunk& c, const voxel::ChunkPos& pos, int32_t height) {
+  const int32_t n = voxel::Chunk::size;
+  for (int32_t z = 0; z < n; z++) {
+    for (int32_t x = 0; x < n; x++) {
+      int32_t wx = pos.x * n + x, wz = pos.z * n + z;
+      int32_t top = height / 2 + (int32_t)(height / 6 *
+                                           (sinf(wx * 0.05f) +
+                                            cosf(wz * 0.037f)));
+      for (int32_t y = 0; y < n; y++) {
+        int32_t wy = pos.y * n + y;
+        voxel::Block b = voxel::air;
+        uint32_t h = hash3(wx / 4, wy / 4, wz / 4);
+        if (wy > top) {
+          b = voxel::air;
+        } else if (wy < top - 6 && (h & 15) == 0) {
+          b = voxel::air;  // A cave.
+        } else if (wy == top) {
+          b = grass;
+        } else if (wy > top - 4) {
+          b = dirt;
+        } else if ((hash3(wx, wy, wz) & 63) == 0) {
+          b = ore;
+        } else {
+          b = stone;
+        }
+        c.set(x, y, z, b);
+      }
+    }
+  }
+}
+
+// fillNoise fills c, the Chunk at pos, with noise: about half the voxels
+// are solid, with a random Block. This is the worst case for greedy meshing.
+void fillNoise(voxel::Chunk& c, const voxel::ChunkPos& pos) {
+  const int32_t n = voxel::Chunk::size;
+  for (uint32_t i = 0; i < voxel::Chunk::volume; i++) {
+    uint32_t h = hash3(pos.x * n * n + i, pos.y, pos.z);
+    c.setI(i, (h & 1) ? voxel::air : (voxel::Block)(1 + (h >> 1) % 4));
+  }
+}
+
+// generate creates a Chunk at each of todo, then calls fill on every Chunk
+// across all threads. World::at() is not thread-safe, so the chunks are all
+// created first.
+int generate(job::Scheduler& jobs, voxel::World& world,
+             const std::vector<voxel::ChunkPos>& todo,
+             std::function<void(voxel::Chunk&, const voxel::ChunkPos&)> fill) {
+  std::vector<voxel::Chunk*> chunks;
+  for (auto& pos : todo) {
+    chunks.emplace_back(&world.at(pos));
+  }
+  if (jobs.parallelFor(todo.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          fill(*chunks.at(i), todo.at(i));
+          chunks.at(i)->compact();
+        }
+        return 0;
+      })) {
+    return 1;
+  }
+  world.compact();  // Remove the chunks that are all air.
+  return 0;
+}
+
+bool sameMesh(const voxel::Mesh& a, const voxel::Mesh& b) {
+  return a.vertices.size() == b.vertices.size() &&
+         a.indices == b.indices &&
+         !memcmp(a.vertices.data(), b.vertices.data(),
+                 a.vertices.size() * sizeof(a.vertices[0]));
+}
+
+// check meshes every chunk in todo with path and with SIMD_SCALAR.
+// Returns false if any Mesh differs.
+bool check(const voxel::World& world, const std::vector<voxel::ChunkPos>& todo,
+           voxel::SimdPath path) {
+  voxel::Mesher mesher, scalar;
+  mesher.simd = path;
+  scalar.simd = voxel::SIMD_SCALAR;
+  voxel::Mesh mesh, want;
+  for (auto& pos : todo) {
+    mesher.mesh(world, pos, mesh);
+    scalar.mesh(world, pos, want);
+    if (!sameMesh(mesh, want)) {
+      fprintf(stderr, "%s differs from scalar at chunk %d, %d, %d\n",
+              voxel::simdPathName(path), pos.x, pos.y, pos.z);
+      return false;
+    }
+  }
+  return true;
+}
+
+// bench meshes every chunk in todo until at least 1 second has passed.
+// Returns chunks/sec.
+double bench(const char* name, const voxel::World& world,
+             const std::vector<voxel::ChunkPos>& todo, voxel::SimdPath path) {
+  voxel::Mesher mesher;
+  mesher.simd = path;
+  voxel::Mesh mesh;
+  size_t meshed = 0, quads = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  double seconds = 0;
+  while (seconds < 1.0) {
+    for (auto& pos : todo) {
+      mesher.mesh(world, pos, mesh);
+      quads += mesh.quads();
+      meshed++;
+    }
+    seconds = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::high_resolution_clock::now() - start)
+                  .count() /
+              1e6;
+  }
+  fprintf(stderr, "%s %6s: %zu chunks in %.3f s: %.0f chunks/sec\n", name,
+          voxel::simdPathName(path), meshed, seconds, meshed / seconds);
+  fprintf(stderr, "%s %6s: %.1f quads/chunk, %zu bytes of vertices/chunk\n",
+          name, voxel::simdPathName(path), quads / (double)meshed,
+          quads / meshed * 4 * sizeof(voxel::MeshVertex));
+  return meshed / seconds;
+}
+
+// benchParallel is bench() with every thread in jobs meshing chunks.
+double benchParallel(job::Scheduler& jobs, const char* name,
+                     const voxel::World& world,
+                     const std::vector<voxel::ChunkPos>& todo,
+                     voxel::SimdPath path) {
+  // Each thread gets its own Mesher and Mesh, indexed by threadIndex().
+  std::vector<voxel::Mesher> meshers(jobs.threadCount());
+  std::vector<voxel::Mesh> meshes(jobs.threadCount());
+  for (auto& mesher : meshers) {
+    mesher.simd = path;
+  }
+  size_t meshed = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  double seconds = 0;
+  while (seconds < 1.0) {
+    if (jobs.parallelFor(todo.size(), 4, [&](size_t begin, size_t end) {
+          size_t t = job::Scheduler::threadIndex();
+          for (size_t i = begin; i < end; i++) {
+            meshers.at(t).mesh(world, todo.at(i), meshes.at(t));
+          }
+          return 0;
+        })) {
+      return 0;
+    }
+    meshed += todo.size();
+    seconds = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::high_resolution_clock::now() - start)
+                  .count() /
+              1e6;
+  }
+  fprintf(stderr, "%s %6s: %zu chunks in %.3f s: %.0f chunks/sec",
+          name, voxel::simdPathName(path), meshed, seconds, meshed / seconds);
+  fprintf(stderr, ", %zu threads\n", jobs.threadCount());
+  return meshed / seconds;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char** argv) {
+  int32_t chunksXZ = 16, chunksY = 4, threads = 0;
+  if (argc == 3 || argc == 4) {
+    chunksXZ = atoi(argv[1]);
+    chunksY = atoi(argv[2]);
+    if (argc == 4) {
+      threads = atoi(argv[3]);
+    }
+  } else if (argc != 1) {
+    fprintf(stderr, "usage: %s [chunksXZ chunksY [threads]]\n", argv[0]);
+    return 1;
+  }
+  if (chunksXZ < 1 || chunksY < 1 || threads < 0) {
+    fprintf(stderr, "chunksXZ, chunksY must be positive, threads >= 0\n");
+    return 1;
+  }
+  job::Scheduler jobs;
+  if (jobs.ctorError(threads)) {
+    return 1;
+  }
+
+  std::vector<voxel::ChunkPos> todo, noiseTodo;
+  // Random chunks are slow to mesh. Use fewer of them.
+  const int32_t randomXZ = (chunksXZ + 3) / 4;
+  for (int32_t cx = 0; cx < chunksXZ; cx++) {
+    for (int32_t cz = 0; cz < chunksXZ; cz++) {
+      for (int32_t cy = 0; cy < chunksY; cy++) {
+        todo.emplace_back(voxel::ChunkPos{cx, cy, cz});
+        if (cx < randomXZ && cz < randomXZ) {
+          noiseTodo.emplace_back(voxel::ChunkPos{cx, cy, cz});
+        }
+      }
+    }
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  voxel::World world;
+  const int32_t height = chunksY * voxel::Chunk::size;
+  if (generate(jobs, world, todo,
+               [height](voxel::Chunk& c, const voxel::ChunkPos& pos) {
+                 fillTerrain(c, pos, height);
+               })) {
+    return 1;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::high_resolution_clock::now() - start)
+                     .count();
+  fprintf(stderr, "generate: %zu chunks in %lld ms, %.1f MiB, %zu threads\n",
+          world.chunks.size(), (long long)elapsed,
+          world.memoryUsage() / 1048576.0, jobs.threadCount());
+  voxel::World noise;
+  if (generate(jobs, noise, noiseTodo, fillNoise)) {
+    return 1;
+  }
+
+  // Run every SimdPath this CPU supports, from SIMD_SCALAR up.
+  const voxel::SimdPath best = voxel::bestSimdPath();
+  for (int p = voxel::SIMD_SCALAR; p <= best; p++) {
+    voxel::SimdPath path = (voxel::SimdPath)p;
+    if (!check(world, todo, path) || !check(noise, noiseTodo, path)) {
+      return 1;
+    }
+    bench("random ", noise, noiseTodo, path);
+    bench("terrain", world, todo, path);
+  }
+  double rate = benchParallel(jobs, "terrain", world, todo, best);
+  printf("%.0f\n", rate);
+  return rate > 0 ? 0 : 1;
+}
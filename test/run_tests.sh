@@ -0,0 +1,20 @@
+#!/bin/bash
+#
+# Runs every *_test executable that build.sh built. Run build.sh first.
+#
+# Copyright (c) David Hubbard 2017. Licensed under GPLv3.
+
+cd $( dirname $0 )/../out/Debug
+
+R=0
+for t in *_test; do
+  if [ ! -x "$t" ]; then
+    continue
+  fi
+  echo "===== $t"
+  if ! ./$t; then
+    echo "$t FAILED"
+    R=1
+  fi
+done
+exit $R